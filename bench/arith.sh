@@ -0,0 +1,62 @@
+#!/bin/sh
+# Arithmetic evaluations per second with $((...)) and let, and with expr(1)
+# Usage : bench/arith.sh [shell] [depth] [expression]
+
+SHELL_BIN=${1:-./mini_shell}
+DEPTH=${2:-5}
+EXPR=${3:-i * 3 + (i << 2) - i / 7}
+
+# 10^depth passes of nested for loops, body given as $1
+loop()
+{
+    body=$1
+    i=0
+    while [ "$i" -lt "$DEPTH" ]
+    do
+        body="for v$i in 0 1 2 3 4 5 6 7 8 9; do $body; done"
+        i=$((i + 1))
+    done
+    echo "i=7; $body"
+}
+
+# Milliseconds of a run of the shell over a script
+ms()
+{
+    start=$(date +%s%N)
+    "$1" -c "$2"
+    echo $(( ($(date +%s%N) - start) / 1000000 ))
+}
+
+n=1
+i=0
+while [ "$i" -lt "$DEPTH" ]
+do
+    n=$((n * 10))
+    i=$((i + 1))
+done
+
+echo "$n evaluations of '$EXPR'"
+for sh in "$SHELL_BIN" bash dash
+do
+    command -v "$sh" > /dev/null || continue
+    empty=$(ms "$sh" "$(loop :)")
+    total=$(ms "$sh" "$(loop ": \$(($EXPR))")")
+    [ "$total" -gt "$empty" ] || total=$((empty + 1))
+    echo "$sh \$((...)) : $total ms, $(( n * 1000 / (total - empty) )) evals/sec without the loop"
+    if [ "$sh" = "$SHELL_BIN" ] || [ "$sh" = bash ]
+    then
+        total=$(ms "$sh" "$(loop "let 'x = $EXPR'")")
+        [ "$total" -gt "$empty" ] || total=$((empty + 1))
+        echo "$sh let : $total ms, $(( n * 1000 / (total - empty) )) evals/sec without the loop"
+    fi
+done
+
+# A process per evaluation, over a thousandth of the count
+start=$(date +%s%N)
+i=0
+while [ "$i" -lt $((n / 1000 + 1)) ]
+do
+    expr 7 \* 3 + 7 / 7 > /dev/null
+    i=$((i + 1))
+done
+echo "expr : $(( (n / 1000 + 1) * 1000000000 / ($(date +%s%N) - start) )) evals/sec"
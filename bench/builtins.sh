@@ -0,0 +1,23 @@
+#!/bin/sh
+# Run a builtin-heavy script with builtins and with the same commands exec'd
+# Usage : bench/builtins.sh [shell] [nlines]
+
+SHELL_BIN=${1:-./mini_shell}
+NLINES=${2:-20000}
+
+for echo_cmd in echo /bin/echo
+do
+    awk -v n="$NLINES" -v echo_cmd="$echo_cmd" 'BEGIN {
+        for (i = 0; i < n; i++)
+        {
+            if (i % 2 == 0)
+                print echo_cmd " line " i " > /dev/null"
+            else
+                print echo_cmd " line " i " | cat > /dev/null"
+        }
+    }' > /tmp/msh_builtins.$$
+
+    echo "$echo_cmd : $NLINES lines"
+    "$SHELL_BIN" -r /tmp/msh_builtins.$$ 2>&1 | head -1
+done
+rm -f /tmp/msh_builtins.$$
@@ -0,0 +1,32 @@
+#!/bin/sh
+# Run an expansion-heavy script with mini_shell and with bash
+# Usage : bench/expand.sh [shell] [nlines]
+
+SHELL_BIN=${1:-./mini_shell}
+NLINES=${2:-20000}
+
+awk -v n="$NLINES" 'BEGIN {
+    print "A=alpha"
+    print "B=\"beta gamma\""
+    print "export C=delta"
+    for (i = 0; i < n; i++)
+    {
+        if (i % 2 == 0)
+            print "N" (i % 100) "=value" i "; echo $A ${B}x \"$C\" $N" (i % 100) " > /dev/null"
+        else
+            print "echo \"$A $B\" ${C}_$N" ((i - 1) % 100) " $HOME > /dev/null"
+    }
+}' > /tmp/msh_expand.$$
+
+echo "mini_shell : $NLINES lines"
+"$SHELL_BIN" -r /tmp/msh_expand.$$ 2>&1 | head -1
+
+if command -v bash > /dev/null
+then
+    echo "bash : $NLINES lines"
+    start=$(date +%s%N)
+    bash /tmp/msh_expand.$$
+    end=$(date +%s%N)
+    echo "$NLINES lines in $(( (end - start) / 1000000 )) ms"
+fi
+rm -f /tmp/msh_expand.$$
@@ -0,0 +1,27 @@
+#!/bin/sh
+# Send one producer to N consumers with |> and with tee(1) under bash
+# Usage : bench/fanout.sh [shell] [size] [nconsumers] [pipebuf]
+
+SHELL_BIN=${1:-./mini_shell}
+SIZE=${2:-4G}
+N=${3:-3}
+PIPEBUF=${4:-default}
+
+consumers=""
+tees=""
+i=1
+while [ "$i" -le "$N" ]
+do
+    consumers="$consumers${consumers:+, }wc -c"
+    [ "$i" -lt "$N" ] && tees="$tees >(wc -c >&2)"
+    i=$((i + 1))
+done
+
+echo "|> : $SIZE to $N consumers, pipebuf $PIPEBUF"
+printf '%s\n' "set pipebuf=$PIPEBUF" "time head -c $SIZE /dev/zero |> ($consumers)" | "$SHELL_BIN" 2>&1
+
+if command -v bash > /dev/null
+then
+    echo "tee : $SIZE to $N consumers"
+    bash -c "time (head -c $SIZE /dev/zero | tee $tees | wc -c; wait)" 2>&1
+fi
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Feed literal data to a command through an echo stage and through <<<
+# Usage : bench/heredoc.sh [shell] [nlines]
+
+SHELL_BIN=${1:-./mini_shell}
+NLINES=${2:-5000}
+
+for feed in pipe herestring
+do
+    awk -v n="$NLINES" -v feed="$feed" 'BEGIN {
+        for (i = 0; i < n; i++)
+        {
+            if (feed == "pipe")
+                print "/bin/echo line " i " | cat > /dev/null"
+            else
+                print "cat <<< \"line " i "\" > /dev/null"
+        }
+    }' > /tmp/msh_heredoc.$$
+
+    echo "$feed : $NLINES lines"
+    "$SHELL_BIN" -r /tmp/msh_heredoc.$$ 2>&1 | head -1
+done
+rm -f /tmp/msh_heredoc.$$
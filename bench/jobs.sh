@@ -0,0 +1,20 @@
+#!/bin/sh
+# Launch and reap background jobs through mini_shell
+# Usage : bench/jobs.sh [shell] [njobs]
+
+SHELL_BIN=${1:-./mini_shell}
+NJOBS=${2:-10000}
+
+i=0
+while [ $i -lt "$NJOBS" ]
+do
+    echo "/bin/true &"
+    i=$((i + 1))
+done > /tmp/msh_jobs.$$
+# Give the last children time to exit, then make the shell reap them
+echo "sleep 1" >> /tmp/msh_jobs.$$
+echo "jobs" >> /tmp/msh_jobs.$$
+
+echo "jobs : $NJOBS"
+"$SHELL_BIN" -r /tmp/msh_jobs.$$
+rm -f /tmp/msh_jobs.$$
@@ -0,0 +1,23 @@
+#!/bin/sh
+# Launch a pipeline of N cat stages, find the fewest open descriptors it runs with and time it
+# Usage : bench/long_pipeline.sh [shell] [nstages]
+
+SHELL_BIN=${1:-./mini_shell}
+N=${2:-1000}
+
+line=$(awk -v n="$N" 'BEGIN { s = "echo through"; for (i = 0; i < n; i++) s = s " | cat"; print s }')
+
+# The smallest RLIMIT_NOFILE under which the whole pipeline still works
+limit=4
+while [ "$limit" -le 64 ]
+do
+    out=$( (ulimit -n "$limit" && printf '%s\n' "$line" | "$SHELL_BIN") 2>/dev/null)
+    [ "$out" = "through" ] && break
+    limit=$((limit + 1))
+done
+echo "$N stages : runs with RLIMIT_NOFILE $limit"
+
+for run in 1 2 3
+do
+    printf '%s\n' "time $line" | "$SHELL_BIN" 2>&1 | grep real
+done
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Run a loop of builtins only, 10^depth iterations, in mini_shell, bash and dash
+# Usage : bench/loop.sh [shell] [depth] [body]
+
+SHELL_BIN=${1:-./mini_shell}
+DEPTH=${2:-6}
+BODY=${3:-:}
+
+# Nested for loops over ten words, so that no arithmetic is needed
+loop=$BODY
+i=0
+while [ "$i" -lt "$DEPTH" ]
+do
+    loop="for v$i in 0 1 2 3 4 5 6 7 8 9; do $loop; done"
+    i=$((i + 1))
+done
+
+echo "10^$DEPTH iterations of '$BODY'"
+for sh in "$SHELL_BIN" bash dash
+do
+    command -v "$sh" > /dev/null || continue
+    start=$(date +%s%N)
+    "$sh" -c "$loop"
+    echo "$sh : $(( ($(date +%s%N) - start) / 1000000 )) ms"
+done
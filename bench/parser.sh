@@ -0,0 +1,24 @@
+#!/bin/sh
+# Parse a large corpus without running it and report lines/sec
+# Usage : bench/parser.sh [shell] [nlines]
+
+SHELL_BIN=${1:-./mini_shell}
+NLINES=${2:-200000}
+
+awk -v n="$NLINES" 'BEGIN {
+    for (i = 0; i < n; i++)
+    {
+        if (i % 4 == 0)
+            print "grep -v \"pattern " i "\" file.txt | sort -k2 | uniq -c > out" i ".txt 2>&1"
+        else if (i % 4 == 1)
+            print "test -f /tmp/x" i " && echo '\''found it'\'' || echo missing\\ file ; true"
+        else if (i % 4 == 2)
+            print "cat < in.txt | tr a-z A-Z | cut -d: -f1,3 | head -n 10 >> log.txt &"
+        else
+            print "cc -O2 -Wall -o prog" i " main.c util.c io.c parse.c -lm -lpthread # build"
+    }
+}' > /tmp/msh_corpus.$$
+
+echo "lines : $NLINES"
+"$SHELL_BIN" -n -r /tmp/msh_corpus.$$
+rm -f /tmp/msh_corpus.$$
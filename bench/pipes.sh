@@ -0,0 +1,29 @@
+#!/bin/sh
+# Push a stream through 2 to 8 stage pipelines at several pipe buffer sizes
+# Usage : bench/pipes.sh [shell] [bytes]
+
+SHELL_BIN=${1:-./mini_shell}
+BYTES=${2:-2G}
+
+for size in default 256K 1M
+do
+    for stages in 2 4 8
+    do
+        # head | cat ... | wc, with stages processes in total
+        line="head -c $BYTES /dev/zero"
+        i=2
+        while [ $i -lt "$stages" ]
+        do
+            line="$line | cat"
+            i=$((i + 1))
+        done
+        line="$line | wc -c"
+
+        begin=$(date +%s.%N)
+        "$SHELL_BIN" -c "set pipebuf=$size
+$line" > /dev/null
+        end=$(date +%s.%N)
+        echo "$size $stages $BYTES $begin $end" |
+            awk '{ printf "pipebuf=%-8s stages=%d bytes=%s time=%.3f s\n", $1, $2, $3, $5 - $4 }'
+    done
+done
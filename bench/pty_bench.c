@@ -0,0 +1,486 @@
+/*
+ * Drive mini_shell through a pseudo-terminal and measure its own overhead.
+ * Every result is printed as one JSON object per line on stdout.
+ *
+ * Usage : pty_bench [shell]
+ */
+#define _GNU_SOURCE
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pty.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+
+#define MARKER "@@MSH@@"
+#define MAX_LINE 3000
+#define TIMEOUT_MS 120000
+#define HISTORY_ENTRIES 1000000
+#define DEFAULT_PROMPT "Shankar:"
+
+/* Output of the shell up to a prompt */
+typedef struct output
+{
+    char *buf;
+    size_t len;
+    size_t size;
+} output_t;
+
+/**** FUNCTION PROTOTYPES ***/
+pid_t start_shell(const char *shell, int *master);
+int send_line(int master, const char *line);
+int wait_prompt(int master, int count, output_t *out);
+int wait_text(int master, const char *text, int count, output_t *out);
+double now_us(void);
+int compare_double(const void *a, const void *b);
+void print_latency(const char *bench, const char *mode, double *latency, int count);
+void bench_startup(const char *shell, int iterations);
+void bench_prompt_latency(int master, int iterations);
+void bench_exec_throughput(int master, int commands);
+void bench_pipeline_bandwidth(int master, const char *bytes, int stages);
+void bench_background_jobs(int master, int njobs);
+void bench_jobs_refresh(int master, int njobs, int iterations);
+void send_repeated(int master, const char *command, int count);
+int fill_history(char *path, int nentries);
+void bench_history_search(int master, int nentries, int iterations);
+
+int main(int argc, char *argv[])
+{
+    int master;
+    pid_t cpid;
+    const char *shell = argc > 1 ? argv[1] : "./mini_shell";
+    char history[] = "/tmp/pty_bench_history.XXXXXX";
+
+    signal(SIGPIPE, SIG_IGN);
+
+    /* The shell gets its own history, already holding many entries */
+    if (fill_history(history, HISTORY_ENTRIES) == -1)
+        exit(1);
+    setenv("HISTFILE", history, 1);
+
+    /* Shells start bare, with no rc file */
+    setenv("MSH_RC", "", 1);
+    bench_startup(shell, 200);
+
+    if ((cpid = start_shell(shell, &master)) == -1)
+        exit(1);
+
+    /* First prompt, then a prompt that is easy to find */
+    if (wait_prompt(master, 0, NULL) == -1 || send_line(master, "PS1=" MARKER) == -1 ||
+        wait_prompt(master, 2, NULL) == -1)
+    {
+        fprintf(stderr, "pty_bench : %s : no prompt\n", shell);
+        kill(cpid, SIGKILL);
+        exit(1);
+    }
+
+    bench_prompt_latency(master, 1000);
+    bench_exec_throughput(master, 2000);
+    bench_pipeline_bandwidth(master, "1G", 2);
+    bench_pipeline_bandwidth(master, "1G", 4);
+    bench_background_jobs(master, 1000);
+    bench_background_jobs(master, 10000);
+    bench_jobs_refresh(master, 1000, 50);
+    bench_history_search(master, HISTORY_ENTRIES, 200);
+
+    /* exit hangs up the sleepers left by jobs_refresh */
+    send_line(master, "exit");
+    waitpid(cpid, NULL, 0);
+    unlink(history);
+    return 0;
+}
+
+/* Start the shell on the slave side of a new pseudo-terminal */
+pid_t start_shell(const char *shell, int *master)
+{
+    int slave;
+    pid_t cpid;
+    struct winsize size = {50, 200, 0, 0};
+
+    if (openpty(master, &slave, NULL, NULL, &size) == -1)
+    {
+        perror("openpty");
+        return -1;
+    }
+
+    switch (cpid = fork())
+    {
+        case -1:
+            perror("fork");
+            return -1;
+        case 0:
+            /* New session with the pty as controlling terminal */
+            close(*master);
+            setsid();
+            ioctl(slave, TIOCSCTTY, 0);
+            dup2(slave, 0);
+            dup2(slave, 1);
+            dup2(slave, 2);
+            if (slave > 2)
+                close(slave);
+            execl(shell, shell, (char *)NULL);
+            perror(shell);
+            _exit(127);
+        default:
+            close(slave);
+            return cpid;
+    }
+}
+
+/* Type a line into the terminal */
+int send_line(int master, const char *line)
+{
+    size_t len = strlen(line);
+    ssize_t nwritten;
+
+    while (len > 0)
+    {
+        if ((nwritten = write(master, line, len)) == -1)
+        {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        line += nwritten;
+        len -= nwritten;
+    }
+    return write(master, "\n", 1) == 1 ? 0 : -1;
+}
+
+/* Read until count prompts were shown, or the first output goes quiet when count is 0 */
+int wait_prompt(int master, int count, output_t *out)
+{
+    return wait_text(master, MARKER, count, out);
+}
+
+/*
+ * Read until text has been seen count times, or until the output goes
+ * quiet when count is 0. The output is kept when out is given.
+ */
+int wait_text(int master, const char *text, int count, output_t *out)
+{
+    char buf[65536];
+    char tail[256];
+    size_t text_len = strlen(text);
+    char *scan, *hit;
+    size_t ntail = 0, nscan;
+    ssize_t nread;
+    struct pollfd pfd = {master, POLLIN, 0};
+    int seen = 0;
+
+    if (out != NULL)
+        out->len = 0;
+
+    while (count == 0 || seen < count)
+    {
+        switch (poll(&pfd, 1, count == 0 ? 500 : TIMEOUT_MS))
+        {
+            case -1:
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            case 0:
+                return count == 0 ? 0 : -1;
+        }
+        if ((nread = read(master, buf + ntail, sizeof(buf) - ntail)) <= 0)
+            return -1;
+
+        /* Keep what was read for the caller */
+        if (out != NULL)
+        {
+            if (out->len + nread > out->size)
+            {
+                out->size = (out->len + nread) * 2;
+                out->buf = (char *)realloc(out->buf, out->size);
+            }
+            memcpy(out->buf + out->len, buf + ntail, nread);
+            out->len += nread;
+        }
+
+        /* Look for the marker, also across two reads */
+        memcpy(buf, tail, ntail);
+        nscan = ntail + nread;
+        for (scan = buf; (hit = memmem(scan, nscan - (scan - buf), text, text_len)) != NULL; scan = hit + text_len)
+            seen++;
+        ntail = nscan < text_len ? nscan : text_len;
+        if (scan > buf + nscan - ntail)
+            ntail = buf + nscan - scan;
+        memcpy(tail, buf + nscan - ntail, ntail);
+    }
+    return 0;
+}
+
+/* Monotonic time in microseconds */
+double now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1e6 + now.tv_nsec / 1e3;
+}
+
+/* Order of doubles for qsort */
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Print mean and percentiles of latencies in microseconds, sorting them */
+void print_latency(const char *bench, const char *mode, double *latency, int count)
+{
+    int idx;
+    double total = 0;
+
+    if (count == 0)
+        return;
+    for (idx = 0; idx < count; idx++)
+        total += latency[idx];
+    qsort(latency, count, sizeof(double), compare_double);
+    printf("{\"bench\": \"%s\", \"mode\": \"%s\", \"iterations\": %d, "
+           "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}\n",
+           bench, mode, count, total / count, latency[count / 2], latency[count * 99 / 100], latency[count - 1]);
+    fflush(stdout);
+}
+
+/* Time from starting the shell on a terminal to its first prompt, and the whole run of shell -c true */
+void bench_startup(const char *shell, int iterations)
+{
+    int idx, master;
+    pid_t cpid;
+    double begin;
+    double *latency = (double *)malloc(iterations * sizeof(double));
+
+    for (idx = 0; idx < iterations; idx++)
+    {
+        begin = now_us();
+        if ((cpid = start_shell(shell, &master)) == -1)
+            break;
+        if (wait_text(master, DEFAULT_PROMPT, 1, NULL) == -1)
+        {
+            kill(cpid, SIGKILL);
+            waitpid(cpid, NULL, 0);
+            close(master);
+            break;
+        }
+        latency[idx] = now_us() - begin;
+        send_line(master, "exit");
+        waitpid(cpid, NULL, 0);
+        close(master);
+    }
+    print_latency("startup", "first_prompt", latency, idx);
+
+    for (idx = 0; idx < iterations; idx++)
+    {
+        begin = now_us();
+        switch (cpid = fork())
+        {
+            case -1:
+                perror("fork");
+                break;
+            case 0:
+                execl(shell, shell, "-c", "/bin/true", (char *)NULL);
+                perror(shell);
+                _exit(127);
+            default:
+                waitpid(cpid, NULL, 0);
+                latency[idx] = now_us() - begin;
+                continue;
+        }
+        break;
+    }
+    print_latency("startup", "c_true", latency, idx);
+    free(latency);
+}
+
+/* Time from typing true to the next prompt */
+void bench_prompt_latency(int master, int iterations)
+{
+    int idx;
+    double begin, total = 0;
+    double *latency = (double *)malloc(iterations * sizeof(double));
+
+    for (idx = 0; idx < iterations; idx++)
+    {
+        begin = now_us();
+        send_line(master, "/bin/true");
+        if (wait_prompt(master, 1, NULL) == -1)
+            break;
+        latency[idx] = now_us() - begin;
+        total += latency[idx];
+    }
+    if (idx > 0)
+    {
+        qsort(latency, idx, sizeof(double), compare_double);
+        printf("{\"bench\": \"prompt_latency\", \"command\": \"/bin/true\", \"iterations\": %d, "
+               "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}\n",
+               idx, total / idx, latency[idx / 2], latency[idx * 99 / 100], latency[idx - 1]);
+    }
+    fflush(stdout);
+    free(latency);
+}
+
+/* Type count copies of a command, several per line, one prompt per line */
+void send_repeated(int master, const char *command, int count)
+{
+    char line[MAX_LINE + 64];
+    size_t len;
+
+    while (count > 0)
+    {
+        for (len = 0; count > 0 && len < MAX_LINE; count--)
+            len += sprintf(line + len, "%s", command);
+        send_line(master, line);
+        wait_prompt(master, 1, NULL);
+    }
+}
+
+/* External commands started and waited for per second */
+void bench_exec_throughput(int master, int commands)
+{
+    double begin = now_us();
+    double seconds;
+
+    send_repeated(master, "/bin/true; ", commands);
+    seconds = (now_us() - begin) / 1e6;
+    printf("{\"bench\": \"exec_throughput\", \"commands\": %d, \"seconds\": %.3f, \"commands_per_sec\": %.0f}\n",
+           commands, seconds, commands / seconds);
+    fflush(stdout);
+}
+
+/* Bytes per second through a pipeline of stages processes */
+void bench_pipeline_bandwidth(int master, const char *bytes, int stages)
+{
+    int idx;
+    char line[256];
+    double begin, seconds;
+    long size = strtol(bytes, NULL, 10) << (strchr(bytes, 'G') ? 30 : strchr(bytes, 'M') ? 20 : 0);
+
+    sprintf(line, "head -c %s /dev/zero", bytes);
+    for (idx = 2; idx < stages; idx++)
+        strcat(line, " | cat");
+    strcat(line, " | wc -c");
+
+    begin = now_us();
+    send_line(master, line);
+    wait_prompt(master, 1, NULL);
+    seconds = (now_us() - begin) / 1e6;
+    printf("{\"bench\": \"pipeline_bandwidth\", \"stages\": %d, \"bytes\": %ld, \"seconds\": %.3f, \"mb_per_sec\": %.1f}\n",
+           stages, size, seconds, size / seconds / (1 << 20));
+    fflush(stdout);
+}
+
+/* Launch background jobs, then ask jobs until all are reaped */
+void bench_background_jobs(int master, int njobs)
+{
+    double begin, launched, reaped;
+    output_t out = {NULL, 0, 0};
+
+    begin = now_us();
+    send_repeated(master, "/bin/true & ", njobs);
+    launched = now_us();
+
+    /* jobs prints a header as long as a job is left */
+    do
+    {
+        send_line(master, "jobs");
+        wait_prompt(master, 1, &out);
+    } while (memmem(out.buf, out.len, "PGID", 4) != NULL);
+    reaped = now_us();
+
+    printf("{\"bench\": \"background_jobs\", \"jobs\": %d, \"launch_seconds\": %.3f, \"reap_seconds\": %.3f, "
+           "\"jobs_per_sec\": %.0f}\n",
+           njobs, (launched - begin) / 1e6, (reaped - launched) / 1e6, njobs / ((reaped - begin) / 1e6));
+    fflush(stdout);
+    free(out.buf);
+}
+
+/* Time of jobs with njobs background jobs alive */
+void bench_jobs_refresh(int master, int njobs, int iterations)
+{
+    int idx;
+    double begin, total = 0;
+    output_t out = {NULL, 0, 0};
+
+    send_repeated(master, "sleep 300 & ", njobs);
+
+    for (idx = 0; idx < iterations; idx++)
+    {
+        begin = now_us();
+        send_line(master, "jobs");
+        if (wait_prompt(master, 1, &out) == -1)
+            break;
+        total += now_us() - begin;
+    }
+    printf("{\"bench\": \"jobs_refresh\", \"jobs\": %d, \"iterations\": %d, \"mean_us\": %.1f}\n",
+           njobs, idx, idx ? total / idx : 0.0);
+    fflush(stdout);
+    free(out.buf);
+}
+
+/* Make a history file of nentries numbered commands */
+int fill_history(char *path, int nentries)
+{
+    int fd, idx;
+    FILE *fp;
+
+    if ((fd = mkstemp(path)) == -1 || (fp = fdopen(fd, "w")) == NULL)
+    {
+        perror(path);
+        return -1;
+    }
+    for (idx = 0; idx < nentries; idx++)
+        fprintf(fp, "echo entry_%07d\n", idx);
+    fclose(fp);
+    return 0;
+}
+
+/* Time from each key of a Ctrl-R query to the search line shown, over nentries */
+void bench_history_search(int master, int nentries, int iterations)
+{
+    int idx, nkeys = 0;
+    size_t pos;
+    char query[32], shown[64];
+    double begin, total = 0;
+    double *latency = (double *)malloc(iterations * sizeof(query) * sizeof(double));
+
+    srand(1);
+    for (idx = 0; idx < iterations; idx++)
+    {
+        /* Random entries, so most queries end deep in the file */
+        sprintf(query, "entry_%07d", rand() % nentries);
+        if (write(master, "\022", 1) == -1 || wait_text(master, "`': ", 1, NULL) == -1)
+            break;
+        for (pos = 1; pos <= strlen(query); pos++)
+        {
+            sprintf(shown, "`%.*s': ", (int)pos, query);
+            begin = now_us();
+            if (write(master, query + pos - 1, 1) == -1 || wait_text(master, shown, 1, NULL) == -1)
+                break;
+            latency[nkeys] = now_us() - begin;
+            total += latency[nkeys++];
+        }
+
+        /* Ctrl-C leaves the search with an empty line */
+        if (write(master, "\003", 1) == -1 || wait_prompt(master, 1, NULL) == -1)
+            break;
+    }
+    if (nkeys > 0)
+    {
+        qsort(latency, nkeys, sizeof(double), compare_double);
+        printf("{\"bench\": \"history_search\", \"entries\": %d, \"queries\": %d, \"keys\": %d, "
+               "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, \"max_us\": %.1f}\n",
+               nentries, idx, nkeys, total / nkeys, latency[nkeys / 2], latency[nkeys * 99 / 100], latency[nkeys - 1]);
+    }
+    fflush(stdout);
+    free(latency);
+}
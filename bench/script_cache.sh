@@ -0,0 +1,44 @@
+#!/bin/sh
+# Parse a large script with -n, without the script cache, on a miss and on a hit
+# Usage : bench/script_cache.sh [shell] [nlines] [nruns]
+
+SHELL_BIN=${1:-./mini_shell}
+NLINES=${2:-100000}
+NRUNS=${3:-20}
+CACHE_DIR=/tmp/msh_cache.$$
+
+awk -v n="$NLINES" 'BEGIN {
+    for (i = 0; i < n; i++)
+    {
+        if (i % 4 == 0)
+            print "NAME_" i "=\"value " i "\" && export NAME_" i
+        else if (i % 4 == 1)
+            print "grep -v \"$NAME_" (i - 1) "\" < /etc/passwd | sort -r | head -5 > /dev/null 2>&1"
+        else if (i % 4 == 2)
+            print "true && echo \"line " i "\" > /dev/null || echo '"'"'failed'"'"' >> /tmp/none"
+        else
+            print "cat <<< \"${NAME_" (i - 3) "} here\" | wc -c > /dev/null"
+    }
+}' > /tmp/msh_script.$$
+
+# Wall time of nruns runs, from exec to exit
+wall()
+{
+    start=$(date +%s%N)
+    i=0
+    while [ "$i" -lt "$NRUNS" ]
+    do
+        "$SHELL_BIN" -n /tmp/msh_script.$$ 2> /dev/null
+        i=$((i + 1))
+    done
+    echo "$(( ($(date +%s%N) - start) / NRUNS / 1000 )) us per run"
+}
+
+echo "$NLINES lines, $(wc -c < /tmp/msh_script.$$) bytes"
+echo "off  : $(MSH_CACHE_DIR= "$SHELL_BIN" -n -r /tmp/msh_script.$$ 2>&1 | tail -1)"
+echo "miss : $(MSH_CACHE_DIR=$CACHE_DIR "$SHELL_BIN" -n -r /tmp/msh_script.$$ 2>&1 | tail -1)"
+echo "hit  : $(MSH_CACHE_DIR=$CACHE_DIR "$SHELL_BIN" -n -r /tmp/msh_script.$$ 2>&1 | tail -1)"
+echo "cache file : $(cat $CACHE_DIR/*.mshc | wc -c) bytes"
+echo "off  : $(MSH_CACHE_DIR= wall)"
+echo "hit  : $(MSH_CACHE_DIR=$CACHE_DIR wall)"
+rm -rf /tmp/msh_script.$$ $CACHE_DIR
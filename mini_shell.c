@@ -5,15 +5,76 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <string.h>
+#include <ctype.h>
 #include <signal.h>
 #include <termios.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/signalfd.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <sched.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <malloc.h>
+#include <fnmatch.h>
+#include <inttypes.h>
 
 #define MAX_PROMPT_LENGTH 500
-#define MAX_LEN 500
+#define READ_CHUNK 65536
 #define SET 1
 #define RESET 0
+#define MAX_CLOSE_FDS 4
+#define MAX_SAVED_FDS 16
+#define HASH_BUCKETS 256
+#define JOB_SLAB 256
+#define PID_BUCKETS 4096
+#define ARENA_MIN 256
+#define SCRATCH_SIZE 1024
+#define BUILTIN_BUCKETS 64
+#define FUNCTION_BUCKETS 64
+#define ARITH_BUCKETS 256
+#define ARITH_MAX 4096
+#define ARITH_DEPTH 32
+#define MAX_PROMPT_SEGMENTS 64
+#define VAR_MIN_SLOTS 64
+#define CACHE_MAGIC "MSHC"
+#define CACHE_VERSION 4
+#define TRACE_EVENTS 65536
+#define LATENCY_BUCKETS 40
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+#define VAR_SPLIT '\001'
+#define VAR_QUOTED '\002'
+#define VAR_END '\003'
+#define GLOB_CHARS "*?[]\\"
+#define NAME_CHARS "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789_"
+#define PROMPT_LINE_SIZE (MAX_PROMPT_LENGTH + PATH_MAX + 64)
+#define HISTORY_CAP (64L << 20)
+#define HISTORY_CHUNK 65536
+#define MAX_QUERY 256
+#define HIST_NONE ((size_t)-1)
+#define KEY_DELETE 256
+#define EDIT_MORE 0
+#define EDIT_DONE 1
+#define EDIT_EOF 2
+
+/* Record a trace event, only a test of the ring pointer when tracing is off */
+#define TRACE(kind, phase, pid, pgid, arg, detail) \
+    do { if (trace_ring != NULL) trace_event(kind, phase, pid, pgid, arg, detail); } while (0)
 
 /*** STRUCTURE TYPEDEF ***/
 typedef enum status
@@ -23,23 +84,235 @@ typedef enum status
 } group_status_t;
 
 
+/* Kinds of redirection */
+typedef enum redirect_type
+{
+    REDIR_IN,
+    REDIR_OUT,
+    REDIR_APPEND,
+    REDIR_DUP,
+    REDIR_CLOSE,
+    REDIR_HEREDOC,
+    REDIR_HERESTRING
+} redirect_type_t;
+
+/* Redirection of one file descriptor of a command, path is the delimiter of a here-document */
+typedef struct redirect
+{
+    redirect_type_t type;
+    int fd;
+    int dup_fd;
+    char *path;
+    int strip_tabs;
+    int expand;
+    char *body;
+    size_t body_len;
+    struct redirect *next;
+    struct redirect *here_link;
+} redirect_t;
+
+/*
+ * One command of a pipeline in the parse tree. Leading NAME=value words
+ * are kept apart in assigns. expand is set when a word holds variables,
+ * marked by the lexer to be looked up when the command runs. A compound
+ * command has no words, only its tree and redirections.
+ */
+typedef struct command
+{
+    int argc;
+    char **argv;
+    int nassigns;
+    char **assigns;
+    int expand;
+    redirect_t *redirects;
+    struct compound *compound;
+    struct command *next;
+} command_t;
+
+/* How a pipeline decides whether the next one runs */
+typedef enum connector
+{
+    CONN_SEQ,
+    CONN_AND,
+    CONN_OR
+} connector_t;
+
+/* I/O scheduling classes, numbered as the kernel does */
+typedef enum ioclass
+{
+    IOCLASS_NONE = 0,
+    IOCLASS_REALTIME,
+    IOCLASS_BEST_EFFORT,
+    IOCLASS_IDLE
+} ioclass_t;
+
+/* Where the processes of a job run, each part is optional */
+typedef struct placement
+{
+    int has_cpus;
+    int has_nice;
+    int nice;
+    ioclass_t ioclass;
+    int iolevel;
+    cpu_set_t cpus;
+} placement_t;
+
+/* Pipeline in the parse tree, a command line is a list of them */
+typedef struct pipeline
+{
+    int ncommands;
+    int background;
+    int timed;
+    placement_t *placement;
+    connector_t connector;
+    char *text;
+    command_t *commands;
+    int nbranches;
+    struct pipeline *branches;
+    struct pipeline *next;
+} pipeline_t;
+
+/* Kinds of compound commands, a function definition is one too */
+typedef enum compound_type
+{
+    COMPOUND_IF,
+    COMPOUND_WHILE,
+    COMPOUND_UNTIL,
+    COMPOUND_FOR,
+    COMPOUND_CASE,
+    COMPOUND_GROUP,
+    COMPOUND_FUNCTION
+} compound_type_t;
+
+/* Patterns of one case item and the list it runs */
+typedef struct case_item
+{
+    int npatterns;
+    char **patterns;
+    pipeline_t *body;
+    struct case_item *next;
+} case_item_t;
+
+/*
+ * Compound command, run by the shell on the parse tree itself. cond is
+ * the condition of if and of the loops, body the list they run and
+ * else_part the else of an if, an elif being an if alone in it. name is
+ * the variable of for, the word of case or the name of a function, and
+ * words the list for goes over, NULL for the positional parameters.
+ */
+typedef struct compound
+{
+    compound_type_t type;
+    pipeline_t *cond;
+    pipeline_t *body;
+    pipeline_t *else_part;
+    char *name;
+    int nwords;
+    char **words;
+    case_item_t *items;
+} compound_t;
+
+/* Tokens of the command line lexer */
+typedef enum token
+{
+    TOK_END,
+    TOK_WORD,
+    TOK_PIPE,
+    TOK_AND,
+    TOK_OR,
+    TOK_AMP,
+    TOK_SEMI,
+    TOK_REDIR,
+    TOK_FANOUT,
+    TOK_LPAREN,
+    TOK_RPAREN,
+    TOK_COMMA,
+    TOK_NEWLINE,
+    TOK_DSEMI,
+    TOK_ERROR
+} token_t;
+
+/* State of the lexer over one command line */
+typedef struct lexer
+{
+    const char *line;
+    size_t pos;
+    size_t token_start;
+    size_t prev_end;
+    token_t token;
+    char *word;
+    redirect_type_t redir_type;
+    int redir_fd;
+    int strip_tabs;
+    int quoted;
+    int literal;
+    int fanout;
+    int pattern;
+    int assign;
+    int expand;
+    int open;
+    struct redirect *heredocs;
+    struct redirect **heredoc_tail;
+    struct shell *sh;
+    struct arena *arena;
+} lexer_t;
+
 typedef struct process
 {
     pid_t pid;
     pid_t pgid;
     char *status;
     char *signal;
-    char *argv[5];
+    char **argv;
+    char **envp;
+    redirect_t *redirects;
+    int branch;
+    int nbranches;
+    int *fanout_fds;
+    struct compound *compound;
+    struct function *function;
+    struct rusage usage;
     struct process *proc_link;
+    struct process *prev_proc;
+    struct process *pid_link;
+    struct group *group;
 } process_t;
 
+/*
+ * Bump allocator for the strings parsed from one command line. The first
+ * block is sized from the line so it is normally the only one, and the
+ * whole arena is freed when the last job of the line is released. The
+ * scratch arena of a loop or a function call holds its parent, whose
+ * tree the commands it expands come from.
+ */
+typedef struct arena
+{
+    struct arena *next;
+    struct arena *parent;
+    int refs;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_t;
+
 typedef struct group
 {
+    int id;
     pid_t pgid;
     char status;
     int nprocess;
+    int nlive;
+    char *command;
+    struct rusage usage;
+    int placed;
+    placement_t placement;
+    arena_t *arena;
     struct process *proc_link;
+    struct process *proc_tail;
     struct group *group_link;
+    struct group *prev_group;
+    struct group *dead_link;
+    struct parallel_run *run;
 } group_t;
 
 typedef enum state
@@ -51,1016 +324,8254 @@ typedef enum state
     SIGNALLED
 } stat_t;
 
+/* Remembered location of a command found in $PATH */
+typedef struct hash_entry
+{
+    char *name;
+    char *path;
+    struct timespec dir_mtime;
+    unsigned long hits;
+    struct hash_entry *next;
+} hash_entry_t;
+
+/*
+ * Groups and processes are handed out from slabs through free lists, and
+ * live processes are indexed by pid so a reaped child is found in O(1).
+ * A group id is its slot in the table and stays the same while it lives.
+ */
+typedef struct job_table
+{
+    int ngroups;
+    group_t *free_groups;
+    process_t *free_processes;
+    group_t *dead_groups;
+    process_t *pid_index[PID_BUCKETS];
+} job_table_t;
+
+/* How pipeline stages are started */
+typedef enum launch_mode
+{
+    LAUNCH_SPAWN,
+    LAUNCH_FORK
+} launch_mode_t;
+
+/* Shell variable, a slot with a NULL value is unset and kept for the same name */
+typedef struct variable
+{
+    char *name;
+    char *value;
+    unsigned int hash;
+    int exported;
+} variable_t;
+
+/* Value hidden by a local, put back when its scope ends */
+typedef struct saved_var
+{
+    char *name;
+    char *value;
+    int exported;
+    int depth;
+    struct saved_var *next;
+} saved_var_t;
+
+/* Open addressing table of variables, with the environment of children built from it */
+typedef struct var_table
+{
+    variable_t *slots;
+    size_t nslots;
+    size_t nused;
+    int depth;
+    saved_var_t *saved;
+    char **environ;
+    int environ_dirty;
+} var_table_t;
+
+/* What break, continue, return or an interrupted job asks of the commands around them */
+typedef enum control
+{
+    CTRL_NONE,
+    CTRL_BREAK,
+    CTRL_CONTINUE,
+    CTRL_RETURN,
+    CTRL_INTERRUPT
+} control_t;
+
+/* Shell function, its body stays in the arena of the line that defined it */
+typedef struct function
+{
+    char *name;
+    pipeline_t *body;
+    arena_t *arena;
+    struct function *next;
+} function_t;
+
+/* Operators of arithmetic expressions, the nodes of their trees */
+typedef enum arith_op
+{
+    ARITH_NUM,
+    ARITH_VAR,
+    ARITH_NEG,
+    ARITH_PLUS,
+    ARITH_NOT,
+    ARITH_BITNOT,
+    ARITH_PREINC,
+    ARITH_PREDEC,
+    ARITH_POSTINC,
+    ARITH_POSTDEC,
+    ARITH_POW,
+    ARITH_MUL,
+    ARITH_DIV,
+    ARITH_MOD,
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_SHL,
+    ARITH_SHR,
+    ARITH_LT,
+    ARITH_LE,
+    ARITH_GT,
+    ARITH_GE,
+    ARITH_EQ,
+    ARITH_NE,
+    ARITH_AND,
+    ARITH_XOR,
+    ARITH_OR,
+    ARITH_LAND,
+    ARITH_LOR,
+    ARITH_COND,
+    ARITH_ASSIGN,
+    ARITH_COMMA
+} arith_op_t;
+
+/*
+ * Node of a parsed expression. A variable keeps the hash of its name so
+ * that it is looked up without hashing again. An assignment has its
+ * operator, ARITH_ASSIGN for plain =, in assign_op.
+ */
+typedef struct arith_node
+{
+    arith_op_t op;
+    arith_op_t assign_op;
+    int64_t value;
+    const char *name;
+    size_t name_len;
+    unsigned int hash;
+    struct arith_node *left;
+    struct arith_node *right;
+    struct arith_node *third;
+} arith_node_t;
+
+/* Binary operator of the precedence table, a higher prec binds tighter */
+typedef struct arith_binary
+{
+    const char *text;
+    arith_op_t op;
+    int prec;
+} arith_binary_t;
+
+/* Parsed expression in the cache, keyed by its text */
+typedef struct arith_expr
+{
+    char *text;
+    size_t len;
+    unsigned int hash;
+    arith_node_t *root;
+    struct arith_expr *next;
+} arith_expr_t;
+
+/* Position in the text of an expression being parsed */
+typedef struct arith_parser
+{
+    const char *text;
+    size_t pos;
+    size_t len;
+    const char *error;
+    struct arena *arena;
+} arith_parser_t;
+
+/*
+ * State of the shell that builtins can see and change. params are the
+ * positional parameters, of the script or of the function running.
+ * control is set by break, continue and return for the loops and
+ * functions around them, control_levels counts the loops still to leave.
+ */
+typedef struct shell
+{
+    group_t *session_leader;
+    int terminal;
+    pid_t shell_pid;
+    pid_t job_pgid;
+    int exit_status;
+    char cwd[PATH_MAX];
+    double startup;
+    int exec_last;
+    int nparams;
+    char **params;
+    int loop_depth;
+    int function_depth;
+    control_t control;
+    int control_levels;
+    struct line_reader *input;
+    struct line_editor *editor;
+    int event_fd;
+} shell_t;
+
+/* What a piece of the compiled prompt shows */
+typedef enum prompt_item
+{
+    PROMPT_TEXT,
+    PROMPT_CWD,
+    PROMPT_TIME,
+    PROMPT_STATUS
+} prompt_item_t;
+
+/* Text segments are a range of prompt_text, the others are filled in when shown */
+typedef struct prompt_segment
+{
+    prompt_item_t item;
+    size_t start;
+    size_t len;
+} prompt_segment_t;
+
+/* A builtin gets the words of its command and returns its exit status */
+typedef struct builtin
+{
+    char *name;
+    int (*run)(int argc, char *argv[], shell_t *sh);
+} builtin_t;
+
+/* Buffered line reader for terminal, script, pipe and -c input, dev and ino tell which file fd was when it started */
+typedef struct line_reader
+{
+    int fd;
+    dev_t dev;
+    ino_t ino;
+    char *buf;
+    size_t size;
+    size_t start;
+    size_t scan;
+    size_t end;
+    int eof;
+} line_reader_t;
+
+/*
+ * A run of parallel : the items it has left, its jobs running in slots
+ * and what it has seen of them. A background run holds copies of its
+ * words and items and of the descriptors its jobs get, as the line and
+ * the redirections it came with are gone once it returns.
+ */
+typedef struct parallel_run
+{
+    int background;
+    int njobs;
+    int nwords;
+    char **words;
+    char **items;
+    line_reader_t *reader;
+    line_reader_t own_reader;
+    int null_stdin;
+    int fds[3];
+    int running;
+    int failed;
+    int stop;
+    unsigned long ntotal;
+    unsigned long nitems;
+    unsigned long ndone;
+    unsigned long nlatency;
+    double *latency;
+    struct timespec begin;
+    struct timespec *started;
+    struct group **slots;
+    struct arena *arena;
+    shell_t *sh;
+    struct parallel_run *next;
+} parallel_run_t;
+
+/* Latencies in buckets of powers of two nanoseconds, bucket b holds [2^(b-1), 2^b) */
+typedef struct latency_hist
+{
+    unsigned long count;
+    uint64_t total_ns;
+    unsigned long buckets[LATENCY_BUCKETS];
+} latency_hist_t;
+
+/* Counters of the hot paths, kept all the time and shown by stats */
+typedef struct shell_stats
+{
+    unsigned long parsed;
+    unsigned long started;
+    unsigned long exec_failures;
+    unsigned long waits;
+    unsigned long jobs_created;
+    unsigned long jobs_reaped;
+    size_t arena_bytes;
+    latency_hist_t parse;
+    latency_hist_t fork_exec;
+    latency_hist_t prompt;
+} shell_stats_t;
+
+/* What a trace event records, named as in trace_names */
+typedef enum trace_kind
+{
+    TRACE_PARSE,
+    TRACE_LAUNCH,
+    TRACE_SPAWN,
+    TRACE_FORK,
+    TRACE_CHILD,
+    TRACE_EXEC,
+    TRACE_EXEC_FAILED,
+    TRACE_BUILTIN,
+    TRACE_WAIT,
+    TRACE_TERMINAL,
+    TRACE_STOP,
+    TRACE_CONTINUE,
+    TRACE_EXIT
+} trace_kind_t;
+
+/* One event of the trace ring, 64 bytes. The slot holds event number seq - 1 while seq is not 0 */
+typedef struct trace_event
+{
+    uint64_t seq;
+    uint64_t ns;
+    int32_t pid;
+    int32_t pgid;
+    int32_t arg;
+    uint8_t kind;
+    char phase;
+    char detail[34];
+} trace_event_t;
+
+/*
+ * Ring of trace events in memory shared with forked children, which add
+ * their own. A writer takes a number with an atomic add on head and
+ * publishes its slot through seq, a reader copies a slot and keeps it only
+ * if seq was the same before and after. The oldest events are overwritten.
+ */
+typedef struct trace_ring
+{
+    uint64_t head;
+    uint64_t mask;
+    pid_t owner;
+    char path[PATH_MAX];
+    trace_event_t events[];
+} trace_ring_t;
+
+/* Kinds of line records in a script cache */
+typedef enum cache_line
+{
+    CACHE_PROMPT = 1,
+    CACHE_LIST
+} cache_line_t;
+
+/*
+ * Header of a script cache file, the path of the script and the line
+ * records follow. Numbers in records are varints and strings are their
+ * length plus one (0 for NULL), their bytes and a NUL.
+ */
+typedef struct cache_header
+{
+    char magic[4];
+    uint32_t version;
+    uint32_t layout;
+    uint32_t path_len;
+    uint64_t mtime_sec;
+    uint64_t mtime_nsec;
+    uint64_t size;
+    uint64_t hash;
+    uint64_t records_hash;
+    uint64_t records_len;
+} cache_header_t;
+
+/*
+ * Parsed form of a script, mapped from its cache file on a hit or
+ * recorded line by line on a miss and written when the shell exits.
+ * Strings of a mapped cache are used in place.
+ */
+typedef struct script_cache
+{
+    char *path;
+    char *script;
+    cache_header_t header;
+    int compiling;
+    pid_t owner;
+    struct shell *sh;
+    char *buf;
+    size_t start;
+    size_t len;
+    size_t size;
+    const char *map;
+    size_t pos;
+    size_t end;
+    double parse_seconds;
+} script_cache_t;
+
+/*
+ * History file, only ever appended to and mapped for reading. offsets[i]
+ * is where entry i starts and offsets[nentries] is the end of the last
+ * complete entry. The index is built on first use, not at startup.
+ */
+typedef struct history
+{
+    int fd;
+    char *path;
+    dev_t dev;
+    ino_t ino;
+    char *map;
+    size_t map_size;
+    size_t *offsets;
+    size_t nentries;
+    size_t offsets_size;
+    long cap;
+    int compacting;
+} history_t;
+
+/* Line being edited on the terminal */
+typedef struct line_editor
+{
+    int fd;
+    struct termios cooked;
+    char *buf;
+    size_t len;
+    size_t size;
+    size_t cursor;
+    char prompt[PROMPT_LINE_SIZE];
+    size_t prompt_len;
+    size_t prompt_last;
+    size_t hist_pos;
+    char *saved;
+    size_t saved_len;
+    size_t saved_size;
+    int searching;
+    int search_failed;
+    char query[MAX_QUERY];
+    size_t query_len;
+    size_t match;
+    int esc;
+    int esc_arg;
+} line_editor_t;
+
 /**** FUNCTION PROTOTYPES ***/
 void initialize_msh(void);
-void display_prompt(int prompt_pwd);
-void change_prompt(char *new_prompt);
-void command_parser(char *cmd, group_t **session_leader);
-int change_dir(char *cmd);
-int is_exit(char *cmd, group_t *session_leader);
-int is_ps1(char * cmd, int *prompt_pwd);
-int is_jobs(char *cmd, group_t **session_leader);
-int is_fg(char *cmd, int terminal, group_t **session_leader, pid_t shell_pid, int *exit_status);
+void source_file(const char *path, shell_t *sh);
+void source_rc(shell_t *sh);
+void exec_command(command_t *command, placement_t *placement, struct arena *arena, shell_t *sh);
+size_t render_prompt(shell_t *sh, char *line, size_t size);
+void compile_prompt(const char *ps, int show_cwd);
+void add_prompt_segment(prompt_item_t item, const char *text, size_t len);
+int command_parser(char *cmd, struct arena *arena, pipeline_t **list, shell_t *sh);
+int parse_list(lexer_t *lex, pipeline_t **list);
+void skip_newlines(lexer_t *lex);
+int is_reserved(lexer_t *lex, const char *word);
+int list_ends(lexer_t *lex);
+int compound_start(lexer_t *lex);
+int word_push(int count, char *word);
+char **word_copy(int count, struct arena *arena);
+token_t next_token(lexer_t *lex);
+int lex_more(lexer_t *lex);
+int lex_word(lexer_t *lex);
+long mark_variable(const char *src, char *dst, size_t *len, int quoted);
+command_t *expand_pipeline(pipeline_t *pl, struct arena *arena, shell_t *sh);
+command_t *expand_command(command_t *command, struct arena *arena, shell_t *sh);
+char *expand_word(const char *word, struct arena *arena, shell_t *sh);
+char *expand_pattern(const char *word, struct arena *arena, shell_t *sh);
+void split_word(const char *word, size_t *nfields, struct arena *arena, shell_t *sh);
+void field_add(size_t *len, const char *str, size_t n);
+char *field_take(size_t *len, struct arena *arena);
+void field_push(size_t *nfields, char *field);
+const char *variable_value(const char *name, size_t len, shell_t *sh);
+long arith_span(const char *text);
+const char *arith_expand(const char *text, size_t len, shell_t *sh);
+int arith_eval(const char *text, size_t len, int64_t *result, shell_t *sh);
+arith_node_t *arith_parse(const char *text, size_t len, const char **error);
+arith_node_t *arith_expr(arith_parser_t *parser, int min_prec);
+arith_node_t *arith_unary(arith_parser_t *parser);
+arith_node_t *arith_node(arith_parser_t *parser, arith_op_t op, arith_node_t *left, arith_node_t *right);
+arith_node_t *arith_variable(arith_parser_t *parser);
+void arith_blanks(arith_parser_t *parser);
+int arith_number(const char *text, size_t len, int64_t *value);
+int64_t arith_run(arith_node_t *node, shell_t *sh);
+int64_t arith_fetch(arith_node_t *node, shell_t *sh);
+void arith_store(arith_node_t *node, int64_t value);
+int64_t arith_binop(arith_op_t op, int64_t left, int64_t right);
+char **command_env(command_t *command, struct arena *arena);
+int valid_name(const char *name, size_t len);
+unsigned int hash_name(const char *name, size_t len);
+variable_t *var_slot(const char *name, size_t len, unsigned int hash);
+const char *var_get(const char *name);
+const char *var_get_len(const char *name, size_t len);
+void var_set(const char *name, size_t len, const char *value, int exported);
+void var_unset(const char *name, size_t len);
+void var_grow(void);
+void var_import(char **envp);
+char **var_environ(void);
+void var_push_scope(void);
+void var_pop_scope(void);
+int var_local(const char *name, size_t len, const char *value, int exported);
+void assign_variables(command_t *command, int temporary);
+int builtin_export(int argc, char *argv[], shell_t *sh);
+int builtin_unset(int argc, char *argv[], shell_t *sh);
+int builtin_local(int argc, char *argv[], shell_t *sh);
+int compare_string(const void *a, const void *b);
+pipeline_t *parse_pipeline(lexer_t *lex);
+command_t *parse_command(lexer_t *lex);
+redirect_t *parse_redirect(lexer_t *lex, command_t *command);
+compound_t *parse_compound(lexer_t *lex);
+int parse_if(lexer_t *lex, compound_t *compound);
+int parse_part(lexer_t *lex, pipeline_t **list, const char *end);
+pipeline_t *compound_pipeline(compound_t *compound, struct arena *arena);
+command_t *parse_function(lexer_t *lex, command_t *command, char *name);
+void syntax_error(lexer_t *lex);
+void run_list(pipeline_t *list, struct arena *arena, shell_t *sh);
+int run_compound(compound_t *compound, struct arena *arena, shell_t *sh);
+int loop_continues(shell_t *sh);
+void init_builtins(void);
+builtin_t *find_builtin(const char *name);
+function_t *find_function(const char *name);
+void define_function(const char *name, pipeline_t *body, struct arena *arena);
+int remove_function(const char *name);
+int call_function(function_t *function, int argc, char *argv[], shell_t *sh);
+int run_in_shell(command_t *command, builtin_t *builtin, function_t *function, struct arena *arena, shell_t *sh);
+int apply_redirects(redirect_t *redir);
+int here_document_fd(redirect_t *redir);
+void read_heredocs(lexer_t *lex);
+int redirect_flags(redirect_type_t type);
+int builtin_cd(int argc, char *argv[], shell_t *sh);
+int builtin_exit(int argc, char *argv[], shell_t *sh);
+void hangup_jobs(group_t *session_leader);
+int is_ps1(char *cmd);
+int builtin_jobs(int argc, char *argv[], shell_t *sh);
+int builtin_fg(int argc, char *argv[], shell_t *sh);
 int is_null_input(char *cmd);
-int is_echo(char *cmd, int exit_status);
-process_t *insert_process(process_t **process_leader);
+int builtin_echo(int argc, char *argv[], shell_t *sh);
+int builtin_true(int argc, char *argv[], shell_t *sh);
+int builtin_false(int argc, char *argv[], shell_t *sh);
+int builtin_break(int argc, char *argv[], shell_t *sh);
+int builtin_continue(int argc, char *argv[], shell_t *sh);
+int loop_control(int argc, char *argv[], shell_t *sh, control_t control);
+int builtin_return(int argc, char *argv[], shell_t *sh);
+int builtin_shift(int argc, char *argv[], shell_t *sh);
+int builtin_let(int argc, char *argv[], shell_t *sh);
+int builtin_set(int argc, char *argv[], shell_t *sh);
+long parse_size(const char *str);
+long pipe_max_size(void);
+int launch_group(group_t *group, shell_t *sh);
+void abort_launch(group_t *group, shell_t *sh);
+pid_t spawn_process(process_t *process, char *path, pid_t pgid, int in_fd, int out_fd, int *close_fds, int nclose, char *envp[]);
+pid_t fork_process(process_t *process, char *path, builtin_t *builtin, pid_t pgid, int in_fd, int out_fd, int *close_fds, int nclose, shell_t *sh);
+int fan_out(int *fds, int nbranches);
+int set_placement(placement_t *place, const char *option, const char *value);
+int parse_cpus(const char *list, cpu_set_t *cpus);
+void merge_placement(placement_t *place, placement_t *change);
+char *format_placement(placement_t *place, char *buf, size_t size);
+int place_task(pid_t tid, placement_t *place);
+int place_process(pid_t pid, placement_t *place);
+group_t *find_job(group_t *session_leader, const char *spec);
+int place_jobs(int nspecs, char *specs[], placement_t *change, shell_t *sh);
+int builtin_renice(int argc, char *argv[], shell_t *sh);
+int builtin_pin(int argc, char *argv[], shell_t *sh);
+process_t *add_processes(group_t *group, command_t *commands, struct arena *arena);
+unsigned int hash_string(const char *str);
+char *find_in_path(const char *name, struct timespec *dir_mtime);
+char *hash_lookup(const char *name, int *hashed);
+void hash_forget(void);
+int builtin_hash(int argc, char *argv[], shell_t *sh);
+int builtin_type(int argc, char *argv[], shell_t *sh);
+int builtin_parallel(int argc, char *argv[], shell_t *sh);
+int builtin_parallel_bg(int argc, char *argv[], shell_t *sh);
+parallel_run_t *new_run(int argc, char *argv[], int background, shell_t *sh);
+void fill_run(parallel_run_t *run);
+void schedule_runs(void);
+void finish_runs(shell_t *sh);
+void item_done(group_t *group, int status);
+void item_stopped(process_t *process, int status);
+void report_run(parallel_run_t *run);
+void print_runs(void);
+void free_run(parallel_run_t *run);
+group_t *launch_item(parallel_run_t *run, char *item);
+char *substitute_item(arena_t *arena, const char *word, const char *item);
+int compare_double(const void *a, const void *b);
+process_t *insert_process(group_t *group);
 group_t *insert_group(group_t **session_leader);
+void index_process(process_t *process);
+arena_t *arena_create(size_t size);
+arena_t *arena_child(arena_t *parent);
+arena_t *arena_reuse(arena_t *scratch);
+void *arena_alloc(arena_t *arena, size_t size);
+char *arena_strdup(arena_t *arena, const char *str);
+void arena_rewind(arena_t *arena, arena_t *block, size_t used);
+void arena_release(arena_t *arena);
 void ignore_foreground_signals(int signum);
 process_t *release_process_resource(group_t *group, process_t *process);
-process_t *release_group_resource(group_t **session_leader);
+void release_group_resource(group_t **session_leader);
 void print_resource_for_my_shell(group_t *session);
 void fg(int terminal, group_t **session_leader, pid_t shell_pid, int *exit_status);
 void jobs(group_t **session_leader);
-void wait_for_fg(group_t **session_leader, int *exit_status);
+void wait_for_fg(group_t **session_leader, int *exit_status, struct rusage *usage);
 void update_status_of_bg(group_t **session_leader);
+process_t *find_process(pid_t pid);
+group_t *record_status(group_t *session_leader, pid_t pid, int status, struct rusage *usage);
+void finish_process(group_t *group, process_t *process);
+void unindex_process(process_t *process);
+void add_usage(struct rusage *total, struct rusage *usage);
+void print_times(double real, struct rusage *usage);
+int group_running(group_t *group);
+char *stop_signal_name(int signum);
+void notify_job(group_t *session_leader, group_t *group, char *state);
+void queue_notice(const char *text);
+void print_job_notices(void);
+int wait_for_input(int event_fd, group_t **session_leader);
+void editor_init(line_editor_t *editor, int fd);
+char *next_line(shell_t *sh, const char *prompt);
+char *edit_line(line_editor_t *editor, shell_t *sh, const char *prompt);
+int editor_key(line_editor_t *editor, int key);
+void editor_insert(line_editor_t *editor, char c);
+void editor_delete(line_editor_t *editor, size_t from, size_t to);
+void editor_set(line_editor_t *editor, const char *text, size_t len);
+void editor_save(line_editor_t *editor);
+void editor_refresh(line_editor_t *editor);
+void editor_history(line_editor_t *editor, int older);
+void editor_search(line_editor_t *editor, size_t below);
+size_t char_start(const char *buf, size_t pos);
+void history_open(history_t *hist);
+int history_reopen(history_t *hist);
+int history_sync(history_t *hist);
+void history_add(history_t *hist, const char *line);
+long history_search(history_t *hist, const char *query, size_t len, size_t below);
+const char *history_entry(history_t *hist, size_t idx, size_t *len);
+void history_compact(history_t *hist);
+int builtin_history(int argc, char *argv[], shell_t *sh);
+void reader_init_fd(line_reader_t *reader, int fd);
+void reader_init_string(line_reader_t *reader, const char *str);
+char *read_line(line_reader_t *reader);
+double elapsed_seconds(struct timespec *begin);
+void report_throughput(unsigned long ncommands, double seconds);
+void report_parse(double startup);
+uint64_t hash_bytes(const void *data, size_t len);
+void cache_open(script_cache_t *cache, const char *script, shell_t *sh);
+int cache_map(script_cache_t *cache);
+void cache_put(script_cache_t *cache, const void *data, size_t len);
+void cache_put_num(script_cache_t *cache, uint32_t value);
+void cache_put_str(script_cache_t *cache, const char *str, size_t len);
+void cache_put_line(script_cache_t *cache, pipeline_t *list, size_t line_len);
+void cache_put_prompt(script_cache_t *cache, const char *cmd);
+void cache_put_list(script_cache_t *cache, pipeline_t *list);
+void cache_put_pipeline(script_cache_t *cache, pipeline_t *pl);
+void cache_put_command(script_cache_t *cache, command_t *command);
+void cache_put_words(script_cache_t *cache, int count, char **words);
+void cache_put_compound(script_cache_t *cache, compound_t *compound);
+uint32_t cache_get_num(script_cache_t *cache);
+char *cache_get_str(script_cache_t *cache, size_t *len);
+arena_t *cache_next_line(script_cache_t *cache, char **cmd, pipeline_t **list);
+pipeline_t *cache_get_list(script_cache_t *cache, arena_t *arena);
+pipeline_t *cache_get_pipeline(script_cache_t *cache, arena_t *arena);
+command_t *cache_get_command(script_cache_t *cache, arena_t *arena);
+char **cache_get_words(script_cache_t *cache, int count, arena_t *arena);
+compound_t *cache_get_compound(script_cache_t *cache, arena_t *arena);
+void cache_finish(void);
+void report_allocations(unsigned long ncommands);
+uint64_t elapsed_ns(struct timespec *begin);
+void hist_record(latency_hist_t *hist, uint64_t ns);
+char *format_ns(char *buf, size_t size, uint64_t ns);
+void print_hist(const char *name, latency_hist_t *hist, int json);
+int builtin_stats(int argc, char *argv[], shell_t *sh);
+int trace_start(const char *path);
+void trace_stop(void);
+void trace_event(trace_kind_t kind, char phase, pid_t pid, pid_t pgid, int arg, const char *detail);
+int trace_flush(void);
+void json_string(FILE *out, const char *str);
 
 /**** GLOBAL VARIABLES ****/
 pid_t shell_pid;
-static char prompt[MAX_PROMPT_LENGTH] = "\033[32;1mShankar:\033[0m";
-static char path[200];
-static char *stat[] = {"exited", "stopped", "running", "killed", "signalled"};
+static char prompt_text[MAX_PROMPT_LENGTH];
+static size_t prompt_text_len;
+static prompt_segment_t prompt_segments[MAX_PROMPT_SEGMENTS];
+static int nprompt_segments;
+static char *proc_stat[] = {"exited", "stopped", "running", "killed", "signalled"};
 static char *sig[] = {"", "SIGSTOP", "SIGTSTP", "SIGTTIN", "SIGTTOU"};
+static char *launch_modes[] = {"spawn", "fork"};
+static char *ioclass_names[] = {"none", "realtime", "best-effort", "idle"};
+static launch_mode_t launch_mode = LAUNCH_SPAWN;
+static long pipe_size;
+static hash_entry_t *hash_table[HASH_BUCKETS];
+static job_table_t job_table;
+static unsigned long nallocs;
+static char *hashed_path_var;
+static int sigchld_fd = -1;
+static int report_jobs;
+static char *job_notices;
+static size_t notices_len, notices_size;
+static char *word_buf;
+static size_t word_size;
+static char *text_buf;
+static size_t text_size;
+static char *params_buf;
+static size_t params_size;
+static char **word_vec;
+static int vec_size;
+static char *body_buf;
+static size_t body_size;
+static char *field_buf;
+static size_t field_size;
+static char **field_vec;
+static size_t field_vec_size;
+static int expand_failed;
+static arith_expr_t *arith_table[ARITH_BUCKETS];
+static int narith;
+static struct arena *arith_arena;
+static const char *arith_error;
+static int arith_depth;
+static arith_binary_t arith_binaries[] = {
+    {"<<=", ARITH_SHL, 2}, {">>=", ARITH_SHR, 2},
+    {"**", ARITH_POW, 14}, {"*=", ARITH_MUL, 2}, {"/=", ARITH_DIV, 2}, {"%=", ARITH_MOD, 2},
+    {"+=", ARITH_ADD, 2}, {"-=", ARITH_SUB, 2}, {"&=", ARITH_AND, 2}, {"^=", ARITH_XOR, 2},
+    {"|=", ARITH_OR, 2}, {"<<", ARITH_SHL, 11}, {">>", ARITH_SHR, 11}, {"<=", ARITH_LE, 10},
+    {">=", ARITH_GE, 10}, {"==", ARITH_EQ, 9}, {"!=", ARITH_NE, 9}, {"&&", ARITH_LAND, 5},
+    {"||", ARITH_LOR, 4}, {"*", ARITH_MUL, 13}, {"/", ARITH_DIV, 13}, {"%", ARITH_MOD, 13},
+    {"+", ARITH_ADD, 12}, {"-", ARITH_SUB, 12}, {"<", ARITH_LT, 10}, {">", ARITH_GT, 10},
+    {"&", ARITH_AND, 8}, {"^", ARITH_XOR, 7}, {"|", ARITH_OR, 6}, {"?", ARITH_COND, 3},
+    {"=", ARITH_ASSIGN, 2}, {",", ARITH_COMMA, 1},
+    {NULL, ARITH_NUM, 0}
+};
+static var_table_t variables;
+static char *fanout_argv[] = {"|>", NULL};
+static char *compound_words[] = {"if", "while", "until", "for", "case", "{", NULL};
+static char *closing_words[] = {"then", "elif", "else", "fi", "do", "done", "esac", "}", NULL};
+static char *reserved_words[] = {"if", "then", "elif", "else", "fi", "while", "until", "for", "in", "do", "done",
+                                 "case", "esac", "{", "}", "time", "run", NULL};
+static char *compound_argv[][2] = {{"if", NULL}, {"while", NULL}, {"until", NULL}, {"for", NULL}, {"case", NULL},
+                                   {"{", NULL}, {"()", NULL}};
+static function_t *function_table[FUNCTION_BUCKETS];
+static int nfunctions;
+static history_t history = {.fd = -1};
+static script_cache_t script_cache;
+static line_reader_t *stdin_reader;
+static parallel_run_t *parallel_runs;
+static trace_ring_t *trace_ring;
+static shell_stats_t shell_stats;
+static char *trace_names[] = {"parse", "launch", "spawn", "fork", "child", "exec", "exec failed", "builtin",
+                              "wait", "tcsetpgrp", "stop", "continue", "exit"};
+static char *trace_args[] = {NULL, "pgid", "child", "child", NULL, NULL, "errno", "status",
+                             "pgid", "pgid", "signal", NULL, "status"};
+static builtin_t builtins[] = {
+    {":", builtin_true},
+    {"break", builtin_break},
+    {"cd", builtin_cd},
+    {"continue", builtin_continue},
+    {"echo", builtin_echo},
+    {"exit", builtin_exit},
+    {"export", builtin_export},
+    {"false", builtin_false},
+    {"fg", builtin_fg},
+    {"hash", builtin_hash},
+    {"history", builtin_history},
+    {"jobs", builtin_jobs},
+    {"let", builtin_let},
+    {"local", builtin_local},
+    {"parallel", builtin_parallel},
+    {"pin", builtin_pin},
+    {"renice", builtin_renice},
+    {"return", builtin_return},
+    {"set", builtin_set},
+    {"shift", builtin_shift},
+    {"stats", builtin_stats},
+    {"true", builtin_true},
+    {"type", builtin_type},
+    {"unset", builtin_unset},
+    {NULL, NULL}
+};
+static builtin_t parallel_background = {"parallel", builtin_parallel_bg};
+static builtin_t *builtin_index[BUILTIN_BUCKETS];
 extern char **environ;
 
 int main(int argc, char *argv[], char *envp[])
 {
-    int idx, jdx;
-    int prompt_pwd = 1;
-    int status, wait_status, exit_status = 0;
-    int (*fd)[2];
-    char cmd[MAX_LEN];
-    pid_t shell_pid = getpid();
-    pid_t cpid;
-    pid_t backdground_leader_pid;
-    group_t *session_leader = NULL;
-    group_t *new_group = NULL;
-    group_t *grp_ptr;
-    process_t *new_process = NULL;
-    process_t *proc_ptr;
-    int terminal = open(ctermid(NULL), O_RDWR);
+    int idx, opt, text_len;
+    int interactive, report = 0, noexec = 0, rc_pending = 0;
+    char *cmd;
+    arena_t *arena;
+    pipeline_t *list;
+    char *command_string = NULL;
+    unsigned long ncommands = 0;
+    struct timespec begin, started, parse_begin, line_begin;
+    int line_pending = 0;
+    uint64_t parse_ns;
+    line_reader_t input;
+    line_editor_t editor;
+    int event_fd = -1;
+    shell_t sh;
+    sigset_t chld_mask;
+    struct epoll_event event;
 
-    /* Ignore foreground signals */
-    signal(SIGINT, ignore_foreground_signals);
-    signal(SIGTSTP, ignore_foreground_signals);
-    signal(SIGQUIT, ignore_foreground_signals);
-    signal(SIGTTOU, SIG_IGN);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    sh.session_leader = NULL;
+    sh.terminal = -1;
+    sh.shell_pid = getpid();
+    sh.job_pgid = 0;
+    sh.exit_status = 0;
+    sh.exec_last = 0;
+    sh.nparams = 0;
+    sh.params = NULL;
+    sh.loop_depth = sh.function_depth = 0;
+    sh.control = CTRL_NONE;
+    sh.control_levels = 0;
+    var_import(envp);
+    sh.input = &input;
+    sh.editor = NULL;
+    sh.event_fd = -1;
+    if (getcwd(sh.cwd, sizeof(sh.cwd)) == NULL)
+        sh.cwd[0] = '\0';
+    var_set("PWD", 3, sh.cwd, 1);
+    init_builtins();
 
-    /* Intialize prompt for shell */
-    initialize_msh();
+    /* Parse shell options */
+    while ((opt = getopt(argc, argv, "+c:nr")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c':
+                command_string = optarg;
+                break;
+            case 'n':
+                noexec = 1;
+                break;
+            case 'r':
+                report = 1;
+                break;
+            default:
+                fprintf(stderr, "Usage : %s [-nr] [-c command | script]\n", argv[0]);
+                exit(2);
+        }
+    }
 
-    while (1)
+    /* Select the input source */
+    if (command_string != NULL)
     {
-        display_prompt(prompt_pwd);
+        reader_init_string(&input, command_string);
+    }
+    else if (optind < argc)
+    {
+        if ((idx = open(argv[optind], O_RDONLY | O_CLOEXEC)) == -1)
+        {
+            perror(argv[optind]);
+            exit(127);
+        }
+        reader_init_fd(&input, idx);
 
-        /* Get command from user */
-        fgets(cmd, MAX_LEN, stdin);
-        cmd[strlen(cmd) - 1] = '\0';
+        /* Words after the script are its positional parameters */
+        sh.params = argv + optind + 1;
+        sh.nparams = argc - optind - 1;
 
-        /* Check for built in commands */
-        if (is_null_input(cmd))
-            continue;
-        else if (is_exit(cmd, session_leader))
-            exit(0);
-        else if (is_jobs(cmd, &session_leader))
-            continue;
-        else if (is_fg(cmd, terminal, &session_leader, shell_pid, &exit_status))
-            continue;
-        else if(change_dir(cmd))
-            continue;
-        else if (is_echo(cmd, exit_status))
-            continue;
-        else if (is_ps1(cmd, &prompt_pwd))
-            continue;
+        /* A script parsed before and unchanged since is not parsed again */
+        cache_open(&script_cache, argv[optind], &sh);
+    }
+    else
+    {
+        reader_init_fd(&input, 0);
+        stdin_reader = &input;
+    }
 
-        /* Parse external commands */
-        command_parser(cmd, &session_leader);
+    /* Only a terminal on stdin with no script gets the interactive shell */
+    interactive = command_string == NULL && optind >= argc && isatty(0);
 
-        /* Create child process to execute commands */
-        grp_ptr = session_leader;
-        while (grp_ptr != NULL)
-        {
-            if (grp_ptr->pgid == 0)
-            {
-                idx = 0;
-                /* Allocate memory for pipe fds */
-                fd = (int (*)[2])calloc(grp_ptr->nprocess * 2, sizeof(int));
+    if (interactive)
+    {
+        sh.terminal = open(ctermid(NULL), O_RDWR | O_CLOEXEC);
 
-                proc_ptr = grp_ptr->proc_link;
-                while (proc_ptr != NULL)
-                {
-                    idx++;
+        /* Ignore foreground signals */
+        signal(SIGINT, ignore_foreground_signals);
+        signal(SIGTSTP, ignore_foreground_signals);
+        signal(SIGQUIT, ignore_foreground_signals);
+        signal(SIGTTOU, SIG_IGN);
 
-                    /* Create child processes to execute commands of pipeline */
+        /* Intialize prompt for shell */
+        initialize_msh();
+        compile_prompt("Shankar:", 1);
+        editor_init(&editor, 0);
+        sh.editor = &editor;
+        history_open(&history);
 
-                    /* Last process in the pipeline will not create a pipe */
-                    if (proc_ptr->proc_link != NULL)
-                        pipe(fd[idx]);
+        /* The rc file is read when the first prompt is due, other shells never look for it */
+        rc_pending = 1;
+    }
 
-                    /* Fork nprocess times */
-                    cpid = fork();
+    /* Children are reaped when SIGCHLD shows up on sigchld_fd */
+    sigemptyset(&chld_mask);
+    sigaddset(&chld_mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld_mask, NULL);
+    if ((sigchld_fd = signalfd(-1, &chld_mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+    {
+        perror("signalfd");
+        exit(1);
+    }
 
-                    switch (cpid)
-                    {
-                        case -1:
-                            /* Error handling for forking */
-                            printf("Error forking\n");
-                            exit(1);
-                        case 0:
-                            /* Code for Child to execute pipeline */
-                            /* Code for 1st child */
-                            if (grp_ptr->nprocess > 1)
-                                if (idx == 1)
-                                {
-                                    if (setpgid(proc_ptr->pid, 0) == -1)
-                                    {
-                                        perror("setpgid");
-                                        exit(1);
-                                    }
-                                    close(fd[idx][0]);
-                                    if (dup2(fd[idx][1], 1) == -1)
-                                    {
-                                        printf("LINE NO : %d : ERROR : dup2\n", __LINE__);
-                                        perror("dup2");
-                                        exit(1);
-                                    }
-                                    close(fd[idx][1]);
-                                }
-                            /* Code for last child */
-                                else if (idx == grp_ptr->nprocess)
-                                {
-                                    if (setpgid(proc_ptr->pid, backdground_leader_pid) == -1)
-                                    {
-                                        perror("setpgid");
-                                        exit(1);
-                                    }
-                                    if (dup2(fd[idx - 1][0], 0) == -1)
-                                    {
-                                        printf("LINE NO : %d : ERROR : dup2\n", __LINE__);
-                                        perror("dup2");
-                                        exit(1);
-                                    }
-                                    close(fd[idx - 1][0]);
-                                    close(fd[idx - 1][1]);
-                                }
-                            /* Code for other children */
-                                else
-                                {
-                                    if (setpgid(proc_ptr->pid, backdground_leader_pid) == -1)
-                                    {
-                                        perror("setpgid");
-                                        exit(1);
-                                    }
-                                    if (dup2(fd[idx - 1][0], 0) == -1)
-                                    {
-                                        printf("LINE NO : %d : ERROR : dup2\n", __LINE__);
-                                        perror("dup2");
-                                        exit(1);
-                                    }
-                                    close(fd[idx - 1][0]);
-                                    close(fd[idx - 1][1]);
-
-                                    if (dup2(fd[idx][1], 1) == -1)
-                                    {
-                                        printf("LINE NO : %d : ERROR : dup2\n", __LINE__);
-                                        perror("dup2");
-                                        exit(1);
-                                    }
-                                    close(fd[idx][1]);
-                                    close(fd[idx][0]);
-                                }
-
-                            /* Do exec with a process in the pipeline for each child */
-                            if (execvpe(proc_ptr->argv[0], proc_ptr->argv, envp) == -1)
-                            {
-                                fprintf(stderr, "%s : command not found\n", proc_ptr->argv[0]);
-                                return 0;
-                            }
-                        default :
-                            /* Store pid in process structure */
-                            proc_ptr->pid = cpid;
-
-                            /* Change group id */
-                            /* Store group pid */
-                            if (idx == 1)
-                            {
-                                /* Make process a group leader */
-                                setpgid(proc_ptr->pid, 0);
-                                kill(proc_ptr->pid, SIGCONT);
-                                backdground_leader_pid = proc_ptr->pid;
-                                proc_ptr->pgid = backdground_leader_pid;
-
-                                /* Update group id to group structure */
-                                grp_ptr->pgid = backdground_leader_pid;
-                            }
-                            else
-                            {
-                                /* Set group id of process as that of group leader */
-                                setpgid(proc_ptr->pid, backdground_leader_pid);
-                                proc_ptr->pgid = backdground_leader_pid;
-                                kill(proc_ptr->pid, SIGCONT);
-                            }
-
-                            /* Close extra pipes */
-                            if (idx > 1)
-                            {
-                                close(fd[idx - 1][0]);
-                                close(fd[idx - 1][1]);
-                            }
-                    }
-                    /* Move to next process */
-                    proc_ptr = proc_ptr->proc_link;
-                }
-                /* Free memory allocated for pipes */
-                free(fd);
-            }
+    if (interactive)
+    {
+        /* Wait for the terminal and for children at the same time */
+        report_jobs = 1;
+        event_fd = sh.event_fd = epoll_create1(EPOLL_CLOEXEC);
+        event.events = EPOLLIN;
+        event.data.fd = input.fd;
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, input.fd, &event);
+        event.data.fd = sigchld_fd;
+        epoll_ctl(event_fd, EPOLL_CTL_ADD, sigchld_fd, &event);
+    }
 
-            /* Move to next group */
-            grp_ptr = grp_ptr->group_link;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    sh.startup = elapsed_seconds(&started);
+
+    while (1)
+    {
+        /* Collect children that changed state since the last command */
+        update_status_of_bg(&sh.session_leader);
+
+        /* An interrupted job stops the rest of its line only */
+        sh.control = CTRL_NONE;
+
+        /* Time from one line read to the shell being ready for the next */
+        if (line_pending)
+        {
+            hist_record(&shell_stats.prompt, elapsed_ns(&line_begin));
+            line_pending = 0;
         }
 
-        /* Give the control to foreground process */
-        if (session_leader->status == FG)
+        /* Lines of a cached script come out already parsed */
+        if (script_cache.map != NULL)
         {
-            /* Assign control terminal to forground process */
-            if (tcsetpgrp(terminal, session_leader->pgid) == -1)
+            clock_gettime(CLOCK_MONOTONIC, &parse_begin);
+            TRACE(TRACE_PARSE, 'B', 0, 0, 0, "script cache");
+            arena = cache_next_line(&script_cache, &cmd, &list);
+            TRACE(TRACE_PARSE, 'E', 0, 0, 0, "script cache");
+            parse_ns = elapsed_ns(&parse_begin);
+            script_cache.parse_seconds += parse_ns / 1e9;
+            if (arena != NULL)
             {
-                perror("tcsetpgrp1");
-                exit(0);
+                line_begin = parse_begin;
+                line_pending = 1;
+                shell_stats.parsed++;
+                hist_record(&shell_stats.parse, parse_ns);
+                ncommands++;
+                if (cmd != NULL && !noexec)
+                    is_ps1(cmd);
+                else if (cmd == NULL && !noexec)
+                    run_list(list, arena, &sh);
+                arena_release(arena);
+                continue;
             }
+        }
 
-            /* Wait for foreground process to change state */
-            wait_for_fg(&session_leader, &exit_status);
+        if (rc_pending)
+        {
+            rc_pending = 0;
+            source_rc(&sh);
+        }
 
-            /* Get control terminal back */
-            if (tcsetpgrp(terminal, shell_pid) == -1)
+        /* Get command from user */
+        if (interactive)
+            print_job_notices();
+        if (script_cache.map != NULL || (cmd = next_line(&sh, NULL)) == NULL)
+        {
+            if (report)
+            {
+                report_throughput(ncommands, elapsed_seconds(&begin));
+                report_allocations(ncommands);
+                report_parse(sh.startup);
+            }
+            if (interactive)
             {
-                perror("tcsetpgrp2");
-                exit(0);
+                puts("");
+                hangup_jobs(sh.session_leader);
             }
+            else
+                finish_runs(&sh);
+            exit(sh.exit_status);
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &line_begin);
+        line_pending = 1;
+
+        /* Check for built in commands */
+        if (is_null_input(cmd))
+            continue;
+        if (interactive)
+            history_add(&history, cmd);
+
+        ncommands++;
+        if (strncmp(cmd, "PS1=", 4) == 0 || strncmp(cmd, "PS2=", 4) == 0)
+        {
+            if (script_cache.compiling)
+                cache_put_prompt(&script_cache, cmd);
+            if (!noexec)
+                is_ps1(cmd);
+            continue;
+        }
+
+        /* Parse the line, it keeps one reference to its arena */
+        /* Words, argument vectors and nodes of a line fit in 8 bytes per character */
+        /* A compound command and the bodies of here-documents take the lines after it too, also with -n */
+        clock_gettime(CLOCK_MONOTONIC, &parse_begin);
+        TRACE(TRACE_PARSE, 'B', 0, 0, 0, cmd);
+        arena = arena_create(8 * (strlen(cmd) + 1));
+        arena->refs = 1;
+        if ((text_len = command_parser(cmd, arena, &list, &sh)) == -1)
+        {
+            /* A script with errors is not cached, they are reported each time it runs */
+            script_cache.compiling = 0;
+            parse_ns = elapsed_ns(&parse_begin);
+            script_cache.parse_seconds += parse_ns / 1e9;
+            shell_stats.parsed++;
+            hist_record(&shell_stats.parse, parse_ns);
+            TRACE(TRACE_PARSE, 'E', 0, 0, -1, NULL);
+            sh.exit_status = 2;
+        }
+        else
+        {
+            if (script_cache.compiling)
+                cache_put_line(&script_cache, list, text_len);
+            parse_ns = elapsed_ns(&parse_begin);
+            script_cache.parse_seconds += parse_ns / 1e9;
+            shell_stats.parsed++;
+            hist_record(&shell_stats.parse, parse_ns);
+            TRACE(TRACE_PARSE, 'E', 0, 0, 0, NULL);
+
+            /* The last command of -c can take the place of the shell */
+            sh.exec_last = command_string != NULL && !report && input.start == input.end;
+            if (!noexec)
+                run_list(list, arena, &sh);
         }
+        arena_release(arena);
 
     } /* bracket for while(1) */
     return 0;
 }
 
-void command_parser(char *cmd, group_t **session_leader)
+/*
+ * Run the pipelines of a parsed line, each one in its own process group.
+ * It stops early for break, continue and return, which leave it to the
+ * loops and functions around it.
+ */
+void run_list(pipeline_t *list, arena_t *arena, shell_t *sh)
 {
-    int idx;
-    char *str;
-    char *saveptr1, *saveptr2, *saveptr3;
-    char *group, *process, *cmd_args;
-    group_t *grp_ptr;
-    group_t *new_group;
-    process_t *proc_ptr;
-    process_t *new_process;
-    int ampersand_count = 0;
-    int no_of_group = 0;
+    int started;
+    connector_t connector = CONN_SEQ;
+    pipeline_t *pl, *branch;
+    command_t *commands;
+    group_t *group;
+    process_t *process;
+    builtin_t *builtin;
+    function_t *function;
+    struct timespec begin;
+    struct rusage before, usage, group_usage;
 
-    /* Get '&' count in command */
-    for (idx = 0; cmd[idx] != '\0'; idx++)
-        if (cmd[idx] == '&')
-            ++ampersand_count;
-
-    str = cmd;
-    /* First level parsing for process groups */
-    for (; ;str = NULL)
+    for (pl = list; pl != NULL && sh->control == CTRL_NONE; connector = pl->connector, pl = pl->next)
     {
-        group = strtok_r(str, "&", &saveptr1);
-        if (group == NULL)
-            break;
-        else
+        /* && and || look at the status of the last pipeline that ran */
+        if ((connector == CONN_AND && sh->exit_status != 0) || (connector == CONN_OR && sh->exit_status == 0))
+            continue;
+
+        if (pl->timed)
+            clock_gettime(CLOCK_MONOTONIC, &begin);
+
+        /* Variables take the values they have now that the pipeline runs, a failed $((...)) stops it */
+        commands = expand_pipeline(pl, arena, sh);
+        if (expand_failed)
         {
-            new_group = insert_group(session_leader);
-            no_of_group++;
-            new_group->nprocess = 0;
-            /* Second level parsing for process groups */
-            for (; ;group = NULL)
-            {   
-                process = strtok_r(group, "|", &saveptr2);
-                if (process == NULL)
-                    break;
-                else
-                {
-                    new_process = insert_process(&new_group->proc_link);
-                    new_group->nprocess++;
-                    /* Third level parsing for arguments of process groups */
-                    for (idx = 0; ; idx++, process = NULL)
-                    {
-                        cmd_args = strtok_r(process, " ", &saveptr3);
-                        if (cmd_args == NULL)
-                            break;
-                        else
-                        {
-                            /* Allocate memory to store each argument of new process */
-                            new_process->argv[idx] = (char *)calloc(1, sizeof(cmd_args));
-                            strcpy(new_process->argv[idx], cmd_args);
-                        }
-                    }
-                    /* Store NULL as end argument */
-                    new_process->argv[idx] = NULL;
-                }
-            }
+            expand_failed = 0;
+            sh->exit_status = 1;
+            continue;
         }
-    }
 
-    /* Make a process forground */
-    if (ampersand_count < no_of_group)
-        new_group->status = FG;
+        /* Assignments on their own set shell variables */
+        if (pl->ncommands == 1 && pl->nbranches == 0 && !pl->background && commands->argc == 0 &&
+            commands->compound == NULL)
+        {
+            assign_variables(commands, 0);
+            sh->exit_status = 0;
+            continue;
+        }
 
-#ifdef DEBUG
-    /* Only for DEBUG : To print the arguments */
-    grp_ptr = *session_leader;
-    while (grp_ptr != NULL)
-    {
-        if (grp_ptr->pgid == 0)
+        /* A compound command, function or builtin on its own runs in the shell without a fork */
+        builtin = NULL;
+        function = NULL;
+        if (pl->ncommands == 1 && pl->nbranches == 0 && !pl->background &&
+            (commands->compound != NULL || (function = find_function(commands->argv[0])) != NULL ||
+             (builtin = find_builtin(commands->argv[0])) != NULL))
         {
-            printf("New group\n");
-            printf("New group status = %d\n", grp_ptr->status);
-            proc_ptr = grp_ptr->proc_link;
-            while (proc_ptr != NULL)
+            /* Time spent by the shell itself and by the jobs the command ran */
+            if (pl->timed)
             {
-                printf("New process\n");
-                for (idx = 0; proc_ptr->argv[idx] != NULL; idx++)
-                {
-                    printf("argv[%d] = %s\n", idx, proc_ptr->argv[idx]);
-                }
-                proc_ptr = proc_ptr->proc_link;
+                getrusage(RUSAGE_SELF, &before);
+                getrusage(RUSAGE_CHILDREN, &usage);
+                add_usage(&before, &usage);
+            }
+
+            /* NAME=value in front of a builtin or function lasts for that command only */
+            if (commands->nassigns > 0)
+            {
+                var_push_scope();
+                assign_variables(commands, 1);
+            }
+            if (builtin != NULL)
+                TRACE(TRACE_BUILTIN, 'B', 0, 0, 0, commands->argv[0]);
+            sh->exit_status = run_in_shell(commands, builtin, function, arena, sh);
+            if (builtin != NULL)
+                TRACE(TRACE_BUILTIN, 'E', 0, 0, sh->exit_status, commands->argv[0]);
+            if (commands->nassigns > 0)
+                var_pop_scope();
+            if (pl->timed)
+            {
+                getrusage(RUSAGE_SELF, &usage);
+                getrusage(RUSAGE_CHILDREN, &group_usage);
+                add_usage(&usage, &group_usage);
+                timersub(&usage.ru_utime, &before.ru_utime, &usage.ru_utime);
+                timersub(&usage.ru_stime, &before.ru_stime, &usage.ru_stime);
+                print_times(elapsed_seconds(&begin), &usage);
             }
+            continue;
+        }
+
+        /* parallel ... & runs in the shell, which starts its next items as it reaps its jobs */
+        if (pl->ncommands == 1 && pl->nbranches == 0 && pl->background && !pl->timed && commands->compound == NULL &&
+            commands->nassigns == 0 && commands->argc > 0 && strcmp(commands->argv[0], "parallel") == 0 &&
+            find_function("parallel") == NULL && getpid() == sh->shell_pid)
+        {
+            sh->exit_status = run_in_shell(commands, &parallel_background, NULL, arena, sh);
+            continue;
+        }
+
+        /* Nothing runs after the last command of -c, it is exec'd without a fork, unless parallel has items left */
+        if (sh->exec_last && pl->next == NULL && pl->ncommands == 1 && pl->nbranches == 0 && !pl->background &&
+            !pl->timed && commands->argv[0] != NULL && parallel_runs == NULL)
+        {
+            exec_command(commands, pl->placement, arena, sh);
+            continue;
+        }
+
+        /* Make a job of the pipeline, its strings stay in the arena of the line */
+        group = insert_group(&sh->session_leader);
+        group->pgid = sh->job_pgid;
+        group->arena = arena;
+        arena->refs++;
+        group->command = pl->text;
+        group->status = pl->background ? BG : FG;
+        if (pl->placement != NULL)
+        {
+            group->placed = 1;
+            group->placement = *pl->placement;
+        }
+        add_processes(group, commands, arena);
+
+        /* producer |> (a, b) : a pump process feeds every branch, all in the one job */
+        if (pl->nbranches > 0)
+        {
+            process = insert_process(group);
+            process->argv = fanout_argv;
+            process->nbranches = pl->nbranches;
+            for (branch = pl->branches; branch != NULL; branch = branch->next)
+                add_processes(group, expand_pipeline(branch, arena, sh), arena)->branch = 1;
+            /* The branches are in the job already, one whose $((...)) failed runs with the value left empty */
+            expand_failed = 0;
+        }
+
+        TRACE(TRACE_LAUNCH, 'B', 0, 0, 0, pl->text);
+        launch_group(group, sh);
+        TRACE(TRACE_LAUNCH, 'E', 0, 0, group->pgid, pl->text);
+
+        /* Drop the group if no command could be started */
+        started = group->nprocess > 0;
+        release_group_resource(&sh->session_leader);
+        if (!started)
+            continue;
+
+        if (pl->background)
+        {
+            sh->exit_status = 0;
+            continue;
+        }
+
+        /* Assign control terminal to forground process */
+        if (sh->terminal != -1)
+            TRACE(TRACE_TERMINAL, 'i', 0, 0, group->pgid, NULL);
+        if (sh->terminal != -1 && tcsetpgrp(sh->terminal, group->pgid) == -1)
+        {
+            perror("tcsetpgrp1");
+            exit(0);
+        }
+
+        /* Wait for foreground process to change state */
+        wait_for_fg(&sh->session_leader, &sh->exit_status, &usage);
+        if (pl->timed)
+            print_times(elapsed_seconds(&begin), &usage);
+
+        /* Ctrl-C on a job also stops the loops and functions it runs in */
+        if (sh->terminal != -1 && sh->exit_status == 128 + SIGINT)
+            sh->control = CTRL_INTERRUPT;
+
+        /* Get control terminal back */
+        if (sh->terminal != -1)
+            TRACE(TRACE_TERMINAL, 'i', 0, 0, sh->shell_pid, NULL);
+        if (sh->terminal != -1 && tcsetpgrp(sh->terminal, sh->shell_pid) == -1)
+        {
+            perror("tcsetpgrp2");
+            exit(0);
         }
-        grp_ptr = grp_ptr->group_link;
     }
-#endif
 }
 
-group_t *insert_group(group_t **session_leader)
+/*
+ * Replace the shell with a command, set up as a child would be. Returns
+ * only when the command is not found, the shell has nothing left to undo.
+ */
+void exec_command(command_t *command, placement_t *placement, arena_t *arena, shell_t *sh)
 {
-    /* Insert as first element */
-    group_t *new_group;
+    char *path;
+    sigset_t mask;
 
-    if (*session_leader == NULL)
+    if ((path = hash_lookup(command->argv[0], NULL)) == NULL)
     {
-        (*session_leader) = (group_t *)calloc(1, sizeof(group_t));
-        (*session_leader)->status = BG;
-        (*session_leader)->proc_link = NULL;
-        (*session_leader)->group_link = NULL;
+        fprintf(stderr, "%s : command not found\n", command->argv[0]);
+        shell_stats.exec_failures++;
+        sh->exit_status = 127;
+        return;
     }
-    else
+    fflush(stdout);
+    if (placement != NULL)
+        place_task(0, placement);
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    if (apply_redirects(command->redirects) == -1)
+        exit(1);
+
+    /* The trace is written now, nothing is left to run at exit */
+    TRACE(TRACE_EXEC, 'i', 0, 0, 0, path);
+    if (trace_ring != NULL)
+        trace_stop();
+    execve(path, command->argv, command->nassigns > 0 ? command_env(command, arena) : var_environ());
+    fprintf(stderr, "%s : %s\n", command->argv[0], strerror(errno));
+    exit(126);
+}
+
+/* Add a process to the group for every command, returns the first one */
+process_t *add_processes(group_t *group, command_t *commands, arena_t *arena)
+{
+    command_t *command;
+    process_t *process, *first = NULL;
+
+    for (command = commands; command != NULL; command = command->next)
     {
-        new_group = (group_t *)calloc(1, sizeof(group_t));
-        new_group->proc_link = NULL;
-        new_group->status = BG;
-        new_group->group_link = *session_leader;
-        (*session_leader) = new_group;
+        process = insert_process(group);
+        process->argv = command->compound != NULL ? compound_argv[command->compound->type] : command->argv;
+        process->compound = command->compound;
+        process->envp = command->nassigns > 0 ? command_env(command, arena) : NULL;
+        process->redirects = command->redirects;
+        if (first == NULL)
+            first = process;
     }
-    return *session_leader;
+    return first;
 }
 
-process_t *insert_process(process_t **process_leader)
+/*
+ * Commands of a pipeline with their variables expanded, copied into the
+ * arena of the line. Pipelines without variables are used as they are.
+ */
+command_t *expand_pipeline(pipeline_t *pl, arena_t *arena, shell_t *sh)
 {
-    /* Insert as last element */
-    process_t *ptr = *process_leader;
+    command_t *command, *head = NULL;
+    command_t **tail = &head;
+
+    for (command = pl->commands; command != NULL; command = command->next)
+        if (command->expand)
+            break;
+    if (command == NULL)
+        return pl->commands;
 
-    if (ptr == NULL)
+    for (command = pl->commands; command != NULL; command = command->next)
     {
-        (*process_leader) = (process_t *)calloc(1, sizeof(process_t));
-        (*process_leader)->proc_link = NULL;
-        (*process_leader)->status = stat[RUNNING];
-        (*process_leader)->signal = sig[0];
-        return (*process_leader);
+        *tail = expand_command(command, arena, sh);
+        tail = &(*tail)->next;
     }
-    else
+    return head;
+}
+
+/* Copy of a command with its words split into fields and its assignments and redirections expanded */
+command_t *expand_command(command_t *command, arena_t *arena, shell_t *sh)
+{
+    int idx;
+    size_t nfields = 0;
+    command_t *copy;
+    redirect_t *redir, *redir_copy;
+    redirect_t **tail;
+
+    copy = (command_t *)arena_alloc(arena, sizeof(command_t));
+    *copy = *command;
+    copy->next = NULL;
+    if (!command->expand)
+        return copy;
+
+    for (idx = 0; idx < command->argc; idx++)
+        split_word(command->argv[idx], &nfields, arena, sh);
+    copy->argc = nfields;
+    copy->argv = (char **)arena_alloc(arena, (nfields + 1) * sizeof(char *));
+    memcpy(copy->argv, field_vec, nfields * sizeof(char *));
+    copy->argv[nfields] = NULL;
+
+    /* Values of assignments and targets of redirections are not split */
+    if (command->nassigns > 0)
+    {
+        copy->assigns = (char **)arena_alloc(arena, command->nassigns * sizeof(char *));
+        for (idx = 0; idx < command->nassigns; idx++)
+            copy->assigns[idx] = expand_word(command->assigns[idx], arena, sh);
+    }
+
+    tail = &copy->redirects;
+    for (redir = command->redirects; redir != NULL; redir = redir->next)
     {
-        while (ptr->proc_link != NULL)
+        redir_copy = (redirect_t *)arena_alloc(arena, sizeof(redirect_t));
+        *redir_copy = *redir;
+        if (redir->expand && redir->body != NULL)
         {
-            ptr = ptr->proc_link;
+            redir_copy->body = expand_word(redir->body, arena, sh);
+            redir_copy->body_len = strlen(redir_copy->body);
         }
-        ptr->proc_link = (process_t *)calloc(1, sizeof(process_t));
-        ptr->proc_link->proc_link = NULL;
-        ptr->proc_link->status = stat[RUNNING];
-        ptr->proc_link->signal = sig[0];
-        return ptr->proc_link;
+        else if (redir->expand)
+            redir_copy->path = expand_word(redir->path, arena, sh);
+        *tail = redir_copy;
+        tail = &redir_copy->next;
     }
+    *tail = NULL;
+    return copy;
 }
 
-void initialize_msh(void)
+/* Word with the values of its marked variables put in */
+char *expand_word(const char *word, arena_t *arena, shell_t *sh)
 {
-    system("clear");
-    printf("\033[32;1m");
-    printf("-----------------------------------------------------------------------------------\n");
-    printf("|                        WELCOME TO MINI SHELL                                    |\n");
-    printf("|                            AUTHOR : ABHI                                        |\n");
-    printf("-----------------------------------------------------------------------------------\n");
-    printf("\033[0m");
-}
+    size_t len = 0, run;
+    const char *end, *value;
 
-void display_prompt(int prompt_pwd)
-{
-    if (prompt_pwd)
-    printf("%s\033[34;1m%s:\033[0m ", prompt, getcwd(path, 200));
-    else
-    printf("%s", prompt);
-    fflush(stdout);
-}
+    if (strpbrk(word, "\001\002") == NULL)
+        return (char *)word;
 
-void change_prompt(char *new_prompt)
-{
-    strcpy(prompt, "\033[32;1m");
-    strcat(prompt, new_prompt + 4);
-    strcat(prompt, "\033[0m");
-    return;
+    while (*word != '\0')
+    {
+        if (*word != VAR_SPLIT && *word != VAR_QUOTED)
+        {
+            run = strcspn(word, "\001\002");
+            field_add(&len, word, run);
+            word += run;
+            continue;
+        }
+        end = strchr(word + 1, VAR_END);
+        if ((value = variable_value(word + 1, end - word - 1, sh)) != NULL)
+            field_add(&len, value, strlen(value));
+        word = end + 1;
+    }
+    return field_take(&len, arena);
 }
 
-int change_dir(char *cmd)
+/* Case pattern with its marked variables put in, the glob characters of quoted ones escaped */
+char *expand_pattern(const char *word, arena_t *arena, shell_t *sh)
 {
-    if (strcmp(cmd, "cd") == 0)
-    {
-        if (chdir(getenv("HOME")) != 0)
-            perror("cd");
-        return 1;
-    }
-    else if (strncmp(cmd, "cd ", 3) == 0)
-    {
-        if ((chdir(cmd + 3)) != 0)
-            perror("cd");
-        return 1;
-    }
-    else
+    size_t len = 0, run;
+    const char *end, *value;
+
+    if (strchr(word, VAR_QUOTED) == NULL)
+        return expand_word(word, arena, sh);
+
+    while (*word != '\0')
     {
-        return 0;
+        if (*word != VAR_SPLIT && *word != VAR_QUOTED)
+        {
+            run = strcspn(word, "\001\002");
+            field_add(&len, word, run);
+            word += run;
+            continue;
+        }
+        end = strchr(word + 1, VAR_END);
+        value = variable_value(word + 1, end - word - 1, sh);
+        while (value != NULL && *value != '\0')
+        {
+            run = *word == VAR_QUOTED ? strcspn(value, GLOB_CHARS) : strlen(value);
+            if (run == 0)
+            {
+                field_add(&len, "\\", 1);
+                run = 1;
+            }
+            field_add(&len, value, run);
+            value += run;
+        }
+        word = end + 1;
     }
+    return field_take(&len, arena);
 }
 
-int is_exit(char *cmd, group_t *session_leader)
+/*
+ * Add the fields of a word to field_vec, in one pass over it. Values of
+ * unquoted variables are split at blanks, and a word that comes out
+ * empty gives no field unless part of it was quoted.
+ */
+void split_word(const char *word, size_t *nfields, arena_t *arena, shell_t *sh)
 {
-    group_t *grp_ptr;
+    int idx, field = 0;
+    size_t len = 0, run;
+    const char *end, *value;
 
-    if (strcasecmp(cmd, "exit") == 0)
+    if (strpbrk(word, "\001\002") == NULL)
     {
-        for (grp_ptr = session_leader; grp_ptr; grp_ptr = grp_ptr->group_link)
-            killpg(grp_ptr->pgid, SIGHUP);
-        return 1;
+        field_push(nfields, (char *)word);
+        return;
     }
-    else
+
+    while (*word != '\0')
     {
-        return 0;
+        if (*word != VAR_SPLIT && *word != VAR_QUOTED)
+        {
+            run = strcspn(word, "\001\002");
+            field_add(&len, word, run);
+            word += run;
+            field = 1;
+            continue;
+        }
+
+        end = strchr(word + 1, VAR_END);
+        if (*word == VAR_QUOTED && end == word + 2 && word[1] == '@')
+        {
+            /* "$@" is a field per parameter, the first and last joined to the text around */
+            for (idx = 0; idx < sh->nparams; idx++)
+            {
+                if (idx > 0)
+                    field_push(nfields, field_take(&len, arena));
+                field_add(&len, sh->params[idx], strlen(sh->params[idx]));
+                field = 1;
+            }
+            word = end + 1;
+            continue;
+        }
+        value = variable_value(word + 1, end - word - 1, sh);
+        if (*word == VAR_QUOTED)
+        {
+            field = 1;
+            if (value != NULL)
+                field_add(&len, value, strlen(value));
+        }
+        else if (value != NULL)
+        {
+            while (*value != '\0')
+            {
+                if ((run = strcspn(value, " \t\n")) > 0)
+                {
+                    field_add(&len, value, run);
+                    value += run;
+                    field = 1;
+                    continue;
+                }
+                /* A blank ends the field it follows */
+                if (field)
+                    field_push(nfields, field_take(&len, arena));
+                field = 0;
+                value++;
+            }
+        }
+        word = end + 1;
     }
+    if (field)
+        field_push(nfields, field_take(&len, arena));
 }
 
-int is_null_input(char *cmd)
+/* Append n characters to the field being built */
+void field_add(size_t *len, const char *str, size_t n)
 {
-    if (strcmp(cmd, "") == 0)
-        return 1;
-    else
-        return 0;
+    if (*len + n + 1 > field_size)
+    {
+        field_size = (*len + n + 1) * 2;
+        field_buf = (char *)realloc(field_buf, field_size);
+    }
+    memcpy(field_buf + *len, str, n);
+    *len += n;
 }
 
-int is_ps(char *cmd)
+/* Copy the field built so far into the arena and start a new one */
+char *field_take(size_t *len, arena_t *arena)
 {
-    if (strcmp(cmd, "jobs -l") == 0)
-        return 1;
-    else
-        return 0;
+    char *field = (char *)arena_alloc(arena, *len + 1);
+
+    memcpy(field, field_buf, *len);
+    field[*len] = '\0';
+    *len = 0;
+    return field;
 }
 
-int is_jobs(char *cmd, group_t **session_leader)
+/* Add a field to the vector reused between commands */
+void field_push(size_t *nfields, char *field)
 {
-    if (strcmp(cmd, "jobs") == 0)
+    if (*nfields >= field_vec_size)
     {
-        update_status_of_bg(session_leader);
-        jobs(session_leader);
-        return 1;
+        field_vec_size = field_vec_size ? field_vec_size * 2 : 64;
+        field_vec = (char **)realloc(field_vec, field_vec_size * sizeof(char *));
     }
-    else if (strcmp(cmd, "jobs -l") == 0)
+    field_vec[(*nfields)++] = field;
+}
+
+/* Value of a variable, of $? $$ $# $@ $* $0, of a positional parameter or of $((...)), NULL when it is not set */
+const char *variable_value(const char *name, size_t len, shell_t *sh)
+{
+    static char number[24];
+    int idx;
+    size_t used = 0;
+
+    /* $((expression)) is marked as ( and its text */
+    if (*name == '(')
+        return arith_expand(name + 1, len - 1, sh);
+
+    /* $1-$9 and ${10} up, the name runs to the VAR_END after it */
+    if (*name >= '1' && *name <= '9')
     {
-        update_status_of_bg(session_leader);
-        print_resource_for_my_shell(*session_leader);
-        return 1;
+        idx = atoi(name);
+        return idx <= sh->nparams ? sh->params[idx - 1] : NULL;
     }
-    else
+    if (len != 1 || strchr("?$#@*0", *name) == NULL)
+        return var_get_len(name, len);
+
+    switch (*name)
     {
-        return 0;
+        case '?':
+            snprintf(number, sizeof(number), "%d", sh->exit_status);
+            return number;
+        case '$':
+            snprintf(number, sizeof(number), "%d", sh->shell_pid);
+            return number;
+        case '#':
+            snprintf(number, sizeof(number), "%d", sh->nparams);
+            return number;
+        case '0':
+            return "mini_shell";
+        default:
+            /* $@ and $* are the parameters joined by blanks, "$@" is split apart by split_word */
+            for (idx = 0; idx < sh->nparams; idx++)
+            {
+                if (used + strlen(sh->params[idx]) + 2 > params_size)
+                {
+                    params_size = (used + strlen(sh->params[idx]) + 2) * 2;
+                    params_buf = (char *)realloc(params_buf, params_size);
+                }
+                if (idx > 0)
+                    params_buf[used++] = ' ';
+                strcpy(params_buf + used, sh->params[idx]);
+                used += strlen(sh->params[idx]);
+            }
+            return sh->nparams > 0 ? params_buf : "";
     }
 }
 
-int is_fg(char *cmd, int terminal, group_t **session_leader, pid_t shell_pid, int *exit_status)
+/*
+ * Length of the expression of $((...)) or ((...)), text starting after
+ * the two parentheses, up to the )) that closes it. -1 when there is none.
+ */
+long arith_span(const char *text)
 {
-    if (strcmp(cmd, "fg") == 0)
+    long pos;
+    int depth = 0;
+
+    for (pos = 0; text[pos] != '\0'; pos++)
     {
-        fg(terminal, session_leader, shell_pid, exit_status);
-        return 1;
+        if (text[pos] == '(')
+            depth++;
+        else if (text[pos] == ')' && depth > 0)
+            depth--;
+        else if (text[pos] == ')')
+            return text[pos + 1] == ')' ? pos : -1;
     }
-    else
+    return -1;
+}
+
+/* Value of $((expression)) as text, NULL after a message when it fails, which stops the command */
+const char *arith_expand(const char *text, size_t len, shell_t *sh)
+{
+    static char number[24];
+    int64_t value;
+
+    if (arith_eval(text, len, &value, sh) == -1)
     {
-        return 0;
+        expand_failed = 1;
+        return NULL;
     }
+    snprintf(number, sizeof(number), "%" PRId64, value);
+    return number;
 }
 
-int is_ps1(char * cmd, int *prompt_pwd)
+/*
+ * Evaluate an expression with 64-bit integers that wrap around. Its tree
+ * comes from the cache, so an expression of a loop is parsed only once.
+ * Returns -1 after a message for a syntax error or a division by 0.
+ */
+int arith_eval(const char *text, size_t len, int64_t *result, shell_t *sh)
 {
-        /* Check if command is exit */
-        if (strncmp(cmd, "PS1=", 4) == 0)
+    int idx, end;
+    unsigned int hash = hash_name(text, len);
+    size_t used;
+    const char *error = NULL;
+    arith_expr_t *expr;
+    arith_expr_t **bucket = &arith_table[hash % ARITH_BUCKETS];
+    arena_t *block;
+
+    for (expr = *bucket; expr != NULL; expr = expr->next)
+        if (expr->hash == hash && expr->len == len && memcmp(expr->text, text, len) == 0)
+            break;
+
+    if (expr == NULL)
+    {
+        /* Text made up at run time could fill it without end, it starts over when full */
+        if (narith >= ARITH_MAX && arith_depth == 0)
         {
-            change_prompt(cmd);
-            *prompt_pwd = 0;
-            return 1;
+            arena_release(arith_arena);
+            arith_arena = NULL;
+            memset(arith_table, 0, sizeof(arith_table));
+            narith = 0;
         }
-        if (strncmp(cmd, "PS2=", 4) == 0)
+        if (arith_arena == NULL)
         {
-            change_prompt(cmd);
-            *prompt_pwd = 1;
-            return 1;
+            arith_arena = arena_create(16384);
+            arith_arena->refs = 1;
         }
-        return 0;
-}
 
-int is_echo(char *cmd, int exit_status)
-{
-    char *env; 
-    if (strncmp(cmd, "echo ", 5) != 0)
-    {
-        return 0;
-    }
-    else 
-    {
-        if ((env = strchr(cmd, '$')) == NULL)
+        /* An expression that does not parse gives its nodes back and is not counted */
+        block = arith_arena->next != NULL ? arith_arena->next : arith_arena;
+        used = block->used;
+        expr = (arith_expr_t *)arena_alloc(arith_arena, sizeof(arith_expr_t));
+        expr->text = (char *)memcpy(arena_alloc(arith_arena, len + 1), text, len);
+        expr->text[len] = '\0';
+        expr->len = len;
+        expr->hash = hash;
+        if ((expr->root = arith_parse(expr->text, len, &error)) != NULL)
         {
-            return 0;
+            expr->next = *bucket;
+            *bucket = expr;
+            narith++;
         }
         else
         {
-            if (strncmp(env, "$PWD", 5) == 0)
-            {
-                printf("%s\n", path);
-                return 1;
-            }
-            else if (strcmp(cmd, "echo $?") == 0)
-            {
-                printf("%d\n", exit_status);
-            }
-            else if (strcmp(cmd, "echo $$") == 0)
-            {
-                printf("%d\n", getpid());
-            }
-            else
-            {
-                env = getenv(++env);
-                if (env != NULL)
-                printf("%s\n", env);
-                return 1;
-            }
+            arena_rewind(arith_arena, block, used);
+            arith_error = error;
         }
     }
-}
 
-void ignore_foreground_signals(int signum)
-{
-    /* This is just to ignore the foreground signals by shell */
+    if (arith_error == NULL)
+    {
+        arith_depth++;
+        *result = arith_run(expr->root, sh);
+        arith_depth--;
+    }
+    if (arith_error == NULL)
+        return 0;
+
+    /* A variable holding an expression fails with the one that uses it */
+    if (arith_depth == 0)
+    {
+        for (idx = 0; idx < (int)len && isspace((unsigned char)text[idx]); idx++)
+            ;
+        for (end = len; end > idx && isspace((unsigned char)text[end - 1]); end--)
+            ;
+        fprintf(stderr, "mini_shell : %.*s : %s\n", end - idx, text + idx, arith_error);
+        arith_error = NULL;
+    }
+    return -1;
 }
 
-process_t *release_process_resource(group_t *group, process_t *process)
+/* Tree of an expression in the arena of the cache, NULL with *error set when it is not valid */
+arith_node_t *arith_parse(const char *text, size_t len, const char **error)
 {
-    int idx;
-    group_t *grp_ptr = group;
-    process_t *proc_ptr = grp_ptr->proc_link;
-    process_t *prev_proc;
-
-    if (grp_ptr->proc_link == process)
-    {
-        /* Free memory allocated for command line arguments */
-        for (idx = 0; process->argv[idx] != NULL; idx++)
-            free(process->argv[idx]);
+    arith_parser_t parser = {text, 0, len, NULL, arith_arena};
+    arith_node_t *root;
 
-        grp_ptr->proc_link = grp_ptr->proc_link->proc_link; 
-        /* Release process resource */
-        free(process);
-        /* Decrement no of process in group */
-        grp_ptr->nprocess--;
+    /* An empty expression is 0 */
+    arith_blanks(&parser);
+    if (parser.pos == len)
+        return arith_node(&parser, ARITH_NUM, NULL, NULL);
 
-        /* Return next process in the group */
-        return grp_ptr->proc_link;
-    }
-    else
+    root = arith_expr(&parser, 1);
+    arith_blanks(&parser);
+    if (root != NULL && parser.pos < len)
     {
-        while (proc_ptr != NULL)
-        {
-            if (proc_ptr == process)
-                break;
-            prev_proc = proc_ptr;
-            proc_ptr = proc_ptr->proc_link;
-        }
-
-        if (proc_ptr == NULL)
-        {
-            printf("ERROR : Unable to find process in the group\n");
-            exit(0);
-        }
-        else
-        {
-            /* Free memory allocated for command line arguments */
-            for (idx = 0; process->argv[idx] != NULL; idx++)
-                free(process->argv[idx]);
-
-            prev_proc->proc_link = process->proc_link;
-            /* Release process resource */
-            free(process);
-            /* Decrement no of process in group */
-            grp_ptr->nprocess--;
-            /* return next process in the group */
-            return prev_proc->proc_link;
-        }
+        parser.error = "syntax error in expression";
+        root = NULL;
     }
+    *error = parser.error;
+    return root;
 }
 
-process_t *release_group_resource(group_t **session_leader)
+/*
+ * Precedence climbing : an operand, then binary operators binding at
+ * least as tight as min_prec, each with the operators that bind tighter
+ * on its right. Assignments, ?: and ** group right to left.
+ */
+arith_node_t *arith_expr(arith_parser_t *parser, int min_prec)
 {
-    int idx;
-    group_t *grp_ptr = *session_leader;
-    group_t *prev_grp;
+    arith_node_t *left, *middle, *right;
+    arith_binary_t *binary;
 
-    while (grp_ptr != NULL)
+    if ((left = arith_unary(parser)) == NULL)
+        return NULL;
+    while (1)
     {
-        if (grp_ptr->nprocess == 0)
+        arith_blanks(parser);
+        for (binary = arith_binaries; binary->text != NULL; binary++)
+            if (strncmp(parser->text + parser->pos, binary->text, strlen(binary->text)) == 0)
+                break;
+        if (binary->text == NULL || binary->prec < min_prec)
+            return left;
+        parser->pos += strlen(binary->text);
+
+        if (binary->prec == 2)
         {
-            if (grp_ptr == *session_leader)
+            /* NAME = and NAME op= : the operator of a compound one is kept in assign_op */
+            if (left->op != ARITH_VAR || left->assign_op != ARITH_ASSIGN)
             {
-                *session_leader = grp_ptr->group_link;
-                /* Release group resource */
-                free(grp_ptr);
-                grp_ptr = *session_leader;
-                prev_grp = grp_ptr;
+                parser->error = "attempted assignment to non-variable";
+                return NULL;
             }
-            else
+            if ((right = arith_expr(parser, 2)) == NULL)
+                return NULL;
+            left = arith_node(parser, ARITH_ASSIGN, left, right);
+            left->assign_op = binary->op;
+        }
+        else if (binary->op == ARITH_COND)
+        {
+            if ((middle = arith_expr(parser, 1)) == NULL)
+                return NULL;
+            arith_blanks(parser);
+            if (parser->text[parser->pos] != ':')
             {
-                prev_grp->group_link = grp_ptr->group_link;
-                /* Release group resource */
-                free(grp_ptr);
-                grp_ptr = prev_grp->group_link;
+                parser->error = "':' expected for conditional expression";
+                return NULL;
             }
+            parser->pos++;
+            if ((right = arith_expr(parser, 3)) == NULL)
+                return NULL;
+            left = arith_node(parser, ARITH_COND, left, middle);
+            left->third = right;
         }
         else
         {
-            /* Store previous group */
-            prev_grp = grp_ptr;
-
-            /* Move to next group */
-            grp_ptr = grp_ptr->group_link;
+            right = arith_expr(parser, binary->op == ARITH_POW ? binary->prec : binary->prec + 1);
+            if (right == NULL)
+                return NULL;
+            left = arith_node(parser, binary->op, left, right);
         }
     }
 }
 
-/* Print info for each process with pid */
-void print_resource_for_my_shell(group_t *session_leader)
+/* Operand : a number, a variable, ( expression ), or a unary operator and its operand */
+arith_node_t *arith_unary(arith_parser_t *parser)
 {
-    int idx, proc_count = 0;
-    group_t *grp_ptr = session_leader;
-    process_t * proc_ptr;
+    const char *text = parser->text;
+    arith_node_t *node;
+    size_t start;
+    char c;
 
-    if (session_leader != NULL)
+    arith_blanks(parser);
+    c = text[parser->pos];
+
+    /* ++NAME and --NAME, or two signs when no name follows */
+    if ((c == '+' || c == '-') && text[parser->pos + 1] == c)
     {
-        printf("%-6s%-9s%-11s%-11s%-11s%-11s\n","PID", "PGID", "STATUS", "STAT", "SIGNAL", "COMMAND");
-        printf("------------------------------------------------------------\n");
+        start = parser->pos;
+        parser->pos += 2;
+        arith_blanks(parser);
+        if (isalpha((unsigned char)text[parser->pos]) || text[parser->pos] == '_')
+            return arith_node(parser, c == '+' ? ARITH_PREINC : ARITH_PREDEC, arith_variable(parser), NULL);
+        parser->pos = start;
     }
-    while (grp_ptr != NULL)
+
+    switch (c)
     {
-        proc_count = 0;
-        proc_ptr = grp_ptr->proc_link;
-        while (proc_ptr != NULL)
+        case '+':
+        case '-':
+        case '!':
+        case '~':
+            parser->pos++;
+            if ((node = arith_unary(parser)) == NULL)
+                return NULL;
+            return arith_node(parser, c == '+' ? ARITH_PLUS : c == '-' ? ARITH_NEG : c == '!' ? ARITH_NOT : ARITH_BITNOT,
+                              node, NULL);
+        case '(':
+            parser->pos++;
+            if ((node = arith_expr(parser, 1)) == NULL)
+                return NULL;
+            arith_blanks(parser);
+            if (text[parser->pos] != ')')
+            {
+                parser->error = "missing )";
+                return NULL;
+            }
+            parser->pos++;
+            return node;
+        case '$':
+            return arith_variable(parser);
+        case '\0':
+            parser->error = "operand expected";
+            return NULL;
+    }
+
+    if (isdigit((unsigned char)c))
+    {
+        /* Numbers are decimal, 0 octal, 0x hex or BASE#digits */
+        start = parser->pos;
+        parser->pos += strspn(text + parser->pos, NAME_CHARS "#@");
+        node = arith_node(parser, ARITH_NUM, NULL, NULL);
+        if (arith_number(text + start, parser->pos - start, &node->value) == -1)
         {
-            proc_count++;
+            parser->error = "invalid number";
+            return NULL;
+        }
+        return node;
+    }
 
-            printf("%-6d", proc_ptr->pid);
-            printf("%-9d", proc_ptr->pgid);
+    if (isalpha((unsigned char)c) || c == '_')
+    {
+        node = arith_variable(parser);
 
-            if(grp_ptr->status == FG)
-            printf("%-11s", "Foreground");
-            else
-            printf("%-11s", "Background");
+        /* NAME++ and NAME-- */
+        start = parser->pos;
+        arith_blanks(parser);
+        if ((text[parser->pos] == '+' || text[parser->pos] == '-') && text[parser->pos + 1] == text[parser->pos])
+        {
+            parser->pos += 2;
+            return arith_node(parser, text[parser->pos - 1] == '+' ? ARITH_POSTINC : ARITH_POSTDEC, node, NULL);
+        }
+        parser->pos = start;
+        return node;
+    }
 
-            printf("%-11s", proc_ptr->status);
+    parser->error = "syntax error in expression";
+    return NULL;
+}
 
-            if (strcmp(proc_ptr->status, "stopped") == 0)
-            printf("%-11s", proc_ptr->signal);
-            else
-            printf("%-11s", " ");
+arith_node_t *arith_node(arith_parser_t *parser, arith_op_t op, arith_node_t *left, arith_node_t *right)
+{
+    arith_node_t *node = (arith_node_t *)arena_alloc(parser->arena, sizeof(arith_node_t));
 
-            if (proc_count == 1)
-                printf("%-11s ", proc_ptr->argv[0]);
-            else
-                printf("| %-10s", proc_ptr->argv[0]);
+    memset(node, 0, sizeof(arith_node_t));
+    node->op = op;
+    node->left = left;
+    node->right = right;
+    return node;
+}
 
-            puts("");
+/*
+ * NAME, or $NAME, ${NAME} and the special parameters, which are read
+ * but not assigned : those have ARITH_VAR in assign_op, NAME has
+ * ARITH_ASSIGN. Names that are not valid are looked up with
+ * variable_value and get no hash.
+ */
+arith_node_t *arith_variable(arith_parser_t *parser)
+{
+    const char *name = parser->text + parser->pos;
+    arith_node_t *node = arith_node(parser, ARITH_VAR, NULL, NULL);
+    int braced = 0;
 
-            proc_ptr = proc_ptr->proc_link;
-        }
-        grp_ptr = grp_ptr->group_link;
+    node->assign_op = ARITH_ASSIGN;
+    if (*name == '$')
+    {
+        node->assign_op = ARITH_VAR;
+        braced = name[1] == '{';
+        name += 1 + braced;
     }
-    return;
+
+    if (node->assign_op == ARITH_VAR && braced && isdigit((unsigned char)*name))
+        node->name_len = strspn(name, "0123456789");
+    else if (node->assign_op == ARITH_VAR && *name != '\0' && strchr("?$#@*0123456789", *name) != NULL)
+        node->name_len = 1;
+    else
+        node->name_len = strspn(name, NAME_CHARS);
+
+    if (node->name_len == 0 || (braced && name[node->name_len] != '}'))
+    {
+        parser->error = "bad substitution";
+        return NULL;
+    }
+    node->name = name;
+    if (valid_name(name, node->name_len))
+        node->hash = hash_name(name, node->name_len);
+    parser->pos = name + node->name_len + braced - parser->text;
+    return node;
 }
 
-/* Print info for each each group with pgid */
-void jobs(group_t **session_leader)
+void arith_blanks(arith_parser_t *parser)
 {
-    int idx = 0;
-    group_t *grp_ptr = *session_leader;
-    process_t * proc_ptr;
+    while (parser->pos < parser->len && isspace((unsigned char)parser->text[parser->pos]))
+        parser->pos++;
+}
 
-    if (*session_leader != NULL)
+/* Digits of a number, in base 10, 8 after a 0, 16 after 0x or BASE (2 to 64) before # */
+int arith_number(const char *text, size_t len, int64_t *value)
+{
+    uint64_t result = 0;
+    size_t pos = 0;
+    int base = 10, digit;
+    const char *sharp;
+
+    if (len == 0)
+        return -1;
+    if ((sharp = (const char *)memchr(text, '#', len)) != NULL)
     {
-        printf("%-6s%-9s%-11s%-11s%-11s%-11s\n"," ", "PGID", "STATUS", "STAT", "SIGNAL", "COMMAND");
-        printf("------------------------------------------------------------\n");
+        for (base = 0; pos < (size_t)(sharp - text); pos++)
+        {
+            if (!isdigit((unsigned char)text[pos]) || (base = base * 10 + text[pos] - '0') > 64)
+                return -1;
+        }
+        if (base < 2 || ++pos == len)
+            return -1;
     }
-    else
+    else if (len > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X'))
     {
-        return;
+        base = 16;
+        pos = 2;
     }
-    while (grp_ptr != NULL)
-    {
-            idx++;
-            if (idx == 1)
-                printf("[%2d]+ ", idx);
-            else if (idx == 2)
-                printf("[%2d]- ", idx);
-            else
-                printf("[%2d]  ", idx);
+    else if (text[0] == '0')
+        base = 8;
 
-            printf("%-9d", grp_ptr->pgid);
+    /* Letters are 10 to 35 in either case up to base 36, then a-z, A-Z, @ and _ */
+    for (; pos < len; pos++)
+    {
+        if (isdigit((unsigned char)text[pos]))
+            digit = text[pos] - '0';
+        else if (islower((unsigned char)text[pos]))
+            digit = text[pos] - 'a' + 10;
+        else if (isupper((unsigned char)text[pos]))
+            digit = text[pos] - 'A' + (base <= 36 ? 10 : 36);
+        else if (text[pos] == '@')
+            digit = 62;
+        else if (text[pos] == '_')
+            digit = 63;
+        else
+            return -1;
+        if (digit >= base)
+            return -1;
+        result = result * base + digit;
+    }
+    *value = (int64_t)result;
+    return 0;
+}
 
-            if(grp_ptr->status == FG)
-            printf("%-11s", "Foreground");
-            else if (grp_ptr->status == BG)
-            printf("%-11s", "Background");
+/* Value of a tree, 0 once arith_error is set */
+int64_t arith_run(arith_node_t *node, shell_t *sh)
+{
+    int64_t value;
 
-            if (grp_ptr->proc_link != NULL)
-            printf("%-11s",grp_ptr->proc_link->status);
+    if (arith_error != NULL)
+        return 0;
+    switch (node->op)
+    {
+        case ARITH_NUM:
+            return node->value;
+        case ARITH_VAR:
+            return arith_fetch(node, sh);
+        case ARITH_NEG:
+            return (int64_t)(0 - (uint64_t)arith_run(node->left, sh));
+        case ARITH_PLUS:
+            return arith_run(node->left, sh);
+        case ARITH_NOT:
+            return !arith_run(node->left, sh);
+        case ARITH_BITNOT:
+            return ~arith_run(node->left, sh);
+        case ARITH_PREINC:
+        case ARITH_PREDEC:
+            value = (int64_t)((uint64_t)arith_fetch(node->left, sh) + (node->op == ARITH_PREINC ? 1 : -1));
+            arith_store(node->left, value);
+            return value;
+        case ARITH_POSTINC:
+        case ARITH_POSTDEC:
+            value = arith_fetch(node->left, sh);
+            arith_store(node->left, (int64_t)((uint64_t)value + (node->op == ARITH_POSTINC ? 1 : -1)));
+            return value;
+        case ARITH_LAND:
+            return arith_run(node->left, sh) && arith_run(node->right, sh);
+        case ARITH_LOR:
+            return arith_run(node->left, sh) || arith_run(node->right, sh);
+        case ARITH_COND:
+            return arith_run(node->left, sh) ? arith_run(node->right, sh) : arith_run(node->third, sh);
+        case ARITH_COMMA:
+            arith_run(node->left, sh);
+            return arith_run(node->right, sh);
+        case ARITH_ASSIGN:
+            value = arith_run(node->right, sh);
+            if (node->assign_op != ARITH_ASSIGN)
+                value = arith_binop(node->assign_op, arith_fetch(node->left, sh), value);
+            arith_store(node->left, value);
+            return value;
+        default:
+            value = arith_run(node->left, sh);
+            return arith_binop(node->op, value, arith_run(node->right, sh));
+    }
+}
 
-            printf("%-11s", grp_ptr->proc_link->signal);
+/* Value of a variable : unset or empty is 0, text that is no number is evaluated as an expression */
+int64_t arith_fetch(arith_node_t *node, shell_t *sh)
+{
+    const char *text, *value;
+    variable_t *var;
+    size_t len;
+    int64_t result;
+    int negative = 0;
 
-            proc_ptr = grp_ptr->proc_link;
-            while (proc_ptr != NULL)
-            {
-                if(proc_ptr->proc_link != NULL)
-                printf("%s | ",proc_ptr->argv[0]);
-                else
-                printf("%s",proc_ptr->argv[0]);
-                proc_ptr = proc_ptr->proc_link;
-            }
-            puts("");
-            grp_ptr = grp_ptr->group_link;
+    if (node->hash != 0)
+    {
+        var = variables.nslots > 0 ? var_slot(node->name, node->name_len, node->hash) : NULL;
+        value = var != NULL && var->name != NULL ? var->value : NULL;
     }
-    return;
+    else
+        value = variable_value(node->name, node->name_len, sh);
+    if ((text = value) == NULL)
+        return 0;
+
+    while (isspace((unsigned char)*value))
+        value++;
+    if (*value == '-' || *value == '+')
+        negative = *value++ == '-';
+    for (len = strlen(value); len > 0 && isspace((unsigned char)value[len - 1]); len--)
+        ;
+    if (len == 0 && !negative)
+        return 0;
+    if (arith_number(value, len, &result) == 0)
+        return negative ? (int64_t)(0 - (uint64_t)result) : result;
+
+    if (arith_depth >= ARITH_DEPTH)
+    {
+        arith_error = "expression recursion level exceeded";
+        return 0;
+    }
+    return arith_eval(text, strlen(text), &result, sh) == 0 ? result : 0;
 }
 
-/* Wait for foreground process group */
-void wait_for_fg(group_t **session_leader, int *exit_status)
+void arith_store(arith_node_t *node, int64_t value)
 {
-    int idx, status, wait_status;
-    group_t *grp_ptr;
-    process_t *proc_ptr;
+    char number[24];
 
-        /* Code to wait for children to complete execution*/
-        grp_ptr = *session_leader;
-        while (grp_ptr != NULL)
-        {
-            /* Update status of Foreground/Background process */
-            if (grp_ptr->status == FG)
+    if (arith_error != NULL)
+        return;
+    snprintf(number, sizeof(number), "%" PRId64, value);
+    var_set(node->name, node->name_len, number, 0);
+}
+
+/* Binary operators that evaluate both sides, + - * and << wrap around */
+int64_t arith_binop(arith_op_t op, int64_t left, int64_t right)
+{
+    uint64_t result = 1, base = (uint64_t)left;
+
+    switch (op)
+    {
+        case ARITH_POW:
+            if (right < 0)
             {
-                idx = 0;
-                proc_ptr = grp_ptr->proc_link;
-                while (proc_ptr != NULL)
-                {
-                    idx++;
+                arith_error = "exponent less than 0";
+                return 0;
+            }
+            for (; right > 0; right >>= 1, base *= base)
+                if (right & 1)
+                    result *= base;
+            return (int64_t)result;
+        case ARITH_MUL:
+            return (int64_t)((uint64_t)left * (uint64_t)right);
+        case ARITH_DIV:
+        case ARITH_MOD:
+            if (right == 0)
+            {
+                arith_error = "division by 0";
+                return 0;
+            }
+            /* INT64_MIN / -1 does not fit, it wraps to itself */
+            if (right == -1)
+                return op == ARITH_DIV ? (int64_t)(0 - (uint64_t)left) : 0;
+            return op == ARITH_DIV ? left / right : left % right;
+        case ARITH_ADD:
+            return (int64_t)((uint64_t)left + (uint64_t)right);
+        case ARITH_SUB:
+            return (int64_t)((uint64_t)left - (uint64_t)right);
+        case ARITH_SHL:
+            return (int64_t)((uint64_t)left << (right & 63));
+        case ARITH_SHR:
+            return left >> (right & 63);
+        case ARITH_LT:
+            return left < right;
+        case ARITH_LE:
+            return left <= right;
+        case ARITH_GT:
+            return left > right;
+        case ARITH_GE:
+            return left >= right;
+        case ARITH_EQ:
+            return left == right;
+        case ARITH_NE:
+            return left != right;
+        case ARITH_AND:
+            return left & right;
+        case ARITH_XOR:
+            return left ^ right;
+        case ARITH_OR:
+            return left | right;
+        default:
+            return 0;
+    }
+}
 
-#ifdef DEBUG
-                    printf("Waiting for %d %s to terminate\n", proc_ptr->pid, proc_ptr->argv[0]);
-#endif
-                    wait_status = waitpid(proc_ptr->pid, &status, WUNTRACED);
-                    if (wait_status == -1) 
-                    {
-                        perror("waitpid on foreground process");
-                        exit(EXIT_FAILURE);
-                    }
+/* Environment of a command with NAME=value in front : the exported variables with those put over them */
+char **command_env(command_t *command, arena_t *arena)
+{
+    int idx;
+    size_t count = 0, nenv, len;
+    char **env = var_environ();
+    char **envp;
 
-#ifdef DEBUG
-                    printf("Foreground process %d %s has changed state\n", proc_ptr->pid, proc_ptr->argv[0]);
-#endif
-                    if (WIFEXITED(status))
-                    {
-                        *exit_status = WEXITSTATUS(status);
-#ifdef DEBUG
-                        printf("exited, status=%d\n", WEXITSTATUS(status));
-#endif
-                        proc_ptr->status = stat[EXITED];
+    for (nenv = 0; env[nenv] != NULL; nenv++)
+        ;
+    envp = (char **)arena_alloc(arena, (nenv + command->nassigns + 1) * sizeof(char *));
+    for (nenv = 0; env[nenv] != NULL; nenv++)
+    {
+        len = strchr(env[nenv], '=') - env[nenv] + 1;
+        for (idx = 0; idx < command->nassigns; idx++)
+            if (strncmp(env[nenv], command->assigns[idx], len) == 0)
+                break;
+        if (idx == command->nassigns)
+            envp[count++] = env[nenv];
+    }
+    for (idx = 0; idx < command->nassigns; idx++)
+        envp[count++] = command->assigns[idx];
+    envp[count] = NULL;
+    return envp;
+}
 
-                        proc_ptr = release_process_resource(grp_ptr, proc_ptr);
-                        continue;
-                    }
-                    else if (WIFSIGNALED(status))
-                    {
-                        *exit_status = WTERMSIG(status) + 128;
-#ifdef DEBUG
-                        printf("killed by signal %d\n", WTERMSIG(status));
-#endif
-                        proc_ptr->status = stat[SIGNALLED];
-                        proc_ptr->status = stat[KILLED];
+/* Builtins are found by name through a small open addressing table */
+void init_builtins(void)
+{
+    int idx;
+    unsigned int slot;
 
-#ifdef DEBUG
-                        if (WTERMSIG(status) == 11)
-                            printf("Segmentation fault(core dumped)\n");
-#endif
+    for (idx = 0; builtins[idx].name != NULL; idx++)
+    {
+        slot = hash_string(builtins[idx].name) % BUILTIN_BUCKETS;
+        while (builtin_index[slot] != NULL)
+            slot = (slot + 1) % BUILTIN_BUCKETS;
+        builtin_index[slot] = &builtins[idx];
+    }
+}
 
-                        proc_ptr = release_process_resource(grp_ptr, proc_ptr);
-                        continue;
-                    }
-                    else if (WIFSTOPPED(status))
-                    {
-                        *exit_status = WSTOPSIG(status) + 128;
-#ifdef DEBUG
-                        printf("stopped by signal %d\n", WSTOPSIG(status));
-#endif
-                        proc_ptr->status = stat[STOPPED];
-
-                        switch (WSTOPSIG(status))
-                        {
-                            case 19:
-                                proc_ptr->signal = sig[1];
-                                break;
-                            case 20:
-                                proc_ptr->signal = sig[2];
-                                break;
-                            case 21:
-                                proc_ptr->signal = sig[3];
-                                break;
-                            case 22:
-                                break;
-                                proc_ptr->signal = sig[4];
-                        }
+/* Find a builtin by name, NULL when it is not one */
+builtin_t *find_builtin(const char *name)
+{
+    unsigned int slot = hash_string(name) % BUILTIN_BUCKETS;
 
-                    }
-                    else if(WIFCONTINUED(status))
-                    {
-#ifdef DEBUG
-                        printf("continued\n");
-#endif
-                        proc_ptr->status = stat[RUNNING];
-                    }
-                    /* Move to next process */
-                    proc_ptr = proc_ptr->proc_link;
-                } /* Bracket for foreground process */
-                grp_ptr->status = BG;
+    for (; builtin_index[slot] != NULL; slot = (slot + 1) % BUILTIN_BUCKETS)
+        if (strcmp(builtin_index[slot]->name, name) == 0)
+            return builtin_index[slot];
+    return NULL;
+}
 
-            } /* bracket for process looping */
+/* Find a function by name, NULL when there is none */
+function_t *find_function(const char *name)
+{
+    function_t *function;
 
-            /* Move to next group */
-            grp_ptr = grp_ptr->group_link;
+    if (nfunctions == 0)
+        return NULL;
+    for (function = function_table[hash_string(name) % FUNCTION_BUCKETS]; function != NULL; function = function->next)
+        if (strcmp(function->name, name) == 0)
+            return function;
+    return NULL;
+}
 
-        } /* bracket for group looping */
-        release_group_resource(session_leader);
-        return;
+/* Define or replace a function, it keeps a reference to the arena its body is in */
+void define_function(const char *name, pipeline_t *body, arena_t *arena)
+{
+    function_t *function;
+    function_t **bucket;
+
+    if ((function = find_function(name)) == NULL)
+    {
+        function = (function_t *)malloc(sizeof(function_t));
+        function->name = strdup(name);
+        bucket = &function_table[hash_string(name) % FUNCTION_BUCKETS];
+        function->next = *bucket;
+        *bucket = function;
+        nfunctions++;
+    }
+    else
+        arena_release(function->arena);
+    function->body = body;
+    function->arena = arena;
+    arena->refs++;
 }
 
-/* Wait for background process group */
-void update_status_of_bg(group_t **session_leader)
+/* Remove a function, -1 when there is none by that name */
+int remove_function(const char *name)
 {
-    int idx, status, wait_status;
-    group_t *grp_ptr;
-    process_t *proc_ptr;
+    function_t *function;
+    function_t **link;
 
-    /* Code to wait for children to complete execution*/
-    grp_ptr = *session_leader;
-    while (grp_ptr != NULL)
+    for (link = &function_table[hash_string(name) % FUNCTION_BUCKETS]; (function = *link) != NULL; link = &function->next)
     {
-        /* Update status of Foreground/Background process */
-        if (grp_ptr->status == BG)
+        if (strcmp(function->name, name) == 0)
         {
-            idx = 0;
-            proc_ptr = grp_ptr->proc_link;
-            while (proc_ptr != NULL)
-            {
-                idx++;
+            *link = function->next;
+            arena_release(function->arena);
+            free(function->name);
+            free(function);
+            nfunctions--;
+            return 0;
+        }
+    }
+    return -1;
+}
 
-#ifdef DEBUG
-                printf("Waiting for %d %s to terminate\n", proc_ptr->pid, proc_ptr->argv[0]);
-#endif
-                if ((wait_status = waitpid(proc_ptr->pid, &status, WNOHANG|WUNTRACED|WCONTINUED)) == 0)
-                {
-                    proc_ptr = proc_ptr->proc_link;
-                    continue;
-                }
+/*
+ * Run a function with its words as the positional parameters and a scope
+ * for its locals. The commands of its body are expanded in a scratch
+ * arena that holds the one of the body, so a new definition while it
+ * runs does not free it. Returns the exit status.
+ */
+int call_function(function_t *function, int argc, char *argv[], shell_t *sh)
+{
+    int nparams = sh->nparams, loop_depth = sh->loop_depth, exec_last = sh->exec_last;
+    char **params = sh->params;
+    arena_t *scratch;
+
+    sh->params = argv + 1;
+    sh->nparams = argc - 1;
+    sh->loop_depth = 0;
+    sh->exec_last = 0;
+    sh->function_depth++;
+    var_push_scope();
+    scratch = arena_child(function->arena);
+    run_list(function->body, scratch, sh);
+    arena_release(scratch);
+    var_pop_scope();
+    sh->function_depth--;
+    if (sh->control == CTRL_RETURN)
+        sh->control = CTRL_NONE;
+    sh->params = params;
+    sh->nparams = nparams;
+    sh->loop_depth = loop_depth;
+    sh->exec_last = exec_last;
+    return sh->exit_status;
+}
 
-                if (wait_status == -1) 
+/*
+ * Run a compound command on its tree in the shell, returns its exit
+ * status. Loops expand the commands of each pass in a scratch arena,
+ * emptied for the next pass unless a job started in it still holds it.
+ */
+int run_compound(compound_t *compound, arena_t *arena, shell_t *sh)
+{
+    int idx, status = 0, exec_last = sh->exec_last;
+    size_t nfields = 0;
+    char **words;
+    const char *subject;
+    case_item_t *item;
+    arena_t *scratch;
+
+    /* More commands run after the last one of the body, it is never exec'd in place */
+    sh->exec_last = 0;
+    switch (compound->type)
+    {
+        case COMPOUND_IF:
+            run_list(compound->cond, arena, sh);
+            if (sh->control != CTRL_NONE)
+            {
+                status = sh->exit_status;
+                break;
+            }
+            if (sh->exit_status == 0)
+                run_list(compound->body, arena, sh);
+            else if (compound->else_part != NULL)
+                run_list(compound->else_part, arena, sh);
+            else
+                sh->exit_status = 0;
+            status = sh->exit_status;
+            break;
+        case COMPOUND_WHILE:
+        case COMPOUND_UNTIL:
+            sh->loop_depth++;
+            scratch = arena_child(arena);
+            while (1)
+            {
+                run_list(compound->cond, scratch, sh);
+                if (!loop_continues(sh) || (sh->exit_status == 0) != (compound->type == COMPOUND_WHILE))
+                    break;
+                run_list(compound->body, scratch, sh);
+                status = sh->exit_status;
+                if (!loop_continues(sh))
+                    break;
+                scratch = arena_reuse(scratch);
+            }
+            arena_release(scratch);
+            sh->loop_depth--;
+            break;
+        case COMPOUND_FOR:
+            /* The words are expanded once, before the first pass */
+            if (compound->words == NULL)
+            {
+                nfields = sh->nparams;
+                words = (char **)arena_alloc(arena, (nfields + 1) * sizeof(char *));
+                memcpy(words, sh->params, nfields * sizeof(char *));
+            }
+            else
+            {
+                for (idx = 0; idx < compound->nwords; idx++)
+                    split_word(compound->words[idx], &nfields, arena, sh);
+                if (expand_failed)
                 {
-                    perror("waitpid on background process");
-                    exit(EXIT_FAILURE);
+                    expand_failed = 0;
+                    status = 1;
+                    break;
                 }
-#ifdef DEBUG
-                printf("Background process %d %s has changed state\n", proc_ptr->pid, proc_ptr->argv[0]);
-#endif
-                if (WIFEXITED(status))
+                words = (char **)arena_alloc(arena, (nfields + 1) * sizeof(char *));
+                memcpy(words, field_vec, nfields * sizeof(char *));
+            }
+            sh->loop_depth++;
+            scratch = arena_child(arena);
+            for (idx = 0; idx < (int)nfields; idx++)
+            {
+                var_set(compound->name, strlen(compound->name), words[idx], 0);
+                run_list(compound->body, scratch, sh);
+                status = sh->exit_status;
+                if (!loop_continues(sh))
+                    break;
+                scratch = arena_reuse(scratch);
+            }
+            arena_release(scratch);
+            sh->loop_depth--;
+            break;
+        case COMPOUND_CASE:
+            /* The first item with a pattern matching the word runs */
+            subject = expand_word(compound->name, arena, sh);
+            for (item = compound->items; item != NULL; item = item->next)
+            {
+                for (idx = 0; idx < item->npatterns; idx++)
+                    if (fnmatch(expand_pattern(item->patterns[idx], arena, sh), subject, 0) == 0)
+                        break;
+                if (expand_failed)
                 {
-#ifdef DEBUG
-                    printf("exited, status=%d\n", WEXITSTATUS(status));
-#endif
-                    proc_ptr->status = stat[EXITED];
-
-                    proc_ptr = release_process_resource(grp_ptr, proc_ptr);
-                    continue;
+                    expand_failed = 0;
+                    status = 1;
+                    break;
                 }
-                else if (WIFSIGNALED(status))
+                if (idx < item->npatterns)
                 {
-                    proc_ptr->status = stat[SIGNALLED];
-#ifdef DEBUG
-                    printf("killed by signal %d\n", WTERMSIG(status));
-#endif
-                    proc_ptr->status = stat[KILLED];
+                    run_list(item->body, arena, sh);
+                    status = item->body != NULL ? sh->exit_status : 0;
+                    break;
+                }
+            }
+            break;
+        case COMPOUND_GROUP:
+            run_list(compound->body, arena, sh);
+            status = sh->exit_status;
+            break;
+        case COMPOUND_FUNCTION:
+            define_function(compound->name, compound->body, arena);
+            break;
+    }
+    sh->exec_last = exec_last;
+    return status;
+}
 
-                    if (WTERMSIG(status) == 11)
-#ifdef DEBUG
-                        printf("Segmentation fault(core dumped)\n");
-#endif
+/*
+ * After a pass of a loop, whether the loop goes on. break and continue
+ * count down the loops they leave, the last one stops or goes on with
+ * its next pass. return and an interrupt leave every loop.
+ */
+int loop_continues(shell_t *sh)
+{
+    control_t control = sh->control;
 
-                    proc_ptr = release_process_resource(grp_ptr, proc_ptr);
-                    continue;
-                }
-                else if (WIFSTOPPED(status))
-                {
-#ifdef DEBUG
-                    printf("stopped by signal %d\n", WSTOPSIG(status));
-#endif
-                    proc_ptr->status = stat[STOPPED];
+    if (control == CTRL_NONE)
+        return 1;
+    if (control == CTRL_RETURN || control == CTRL_INTERRUPT || --sh->control_levels > 0)
+        return 0;
+    sh->control = CTRL_NONE;
+    return control == CTRL_CONTINUE;
+}
+
+/*
+ * Run a builtin, a function or a compound command in the shell, its
+ * redirections last only for the command
+ */
+int run_in_shell(command_t *command, builtin_t *builtin, function_t *function, arena_t *arena, shell_t *sh)
+{
+    int idx, status, nsaved = 0;
+    int saved_fd[MAX_SAVED_FDS], target_fd[MAX_SAVED_FDS];
+    redirect_t *redir;
+
+    fflush(stdout);
 
-                    switch (WSTOPSIG(status))
+    /* Only as many redirections as can be put back are taken, the shell's own descriptors must not stay changed */
+    for (redir = command->redirects; redir != NULL; redir = redir->next)
+        nsaved++;
+    if (nsaved > MAX_SAVED_FDS)
+    {
+        fprintf(stderr, "mini_shell : more than %d redirections\n", MAX_SAVED_FDS);
+        return 1;
+    }
+
+    /* Keep a copy of every descriptor the redirections replace */
+    nsaved = 0;
+    for (redir = command->redirects; redir != NULL; redir = redir->next)
+    {
+        target_fd[nsaved] = redir->fd;
+        saved_fd[nsaved++] = fcntl(redir->fd, F_DUPFD_CLOEXEC, 10);
+    }
+
+    if (apply_redirects(command->redirects) == -1)
+        status = 1;
+    else if (builtin != NULL)
+        status = builtin->run(command->argc, command->argv, sh);
+    else if (function != NULL)
+        status = call_function(function, command->argc, command->argv, sh);
+    else
+        status = run_compound(command->compound, arena, sh);
+
+    fflush(stdout);
+    fflush(stderr);
+
+    /* Put the descriptors back in reverse order */
+    for (idx = nsaved - 1; idx >= 0; idx--)
+    {
+        if (saved_fd[idx] == -1)
+            close(target_fd[idx]);
+        else
+        {
+            dup2(saved_fd[idx], target_fd[idx]);
+            close(saved_fd[idx]);
+        }
+    }
+    return status;
+}
+
+/*
+ * Start every process of a pipeline in one process group. Between two
+ * stages the shell keeps only the read end of the last pipe, so a
+ * pipeline of any length needs three descriptors at most, all close on
+ * exec. The pump of a fan-out adds the read ends of its branches.
+ * Returns -1 when a pipe cannot be made, with no process of the group
+ * left running.
+ */
+int launch_group(group_t *group, shell_t *sh)
+{
+    int branch_idx;
+    int nclose, nbranches = 0, next_branch = 0;
+    int in_fd, out_fd, next_in_fd = -1;
+    int close_fds[MAX_CLOSE_FDS];
+    int pipe_fds[2];
+    int *branch_fds = NULL;
+    char *path;
+    pid_t cpid;
+    process_t *proc_ptr;
+    builtin_t *builtin;
+
+    /* Output of builtins must come out before that of the children */
+    fflush(stdout);
+
+    proc_ptr = group->proc_link;
+    while (proc_ptr != NULL)
+    {
+        nclose = 0;
+        out_fd = -1;
+
+        /* Read from the pipe of previous process, or from the pump for the first of a branch */
+        in_fd = proc_ptr->branch ? branch_fds[next_branch++] : next_in_fd;
+        next_in_fd = -1;
+
+        /* The pump writes to a pipe per branch, read ends first then write ends */
+        if (proc_ptr->nbranches > 0)
+        {
+            nbranches = proc_ptr->nbranches;
+            branch_fds = (int *)malloc(2 * nbranches * sizeof(int));
+            for (branch_idx = 0; branch_idx < nbranches; branch_idx++)
+            {
+                if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+                {
+                    perror("pipe");
+                    while (--branch_idx >= 0)
                     {
-                        case 19:
-                            proc_ptr->signal = sig[1];
-                            break;
-                        case 20:
-                            proc_ptr->signal = sig[2];
-                            break;
-                        case 21:
-                            proc_ptr->signal = sig[3];
-                            break;
-                        case 22:
-                            break;
-                            proc_ptr->signal = sig[4];
+                        close(branch_fds[branch_idx]);
+                        close(branch_fds[nbranches + branch_idx]);
                     }
-                } 
-                else if(WIFCONTINUED(status))
-                {
-#ifdef DEBUG
-                    printf("continued\n");
-#endif
-                    proc_ptr->status = stat[RUNNING];
+                    if (in_fd != -1)
+                        close(in_fd);
+                    free(branch_fds);
+                    abort_launch(group, sh);
+                    return -1;
                 }
-                /* Move to next process */
-                proc_ptr = proc_ptr->proc_link;
+                if (pipe_size != 0)
+                    fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_size);
+                branch_fds[branch_idx] = pipe_fds[0];
+                branch_fds[nbranches + branch_idx] = pipe_fds[1];
+            }
+            proc_ptr->fanout_fds = branch_fds;
+        }
+        /* Last process in the pipeline or in a branch will not create a pipe */
+        else if (proc_ptr->proc_link != NULL && !proc_ptr->proc_link->branch)
+        {
+            /* Close on exec, so no other stage keeps a write end open */
+            if (pipe2(pipe_fds, O_CLOEXEC) == -1)
+            {
+                perror("pipe");
+                if (in_fd != -1)
+                    close(in_fd);
+                for (branch_idx = next_branch; branch_fds != NULL && branch_idx < nbranches; branch_idx++)
+                    close(branch_fds[branch_idx]);
+                free(branch_fds);
+                abort_launch(group, sh);
+                return -1;
+            }
+            /* A larger buffer lets stages run longer between switches */
+            if (pipe_size != 0)
+                fcntl(pipe_fds[1], F_SETPIPE_SZ, pipe_size);
+            out_fd = pipe_fds[1];
+            next_in_fd = pipe_fds[0];
+            close_fds[nclose++] = pipe_fds[0];
+        }
 
-            } /* bracket for process looping */
+        /* The pump and compound commands run in a forked child without exec */
+        if (proc_ptr->nbranches > 0 || proc_ptr->compound != NULL)
+            cpid = fork_process(proc_ptr, NULL, NULL, group->pgid, in_fd, out_fd, close_fds, nclose, sh);
+        /* A command whose words all expanded to nothing runs nothing */
+        else if (proc_ptr->argv[0] == NULL)
+            cpid = -1;
+        /* So do functions and builtins */
+        else if ((proc_ptr->function = find_function(proc_ptr->argv[0])) != NULL)
+            cpid = fork_process(proc_ptr, NULL, NULL, group->pgid, in_fd, out_fd, close_fds, nclose, sh);
+        else if ((builtin = find_builtin(proc_ptr->argv[0])) != NULL)
+            cpid = fork_process(proc_ptr, NULL, builtin, group->pgid, in_fd, out_fd, close_fds, nclose, sh);
+        /* Resolve the command once in the shell, children exec it directly */
+        else if ((path = hash_lookup(proc_ptr->argv[0], NULL)) == NULL)
+        {
+            fprintf(stderr, "%s : command not found\n", proc_ptr->argv[0]);
+            shell_stats.exec_failures++;
+            cpid = -1;
         }
-        /* Move to next group */
-        grp_ptr = grp_ptr->group_link;
+        /* A placed job is set up in the child before exec, which posix_spawn cannot do */
+        else if (launch_mode == LAUNCH_SPAWN && !group->placed)
+            cpid = spawn_process(proc_ptr, path, group->pgid, in_fd, out_fd, close_fds, nclose,
+                                 proc_ptr->envp ? proc_ptr->envp : var_environ());
+        else
+            cpid = fork_process(proc_ptr, path, NULL, group->pgid, in_fd, out_fd, close_fds, nclose, sh);
 
-    } /* bracket for group looping */
-    release_group_resource(session_leader);
-    return;
+        /* The child has its ends now, keep only the read end for the next one */
+        if (in_fd != -1)
+            close(in_fd);
+        if (out_fd != -1)
+            close(out_fd);
+
+        /* Only the pump writes to the branches */
+        if (proc_ptr->nbranches > 0)
+            for (branch_idx = 0; branch_idx < nbranches; branch_idx++)
+                close(branch_fds[nbranches + branch_idx]);
+
+        if (cpid == -1)
+        {
+            /* Command could not be started, drop it from the group */
+            if (proc_ptr->argv[0] != NULL)
+                sh->exit_status = 127;
+            proc_ptr = release_process_resource(group, proc_ptr);
+            continue;
+        }
+
+        /* Store pid in process structure */
+        proc_ptr->pid = cpid;
+        index_process(proc_ptr);
+
+        /* First started process becomes the group leader */
+        if (group->pgid == 0)
+            group->pgid = cpid;
+        proc_ptr->pgid = group->pgid;
+
+        /* Move to next process */
+        proc_ptr = proc_ptr->proc_link;
+    }
+
+    free(branch_fds);
+    return 0;
 }
 
-/* Put a background process to foreground */
-void fg(int terminal, group_t **session_leader, pid_t shell_pid, int *exit_status)
+/* A launch failed halfway : kill and reap the processes already started, then empty the group */
+void abort_launch(group_t *group, shell_t *sh)
 {
-    int status;
     process_t *proc_ptr;
 
-    if (*session_leader != NULL)
-    if ((*session_leader)->proc_link != NULL)
-    if ((*session_leader)->status == BG)
-    {
-        printf("%s\n",(*session_leader)->proc_link->argv[0]);
+    for (proc_ptr = group->proc_link; proc_ptr != NULL; proc_ptr = proc_ptr->proc_link)
+        if (proc_ptr->pid > 0)
+            kill(proc_ptr->pid, SIGKILL);
 
-        /* Give the control terminal to following group */
-        if (tcsetpgrp(terminal, (*session_leader)->pgid) == -1)
+    proc_ptr = group->proc_link;
+    while (proc_ptr != NULL)
+    {
+        if (proc_ptr->pid > 0)
         {
-            perror("tcsetpgrp1");
-            exit(0);
+            waitpid(proc_ptr->pid, NULL, 0);
+            unindex_process(proc_ptr);
         }
+        proc_ptr = release_process_resource(group, proc_ptr);
+    }
+    sh->exit_status = 1;
+}
 
-        proc_ptr = (*session_leader)->proc_link;
-        while (proc_ptr != NULL)
-        {
-            /* Send SIGCONT to each process to resume execution */
-            kill(proc_ptr->pid, SIGCONT);
-            proc_ptr = proc_ptr->proc_link;
-        }
-        (*session_leader)->status = FG;
+/* Start a process with posix_spawn, the child is set up before exec without copying the shell */
+pid_t spawn_process(process_t *process, char *path, pid_t pgid, int in_fd, int out_fd, int *close_fds, int nclose, char *envp[])
+{
+    int idx, error = 0, nhere = 0;
+    int here_fds[MAX_SAVED_FDS];
+    pid_t cpid;
+    sigset_t mask;
+    redirect_t *redir;
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    struct timespec begin;
 
-        /* Wait for process group to change state */
-        wait_for_fg(session_leader, exit_status);
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    TRACE(TRACE_SPAWN, 'B', 0, 0, 0, process->argv[0]);
+    posix_spawnattr_init(&attr);
+    posix_spawn_file_actions_init(&actions);
 
-        /* Retrive the controlling terminal back */
-        if (tcsetpgrp(terminal, shell_pid) == -1)
+    /* Join the pipeline group, or lead a new one when pgid is 0 */
+    posix_spawnattr_setpgroup(&attr, pgid);
+
+    /* Undo the signal dispositions of the shell */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTSTP);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGTTOU);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+
+    /* Connect the pipes */
+    for (idx = 0; idx < nclose; idx++)
+        posix_spawn_file_actions_addclose(&actions, close_fds[idx]);
+    if (in_fd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, in_fd, 0);
+        posix_spawn_file_actions_addclose(&actions, in_fd);
+    }
+    if (out_fd != -1)
+    {
+        posix_spawn_file_actions_adddup2(&actions, out_fd, 1);
+        posix_spawn_file_actions_addclose(&actions, out_fd);
+    }
+
+    /* Redirections of the command come after the pipes */
+    for (redir = process->redirects; redir != NULL; redir = redir->next)
+    {
+        if (redir->type == REDIR_DUP)
+            posix_spawn_file_actions_adddup2(&actions, redir->dup_fd, redir->fd);
+        else if (redir->type == REDIR_CLOSE)
+            posix_spawn_file_actions_addclose(&actions, redir->fd);
+        else if (redir->type == REDIR_HEREDOC || redir->type == REDIR_HERESTRING)
         {
-            perror("tcsetpgrp2");
-            exit(0);
+            /* The child reads the body straight from a memfd */
+            if (nhere == MAX_SAVED_FDS)
+                error = EMFILE;
+            else if ((here_fds[nhere] = here_document_fd(redir)) == -1)
+                error = errno;
+            else
+                posix_spawn_file_actions_adddup2(&actions, here_fds[nhere++], redir->fd);
         }
+        else
+            posix_spawn_file_actions_addopen(&actions, redir->fd, redir->path, redirect_flags(redir->type), 0666);
     }
-    return;
+
+    if (error == 0)
+        error = posix_spawn(&cpid, path, &actions, &attr, process->argv, envp);
+    TRACE(TRACE_SPAWN, 'E', 0, 0, error == 0 ? cpid : -1, process->argv[0]);
+
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    for (idx = 0; idx < nhere; idx++)
+        close(here_fds[idx]);
+
+    if (error != 0)
+    {
+        fprintf(stderr, "%s : %s\n", process->argv[0], strerror(error));
+        shell_stats.exec_failures++;
+        return -1;
+    }
+
+    /* posix_spawn returns once the child has exec'd */
+    shell_stats.started++;
+    hist_record(&shell_stats.fork_exec, elapsed_ns(&begin));
+    return cpid;
+}
+
+/* Start a process with fork and exec, or with fork only to run a builtin */
+pid_t fork_process(process_t *process, char *path, builtin_t *builtin, pid_t pgid, int in_fd, int out_fd, int *close_fds, int nclose, shell_t *sh)
+{
+    int idx, status;
+    pid_t cpid;
+    sigset_t mask;
+    struct timespec begin;
+
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    TRACE(TRACE_FORK, 'B', 0, 0, 0, process->argv[0]);
+    cpid = fork();
+
+    switch (cpid)
+    {
+        case -1:
+            /* Error handling for forking */
+            TRACE(TRACE_FORK, 'E', 0, 0, -1, process->argv[0]);
+            perror("fork");
+            return -1;
+        case 0:
+            TRACE(TRACE_CHILD, 'B', getpid(), pgid ? pgid : getpid(), 0, process->argv[0]);
+
+            /* Join the pipeline group, or lead a new one when pgid is 0 */
+            if (setpgid(0, pgid) == -1)
+            {
+                perror("setpgid");
+                exit(1);
+            }
+
+            if (process->group->placed)
+                place_task(0, &process->group->placement);
+
+            /* Undo the signal dispositions of the shell */
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTSTP, SIG_DFL);
+            signal(SIGQUIT, SIG_DFL);
+            signal(SIGTTOU, SIG_DFL);
+            sigemptyset(&mask);
+            sigprocmask(SIG_SETMASK, &mask, NULL);
+
+            /* The background runs of parallel go on in the shell */
+            parallel_runs = NULL;
+
+            /* Connect the pipes */
+            for (idx = 0; idx < nclose; idx++)
+                close(close_fds[idx]);
+            if (in_fd != -1)
+            {
+                if (dup2(in_fd, 0) == -1)
+                {
+                    perror("dup2");
+                    exit(1);
+                }
+                close(in_fd);
+            }
+            if (out_fd != -1)
+            {
+                if (dup2(out_fd, 1) == -1)
+                {
+                    perror("dup2");
+                    exit(1);
+                }
+                close(out_fd);
+            }
+            if (apply_redirects(process->redirects) == -1)
+                _exit(1);
+
+            TRACE(TRACE_CHILD, 'E', getpid(), getpgid(0), 0, process->argv[0]);
+
+            /* The pump of a fan-out feeds the branches and leaves */
+            if (process->nbranches > 0)
+                _exit(fan_out(process->fanout_fds, process->nbranches));
+
+            /*
+             * A compound command or a function runs on the tree here. Its
+             * jobs stay in this job's group and leave the terminal alone,
+             * the jobs of the shell are not this child's to wait for.
+             */
+            if (process->compound != NULL || process->function != NULL)
+            {
+                sh->terminal = -1;
+                sh->job_pgid = getpgid(0);
+                sh->session_leader = NULL;
+                report_jobs = 0;
+                for (idx = 0; process->argv[idx] != NULL; idx++)
+                    ;
+                if (process->function != NULL)
+                    status = call_function(process->function, idx, process->argv, sh);
+                else
+                    status = run_compound(process->compound, process->group->arena, sh);
+                fflush(stdout);
+                _exit(status);
+            }
+
+            /* A builtin stage runs here and leaves */
+            if (builtin != NULL)
+            {
+                for (idx = 0; process->argv[idx] != NULL; idx++)
+                    ;
+                status = builtin->run(idx, process->argv, sh);
+                fflush(stdout);
+                _exit(status);
+            }
+
+            /* Do exec with a process in the pipeline */
+            TRACE(TRACE_EXEC, 'i', getpid(), getpgid(0), 0, path);
+            execve(path, process->argv, process->envp ? process->envp : var_environ());
+            TRACE(TRACE_EXEC_FAILED, 'i', getpid(), getpgid(0), errno, path);
+            fprintf(stderr, "%s : %s\n", process->argv[0], strerror(errno));
+            _exit(126);
+        default :
+            /* Set the group in parent too, so it is in place whichever runs first */
+            setpgid(cpid, pgid ? pgid : cpid);
+            TRACE(TRACE_FORK, 'E', 0, 0, cpid, process->argv[0]);
+
+            /* The child may not have exec'd yet, this is the part the shell waits for */
+            shell_stats.started++;
+            hist_record(&shell_stats.fork_exec, elapsed_ns(&begin));
+            return cpid;
+    }
+}
+
+/*
+ * Copy standard input to the write ends fds[n..2n) without reading it.
+ * Each chunk is tee'd into a private pipe per branch, the last one takes
+ * it with splice, and every branch is fed from its own pipe as fast as it
+ * reads, so partial writes need no copy. The next chunk is taken once all
+ * branches have the last one, which holds the producer to the pace of
+ * the slowest. A branch that exits is dropped. Returns the exit status.
+ */
+int fan_out(int *fds, int nbranches)
+{
+    int idx, last, npoll, nlive = nbranches;
+    int (*stage)[2];
+    int *polled;
+    long size;
+    ssize_t len, moved;
+    size_t *pending;
+    struct pollfd *pfds;
+
+    /* The read ends are for the branches */
+    for (idx = 0; idx < nbranches; idx++)
+        close(fds[idx]);
+    fds += nbranches;
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Private pipes as large as the input, so a whole chunk always fits */
+    if ((size = fcntl(0, F_GETPIPE_SZ)) == -1)
+    {
+        perror("|>");
+        return 1;
+    }
+    stage = (int (*)[2])malloc(nbranches * sizeof(*stage));
+    pending = (size_t *)calloc(nbranches, sizeof(size_t));
+    pfds = (struct pollfd *)malloc(nbranches * sizeof(struct pollfd));
+    polled = (int *)malloc(nbranches * sizeof(int));
+    for (idx = 0; idx < nbranches; idx++)
+    {
+        if (fds[idx] == -1)
+            nlive--;
+        else if (pipe(stage[idx]) == -1 || fcntl(stage[idx][1], F_SETPIPE_SZ, size) < size)
+        {
+            perror("|>");
+            return 1;
+        }
+    }
+
+    while (nlive > 0)
+    {
+        /* Take the next chunk : tee into all but the last live branch, splice into that one */
+        for (last = nbranches - 1; fds[last] == -1; last--)
+            ;
+        len = size;
+        for (idx = 0; idx <= last; idx++)
+        {
+            if (fds[idx] == -1)
+                continue;
+            if (idx < last)
+                moved = tee(0, stage[idx][1], len, 0);
+            else
+                moved = splice(0, NULL, stage[idx][1], NULL, len, 0);
+            if (moved <= 0)
+                return moved == 0 ? 0 : (perror("|>"), 1);
+            len = moved;
+            pending[idx] = moved;
+        }
+
+        /* Hand the chunk out, each branch at its own pace */
+        while (1)
+        {
+            for (idx = npoll = 0; idx < nbranches; idx++)
+            {
+                if (pending[idx] == 0)
+                    continue;
+                pfds[npoll].fd = fds[idx];
+                pfds[npoll].events = POLLOUT;
+                polled[npoll++] = idx;
+            }
+            if (npoll == 0)
+                break;
+            if (poll(pfds, npoll, -1) == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                perror("|>");
+                return 1;
+            }
+
+            for (last = 0; last < npoll; last++)
+            {
+                if (pfds[last].revents == 0)
+                    continue;
+                idx = polled[last];
+                moved = splice(stage[idx][0], NULL, fds[idx], NULL, pending[idx], SPLICE_F_NONBLOCK);
+                if (moved > 0)
+                    pending[idx] -= moved;
+                else if (moved == -1 && errno == EAGAIN)
+                    continue;
+                else
+                {
+                    /* The branch is gone, the others go on */
+                    close(fds[idx]);
+                    fds[idx] = -1;
+                    pending[idx] = 0;
+                    nlive--;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+/* Open flags for a file redirection */
+int redirect_flags(redirect_type_t type)
+{
+    switch (type)
+    {
+        case REDIR_IN:
+            return O_RDONLY;
+        case REDIR_APPEND:
+            return O_WRONLY | O_CREAT | O_APPEND;
+        default:
+            return O_WRONLY | O_CREAT | O_TRUNC;
+    }
+}
+
+/* Apply redirections in the calling process, -1 when one fails */
+int apply_redirects(redirect_t *redir)
+{
+    int fd;
+
+    for (; redir != NULL; redir = redir->next)
+    {
+        switch (redir->type)
+        {
+            case REDIR_DUP:
+                if (dup2(redir->dup_fd, redir->fd) == -1)
+                {
+                    fprintf(stderr, "mini_shell : %d : %s\n", redir->dup_fd, strerror(errno));
+                    return -1;
+                }
+                break;
+            case REDIR_CLOSE:
+                close(redir->fd);
+                break;
+            case REDIR_HEREDOC:
+            case REDIR_HERESTRING:
+                if ((fd = here_document_fd(redir)) == -1)
+                {
+                    fprintf(stderr, "mini_shell : here-document : %s\n", strerror(errno));
+                    return -1;
+                }
+                dup2(fd, redir->fd);
+                close(fd);
+                break;
+            default:
+                if ((fd = open(redir->path, redirect_flags(redir->type), 0666)) == -1)
+                {
+                    fprintf(stderr, "mini_shell : %s : %s\n", redir->path, strerror(errno));
+                    return -1;
+                }
+                if (fd != redir->fd)
+                {
+                    dup2(fd, redir->fd);
+                    close(fd);
+                }
+        }
+    }
+    return 0;
+}
+
+/*
+ * Put the body of a here-document or here-string in a memfd sealed
+ * against changes, positioned at its start. There is no temp file and no
+ * process writing into a pipe.
+ */
+int here_document_fd(redirect_t *redir)
+{
+    int fd, saved_errno;
+
+    if ((fd = memfd_create("heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+        return -1;
+    if (write(fd, redir->body, redir->body_len) != (ssize_t)redir->body_len ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+        lseek(fd, 0, SEEK_SET) == -1)
+    {
+        saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+    return fd;
+}
+
+/* Read the bodies of the here-documents met so far, in order, from the lines after theirs */
+void read_heredocs(lexer_t *lex)
+{
+    redirect_t *redir;
+    char *line;
+    size_t len, line_len;
+    long used;
+
+    for (redir = lex->heredocs; redir != NULL; redir = redir->here_link)
+    {
+        len = 0;
+        while ((line = next_line(lex->sh, "> ")) != NULL)
+        {
+            /* <<- takes leading tabs off every line and the delimiter */
+            if (redir->strip_tabs)
+                line += strspn(line, "\t");
+            if (strcmp(line, redir->path) == 0)
+                break;
+
+            /* Marked variables take at most twice the text */
+            line_len = strlen(line);
+            if (len + 2 * line_len + 1 > body_size)
+            {
+                body_size = (len + 2 * line_len + 1) * 2;
+                body_buf = (char *)realloc(body_buf, body_size);
+            }
+            if (!redir->expand)
+            {
+                memcpy(body_buf + len, line, line_len);
+                len += line_len;
+            }
+            else
+            {
+                /* An unquoted delimiter lets $NAME through, \$ and \\ stay as $ and \ */
+                while (*line != '\0')
+                {
+                    if (*line == '\\' && (line[1] == '$' || line[1] == '\\'))
+                    {
+                        body_buf[len++] = line[1];
+                        line += 2;
+                    }
+                    else if (*line != '$')
+                        body_buf[len++] = *line++;
+                    else if ((used = mark_variable(line, body_buf, &len, 1)) == -1)
+                        body_buf[len++] = *line++;
+                    else
+                        line += used;
+                }
+            }
+            body_buf[len++] = '\n';
+        }
+        if (line == NULL)
+            fprintf(stderr, "mini_shell : here-document ended by end of input (wanted '%s')\n", redir->path);
+
+        redir->body = (char *)arena_alloc(lex->arena, len + 1);
+        memcpy(redir->body, body_buf, len);
+        redir->body[len] = '\0';
+        redir->body_len = len;
+    }
+    lex->heredocs = NULL;
+    lex->heredoc_tail = &lex->heredocs;
+}
+
+/*
+ * Parse command lines into a list of pipelines in one pass. Words,
+ * argument vectors and redirections are allocated from the arena of the
+ * line. A compound command still open at the end of the line goes on in
+ * the next lines of the input of sh, and the bodies of here-documents are
+ * read from the lines after theirs. Returns the length of the text parsed,
+ * or -1 after printing a message on a syntax error.
+ */
+int command_parser(char *cmd, arena_t *arena, pipeline_t **list, shell_t *sh)
+{
+    int len;
+    lexer_t lex;
+
+    lex.line = cmd;
+    lex.pos = lex.prev_end = 0;
+    lex.literal = 0;
+    lex.fanout = 0;
+    lex.pattern = 0;
+    lex.open = 0;
+    lex.heredocs = NULL;
+    lex.heredoc_tail = &lex.heredocs;
+    lex.sh = sh;
+    lex.arena = arena;
+    *list = NULL;
+
+    /* A word is never longer than the line, marked variables take 1.5 times their text */
+    if (word_size < 2 * strlen(cmd) + 1)
+    {
+        word_size = 2 * strlen(cmd) + 1;
+        word_buf = (char *)realloc(word_buf, word_size);
+    }
+
+    next_token(&lex);
+    if (parse_list(&lex, list) == -1)
+        return -1;
+
+    /* Only a word that closes nothing or a stray ;; or ) is left here */
+    if (lex.token != TOK_END)
+    {
+        syntax_error(&lex);
+        return -1;
+    }
+
+    /* The text may be overwritten by the lines read now */
+    len = strlen(lex.line);
+    read_heredocs(&lex);
+
+#ifdef DEBUG
+    /* Only for DEBUG : To print the parse tree */
+    {
+        int idx;
+        pipeline_t *pl;
+        command_t *command;
+
+        for (pl = *list; pl != NULL; pl = pl->next)
+        {
+            printf("New pipeline '%s' background = %d connector = %d\n", pl->text, pl->background, pl->connector);
+            for (command = pl->commands; command != NULL; command = command->next)
+            {
+                printf("New command\n");
+                for (idx = 0; idx < command->argc; idx++)
+                    printf("argv[%d] = %s\n", idx, command->argv[idx]);
+            }
+        }
+    }
+#endif
+    return len;
+}
+
+/*
+ * list : pipeline [(';' | '&' | '&&' | '||' | newline) pipeline]... It ends
+ * at the end of the text, at ';;' or ')', or at a reserved word that closes
+ * a compound command, all left for the caller to check.
+ */
+int parse_list(lexer_t *lex, pipeline_t **list)
+{
+    size_t start;
+    pipeline_t *pl;
+    pipeline_t **tail = list;
+
+    *list = NULL;
+    skip_newlines(lex);
+    while (!list_ends(lex))
+    {
+        start = lex->token_start;
+        if ((pl = parse_pipeline(lex)) == NULL)
+            return -1;
+
+        /* Text of the job, shown by jobs and in notifications */
+        pl->text = (char *)arena_alloc(lex->arena, lex->prev_end - start + 1);
+        memcpy(pl->text, lex->line + start, lex->prev_end - start);
+        pl->text[lex->prev_end - start] = '\0';
+        *tail = pl;
+        tail = &pl->next;
+
+        switch (lex->token)
+        {
+            case TOK_AMP:
+                pl->background = 1;
+                break;
+            case TOK_AND:
+                pl->connector = CONN_AND;
+                break;
+            case TOK_OR:
+                pl->connector = CONN_OR;
+                break;
+            case TOK_SEMI:
+            case TOK_NEWLINE:
+                break;
+            case TOK_END:
+            case TOK_DSEMI:
+            case TOK_RPAREN:
+                return 0;
+            default:
+                syntax_error(lex);
+                return -1;
+        }
+        next_token(lex);
+        skip_newlines(lex);
+
+        /* && and || need a pipeline after them */
+        if (pl->connector != CONN_SEQ && list_ends(lex))
+        {
+            syntax_error(lex);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Newlines between commands only separate them */
+void skip_newlines(lexer_t *lex)
+{
+    while (lex->token == TOK_NEWLINE)
+        next_token(lex);
+}
+
+/* Whether the token is the given reserved word, which is one only when unquoted */
+int is_reserved(lexer_t *lex, const char *word)
+{
+    return lex->token == TOK_WORD && !lex->quoted && !lex->expand && strcmp(lex->word, word) == 0;
+}
+
+/* Whether the token ends a list : the end of the text, ;; or ), or a word closing a compound command */
+int list_ends(lexer_t *lex)
+{
+    int idx;
+
+    if (lex->token == TOK_END || lex->token == TOK_DSEMI || lex->token == TOK_RPAREN)
+        return 1;
+    for (idx = 0; closing_words[idx] != NULL; idx++)
+        if (is_reserved(lex, closing_words[idx]))
+            return 1;
+    return 0;
+}
+
+/* Type of the compound command the token starts, -1 when it starts none */
+int compound_start(lexer_t *lex)
+{
+    int idx;
+
+    for (idx = 0; compound_words[idx] != NULL; idx++)
+        if (is_reserved(lex, compound_words[idx]))
+            return idx;
+    return -1;
+}
+
+/* Add a word to the vector reused between commands, returns the new count */
+int word_push(int count, char *word)
+{
+    if (count + 1 >= vec_size)
+    {
+        vec_size = vec_size ? vec_size * 2 : 64;
+        word_vec = (char **)realloc(word_vec, vec_size * sizeof(char *));
+    }
+    word_vec[count] = word;
+    return count + 1;
+}
+
+/* Copy of the first count words of the vector, ending with NULL, before nested commands reuse it */
+char **word_copy(int count, arena_t *arena)
+{
+    char **words = (char **)arena_alloc(arena, (count + 1) * sizeof(char *));
+
+    memcpy(words, word_vec, count * sizeof(char *));
+    words[count] = NULL;
+    return words;
+}
+
+/* pipeline : command ['|' command]... ['|>' '(' pipeline [',' pipeline]... ')'] */
+pipeline_t *parse_pipeline(lexer_t *lex)
+{
+    pipeline_t *pl;
+    pipeline_t **branch_tail;
+    command_t *command;
+    command_t **tail;
+    char *option;
+
+    pl = (pipeline_t *)arena_alloc(lex->arena, sizeof(pipeline_t));
+    memset(pl, 0, sizeof(pipeline_t));
+    tail = &pl->commands;
+
+    /* time in front reports the times of the whole pipeline */
+    if (is_reserved(lex, "time"))
+    {
+        pl->timed = 1;
+        next_token(lex);
+    }
+
+    /* run [--cpus LIST] [--nice N] [--ioclass CLASS[:LEVEL]] places the job */
+    if (is_reserved(lex, "run"))
+    {
+        pl->placement = (placement_t *)arena_alloc(lex->arena, sizeof(placement_t));
+        memset(pl->placement, 0, sizeof(placement_t));
+        next_token(lex);
+        while (lex->token == TOK_WORD && strncmp(lex->word, "--", 2) == 0)
+        {
+            option = lex->word;
+            if (next_token(lex) != TOK_WORD)
+            {
+                syntax_error(lex);
+                return NULL;
+            }
+            if (set_placement(pl->placement, option, lex->word) == -1)
+                return NULL;
+            next_token(lex);
+        }
+    }
+
+    while (1)
+    {
+        if ((command = parse_command(lex)) == NULL)
+            return NULL;
+        *tail = command;
+        tail = &command->next;
+        pl->ncommands++;
+
+        if (lex->token != TOK_PIPE)
+            break;
+        next_token(lex);
+        skip_newlines(lex);
+    }
+
+    if (lex->token != TOK_FANOUT)
+        return pl;
+
+    /* Branches of a fan-out are plain pipelines */
+    if (lex->fanout || (lex->fanout = 1, next_token(lex)) != TOK_LPAREN)
+    {
+        syntax_error(lex);
+        return NULL;
+    }
+    branch_tail = &pl->branches;
+    do
+    {
+        next_token(lex);
+        if ((*branch_tail = parse_pipeline(lex)) == NULL)
+            return NULL;
+        branch_tail = &(*branch_tail)->next;
+        pl->nbranches++;
+    } while (lex->token == TOK_COMMA);
+
+    if (lex->token != TOK_RPAREN)
+    {
+        syntax_error(lex);
+        return NULL;
+    }
+    lex->fanout = 0;
+    next_token(lex);
+    return pl;
+}
+
+/*
+ * command : [NAME=value]... [word | redirection word]... with at least one
+ * word or assignment, a compound command or (( expression )) and its
+ * redirections, or NAME '(' ')' compound command, which defines a function
+ */
+command_t *parse_command(lexer_t *lex)
+{
+    int argc = 0, nassigns = 0;
+    long expr_len;
+    char *mark;
+    command_t *command;
+    redirect_t **tail;
+
+    command = (command_t *)arena_alloc(lex->arena, sizeof(command_t));
+    memset(command, 0, sizeof(command_t));
+    tail = &command->redirects;
+
+    /* (( expression )) is let with the expression as its one word */
+    if (lex->token == TOK_LPAREN && lex->line[lex->pos] == '(')
+    {
+        if ((expr_len = arith_span(lex->line + lex->pos + 1)) == -1)
+        {
+            fprintf(stderr, "mini_shell : ((%.*s : missing ))\n", (int)strcspn(lex->line + lex->pos + 1, "\n"),
+                    lex->line + lex->pos + 1);
+            return NULL;
+        }
+        command->argc = 2;
+        command->argv = (char **)arena_alloc(lex->arena, 3 * sizeof(char *));
+        command->argv[0] = "let";
+        command->argv[1] = (char *)memcpy(arena_alloc(lex->arena, expr_len + 1), lex->line + lex->pos + 1, expr_len);
+        command->argv[1][expr_len] = '\0';
+        command->argv[2] = NULL;
+        lex->pos += 1 + expr_len + 2;
+        next_token(lex);
+        while (lex->token == TOK_REDIR)
+        {
+            if ((*tail = parse_redirect(lex, command)) == NULL)
+                return NULL;
+            tail = &(*tail)->next;
+            next_token(lex);
+        }
+        return command;
+    }
+
+    /* Reserved words start a compound command only where a command starts */
+    if (compound_start(lex) != -1)
+    {
+        if ((command->compound = parse_compound(lex)) == NULL)
+            return NULL;
+        while (lex->token == TOK_REDIR)
+        {
+            if ((*tail = parse_redirect(lex, command)) == NULL)
+                return NULL;
+            tail = &(*tail)->next;
+            next_token(lex);
+        }
+        command->argv = word_copy(0, lex->arena);
+        return command;
+    }
+
+    while (lex->token == TOK_WORD || lex->token == TOK_REDIR)
+    {
+        if (lex->token == TOK_WORD)
+        {
+            command->expand |= lex->expand;
+
+            /* Collect words in a vector reused between lines */
+            if (argc + nassigns + 1 >= vec_size)
+            {
+                vec_size = vec_size ? vec_size * 2 : 64;
+                word_vec = (char **)realloc(word_vec, vec_size * sizeof(char *));
+            }
+
+            /* Assignments before the command name go first in the vector */
+            if (argc == 0 && lex->assign)
+            {
+                word_vec[nassigns++] = lex->word;
+                next_token(lex);
+                continue;
+            }
+
+            /* export and local take assignments, whose values are not split */
+            if (argc > 0 && lex->assign && lex->expand &&
+                (strcmp(word_vec[nassigns], "export") == 0 || strcmp(word_vec[nassigns], "local") == 0))
+            {
+                for (mark = lex->word; (mark = strchr(mark, VAR_SPLIT)) != NULL; )
+                    *mark = VAR_QUOTED;
+            }
+            word_vec[nassigns + argc++] = lex->word;
+        }
+        else
+        {
+            if ((*tail = parse_redirect(lex, command)) == NULL)
+                return NULL;
+            tail = &(*tail)->next;
+        }
+        next_token(lex);
+    }
+
+    /* NAME () is followed by the body of a function */
+    if (lex->token == TOK_LPAREN && argc == 1 && nassigns == 0 && command->redirects == NULL && !command->expand)
+        return parse_function(lex, command, word_vec[0]);
+
+    if (argc == 0 && nassigns == 0)
+    {
+        syntax_error(lex);
+        return NULL;
+    }
+
+    /* Argument vector of the exact size, ending with NULL */
+    command->argc = argc;
+    command->argv = (char **)arena_alloc(lex->arena, (argc + 1) * sizeof(char *));
+    memcpy(command->argv, word_vec + nassigns, argc * sizeof(char *));
+    command->argv[argc] = NULL;
+    if (nassigns > 0)
+    {
+        command->nassigns = nassigns;
+        command->assigns = (char **)arena_alloc(lex->arena, nassigns * sizeof(char *));
+        memcpy(command->assigns, word_vec, nassigns * sizeof(char *));
+    }
+    return command;
+}
+
+/* Redirection operator and its target, which is the current token when it returns */
+redirect_t *parse_redirect(lexer_t *lex, command_t *command)
+{
+    redirect_t *redir;
+
+    redir = (redirect_t *)arena_alloc(lex->arena, sizeof(redirect_t));
+    memset(redir, 0, sizeof(redirect_t));
+    redir->type = lex->redir_type;
+    redir->fd = lex->redir_fd;
+    redir->strip_tabs = lex->strip_tabs;
+
+    /* Target of the redirection, the delimiter of a here-document is taken as it is */
+    lex->literal = redir->type == REDIR_HEREDOC;
+    next_token(lex);
+    lex->literal = 0;
+    if (lex->token != TOK_WORD)
+    {
+        syntax_error(lex);
+        return NULL;
+    }
+    command->expand |= lex->expand;
+    redir->expand = lex->expand;
+    if (redir->type == REDIR_DUP)
+    {
+        /* n>&m duplicates m, n>&- closes n */
+        if (strcmp(lex->word, "-") == 0)
+            redir->type = REDIR_CLOSE;
+        else if (lex->word[0] != '\0' && strspn(lex->word, "0123456789") == strlen(lex->word))
+            redir->dup_fd = atoi(lex->word);
+        else
+        {
+            fprintf(stderr, "mini_shell : %s : ambiguous redirect\n", lex->word);
+            return NULL;
+        }
+    }
+    else if (redir->type == REDIR_HEREDOC)
+    {
+        /* Variables in the body are expanded unless part of the delimiter is quoted */
+        redir->expand = !lex->quoted;
+        command->expand |= redir->expand;
+
+        /* The body is read from the lines after this one */
+        *lex->heredoc_tail = redir;
+        lex->heredoc_tail = &redir->here_link;
+    }
+    else if (redir->type == REDIR_HERESTRING)
+    {
+        /* <<< word feeds the word and a newline */
+        redir->body_len = strlen(lex->word) + 1;
+        redir->body = (char *)arena_alloc(lex->arena, redir->body_len + 1);
+        sprintf(redir->body, "%s\n", lex->word);
+    }
+    redir->path = lex->word;
+    return redir;
+}
+
+/*
+ * Compound command, the token is the reserved word that starts it :
+ *     if list then list [elif list then list]... [else list] fi
+ *     while list do list done, until list do list done
+ *     for NAME [in word...] do list done, with ; or a newline before do
+ *     case word in [[(] pattern [| pattern]... ) list ;;]... esac
+ *     { list }
+ * Until it is closed the lexer reads more lines at the end of the text.
+ */
+compound_t *parse_compound(lexer_t *lex)
+{
+    int count;
+    const char *close;
+    compound_t *compound;
+    case_item_t *item;
+    case_item_t **item_tail;
+
+    compound = (compound_t *)arena_alloc(lex->arena, sizeof(compound_t));
+    memset(compound, 0, sizeof(compound_t));
+    compound->type = (compound_type_t)compound_start(lex);
+    lex->open++;
+    next_token(lex);
+
+    switch (compound->type)
+    {
+        case COMPOUND_IF:
+            if (parse_if(lex, compound) == -1)
+                return NULL;
+            close = "fi";
+            break;
+        case COMPOUND_WHILE:
+        case COMPOUND_UNTIL:
+            if (parse_part(lex, &compound->cond, "do") == -1 || parse_part(lex, &compound->body, NULL) == -1)
+                return NULL;
+            close = "done";
+            break;
+        case COMPOUND_FOR:
+            if (lex->token != TOK_WORD || lex->quoted || !valid_name(lex->word, strlen(lex->word)))
+            {
+                syntax_error(lex);
+                return NULL;
+            }
+            compound->name = lex->word;
+            next_token(lex);
+            skip_newlines(lex);
+            if (is_reserved(lex, "in"))
+            {
+                /* Words up to ; or a newline, expanded each time the loop starts */
+                for (count = 0; next_token(lex) == TOK_WORD; )
+                    count = word_push(count, lex->word);
+                if (lex->token != TOK_SEMI && lex->token != TOK_NEWLINE)
+                {
+                    syntax_error(lex);
+                    return NULL;
+                }
+                compound->nwords = count;
+                compound->words = word_copy(count, lex->arena);
+                next_token(lex);
+            }
+            else if (lex->token == TOK_SEMI)
+                next_token(lex);
+            skip_newlines(lex);
+            if (!is_reserved(lex, "do"))
+            {
+                syntax_error(lex);
+                return NULL;
+            }
+            next_token(lex);
+            if (parse_part(lex, &compound->body, NULL) == -1)
+                return NULL;
+            close = "done";
+            break;
+        case COMPOUND_CASE:
+            if (lex->token != TOK_WORD)
+            {
+                syntax_error(lex);
+                return NULL;
+            }
+            compound->name = lex->word;
+            next_token(lex);
+            skip_newlines(lex);
+            if (!is_reserved(lex, "in"))
+            {
+                syntax_error(lex);
+                return NULL;
+            }
+
+            /* Glob characters of the quoted parts of patterns are escaped, so they match as they are */
+            lex->pattern = 1;
+            next_token(lex);
+            skip_newlines(lex);
+            item_tail = &compound->items;
+            while (!is_reserved(lex, "esac"))
+            {
+                item = (case_item_t *)arena_alloc(lex->arena, sizeof(case_item_t));
+                memset(item, 0, sizeof(case_item_t));
+                if (lex->token == TOK_LPAREN)
+                    next_token(lex);
+                for (count = 0; ; next_token(lex))
+                {
+                    if (lex->token != TOK_WORD)
+                    {
+                        syntax_error(lex);
+                        return NULL;
+                    }
+                    count = word_push(count, lex->word);
+                    if (next_token(lex) != TOK_PIPE)
+                        break;
+                }
+                if (lex->token != TOK_RPAREN)
+                {
+                    syntax_error(lex);
+                    return NULL;
+                }
+                item->npatterns = count;
+                item->patterns = word_copy(count, lex->arena);
+                lex->pattern = 0;
+                next_token(lex);
+
+                /* The list of an item may be empty, the last one needs no ;; */
+                if (parse_list(lex, &item->body) == -1)
+                    return NULL;
+                *item_tail = item;
+                item_tail = &item->next;
+                if (lex->token == TOK_DSEMI)
+                {
+                    lex->pattern = 1;
+                    next_token(lex);
+                    skip_newlines(lex);
+                }
+                else if (!is_reserved(lex, "esac"))
+                {
+                    syntax_error(lex);
+                    return NULL;
+                }
+            }
+            lex->pattern = 0;
+            close = "esac";
+            break;
+        default:
+            if (parse_part(lex, &compound->body, NULL) == -1)
+                return NULL;
+            close = "}";
+    }
+
+    if (!is_reserved(lex, close))
+    {
+        syntax_error(lex);
+        return NULL;
+    }
+
+    /* Closed before the next token, so that the end of the line is the end of the text */
+    lex->open--;
+    next_token(lex);
+    return compound;
+}
+
+/* Rest of an if after if or elif, up to the fi left for the caller */
+int parse_if(lexer_t *lex, compound_t *compound)
+{
+    compound_t *elif;
+
+    if (parse_part(lex, &compound->cond, "then") == -1 || parse_part(lex, &compound->body, NULL) == -1)
+        return -1;
+    if (is_reserved(lex, "elif"))
+    {
+        /* elif is an if alone in the else part, closed by the same fi */
+        next_token(lex);
+        elif = (compound_t *)arena_alloc(lex->arena, sizeof(compound_t));
+        memset(elif, 0, sizeof(compound_t));
+        elif->type = COMPOUND_IF;
+        compound->else_part = compound_pipeline(elif, lex->arena);
+        return parse_if(lex, elif);
+    }
+    if (is_reserved(lex, "else"))
+    {
+        next_token(lex);
+        return parse_part(lex, &compound->else_part, NULL);
+    }
+    return 0;
+}
+
+/* A list that may not be empty, followed by the reserved word end when it is given */
+int parse_part(lexer_t *lex, pipeline_t **list, const char *end)
+{
+    if (parse_list(lex, list) == -1)
+        return -1;
+    if (*list == NULL || (end != NULL && !is_reserved(lex, end)))
+    {
+        syntax_error(lex);
+        return -1;
+    }
+    if (end != NULL)
+        next_token(lex);
+    return 0;
+}
+
+/* Pipeline of a single compound command, without redirections */
+pipeline_t *compound_pipeline(compound_t *compound, arena_t *arena)
+{
+    pipeline_t *pl;
+    command_t *command;
+
+    command = (command_t *)arena_alloc(arena, sizeof(command_t));
+    memset(command, 0, sizeof(command_t));
+    command->argv = word_copy(0, arena);
+    command->compound = compound;
+    pl = (pipeline_t *)arena_alloc(arena, sizeof(pipeline_t));
+    memset(pl, 0, sizeof(pipeline_t));
+    pl->ncommands = 1;
+    pl->commands = command;
+    return pl;
+}
+
+/* NAME ( ) compound command : the token is the (, command holds NAME */
+command_t *parse_function(lexer_t *lex, command_t *command, char *name)
+{
+    size_t start;
+    compound_t *compound;
+    pipeline_t *body;
+
+    if (!valid_name(name, strlen(name)) || next_token(lex) != TOK_RPAREN)
+    {
+        syntax_error(lex);
+        return NULL;
+    }
+
+    /* The body may start on the next line */
+    lex->open++;
+    next_token(lex);
+    skip_newlines(lex);
+    lex->open--;
+    if (compound_start(lex) == -1)
+    {
+        syntax_error(lex);
+        return NULL;
+    }
+
+    compound = (compound_t *)arena_alloc(lex->arena, sizeof(compound_t));
+    memset(compound, 0, sizeof(compound_t));
+    compound->type = COMPOUND_FUNCTION;
+    compound->name = name;
+    body = (pipeline_t *)arena_alloc(lex->arena, sizeof(pipeline_t));
+    memset(body, 0, sizeof(pipeline_t));
+    start = lex->token_start;
+    if ((body->commands = parse_command(lex)) == NULL)
+        return NULL;
+    body->ncommands = 1;
+    body->text = (char *)arena_alloc(lex->arena, lex->prev_end - start + 1);
+    memcpy(body->text, lex->line + start, lex->prev_end - start);
+    body->text[lex->prev_end - start] = '\0';
+    compound->body = body;
+
+    command->compound = compound;
+    command->argv = word_copy(0, lex->arena);
+    return command;
+}
+
+/* Report the token the parser did not expect */
+void syntax_error(lexer_t *lex)
+{
+    if (lex->token == TOK_ERROR)
+        return;
+    if (lex->token == TOK_END && lex->open > 0)
+        fprintf(stderr, "mini_shell : syntax error : unexpected end of input\n");
+    else if (lex->token == TOK_END || lex->token == TOK_NEWLINE)
+        fprintf(stderr, "mini_shell : syntax error near unexpected token 'newline'\n");
+    else
+        fprintf(stderr, "mini_shell : syntax error near unexpected token '%.*s'\n",
+                (int)(lex->pos - lex->token_start), lex->line + lex->token_start);
+}
+
+/* Read the next token of the line */
+token_t next_token(lexer_t *lex)
+{
+    const char *line = lex->line;
+    size_t pos = lex->pos;
+    size_t digits;
+
+    lex->prev_end = pos;
+
+    /* Blanks separate tokens, a comment runs to the end of the line */
+    while (line[pos] == ' ' || line[pos] == '\t')
+        pos++;
+    if (line[pos] == '#')
+        pos += strcspn(line + pos, "\n");
+    lex->token_start = pos;
+
+    /* Digits right before < or > name the descriptor to redirect */
+    for (digits = 0; line[pos + digits] >= '0' && line[pos + digits] <= '9'; digits++)
+        ;
+    if (line[pos + digits] == '<' || line[pos + digits] == '>')
+    {
+        lex->redir_fd = digits ? atoi(line + pos) : line[pos] == '<' ? 0 : 1;
+        pos += digits;
+        lex->token = TOK_REDIR;
+        lex->strip_tabs = 0;
+
+        if (line[pos] == '<')
+        {
+            pos++;
+            if (line[pos] == '<')
+            {
+                /* <<word, <<-word and <<<word */
+                pos++;
+                lex->redir_type = REDIR_HEREDOC;
+                if (line[pos] == '<')
+                {
+                    pos++;
+                    lex->redir_type = REDIR_HERESTRING;
+                }
+                else if (line[pos] == '-')
+                {
+                    pos++;
+                    lex->strip_tabs = 1;
+                }
+            }
+            else if (line[pos] == '&')
+            {
+                pos++;
+                lex->redir_type = REDIR_DUP;
+            }
+            else
+                lex->redir_type = REDIR_IN;
+        }
+        else
+        {
+            pos++;
+            if (line[pos] == '>')
+            {
+                pos++;
+                lex->redir_type = REDIR_APPEND;
+            }
+            else if (line[pos] == '&')
+            {
+                pos++;
+                lex->redir_type = REDIR_DUP;
+            }
+            else
+                lex->redir_type = REDIR_OUT;
+        }
+        lex->pos = pos;
+        return lex->token;
+    }
+
+    switch (line[pos])
+    {
+        case '\0':
+            /* A compound command still open goes on in the next line */
+            if (lex->open > 0 && lex_more(lex) == 0)
+                return next_token(lex);
+            lex->token = TOK_END;
+            break;
+        case '\n':
+            lex->token = TOK_NEWLINE;
+            pos++;
+            break;
+        case '|':
+            if (line[pos + 1] == '>')
+            {
+                lex->token = TOK_FANOUT;
+                pos += 2;
+                break;
+            }
+            lex->token = line[pos + 1] == '|' ? TOK_OR : TOK_PIPE;
+            pos += lex->token == TOK_OR ? 2 : 1;
+            break;
+        case '&':
+            lex->token = line[pos + 1] == '&' ? TOK_AND : TOK_AMP;
+            pos += lex->token == TOK_AND ? 2 : 1;
+            break;
+        case ';':
+            lex->token = line[pos + 1] == ';' ? TOK_DSEMI : TOK_SEMI;
+            pos += lex->token == TOK_DSEMI ? 2 : 1;
+            break;
+        case '(':
+            lex->token = TOK_LPAREN;
+            pos++;
+            break;
+        case ')':
+            lex->token = TOK_RPAREN;
+            pos++;
+            break;
+        case ',':
+            /* Only the branches of a fan-out give a comma a meaning */
+            if (lex->fanout)
+            {
+                lex->token = TOK_COMMA;
+                pos++;
+                break;
+            }
+            /* fall through */
+        default:
+            lex->pos = pos;
+            lex->token = lex_word(lex) == -1 ? TOK_ERROR : TOK_WORD;
+            return lex->token;
+    }
+    lex->pos = pos;
+    return lex->token;
+}
+
+/*
+ * Add the next line to the text for a compound command still open at its
+ * end, after the bodies of the here-documents of the lines so far. The
+ * text is copied to text_buf first, as reading a line may overwrite it,
+ * and the lines are joined by newlines. Returns -1 at the end of input.
+ */
+int lex_more(lexer_t *lex)
+{
+    size_t len = strlen(lex->line), line_len;
+    char *line;
+
+    if (lex->sh == NULL)
+        return -1;
+    if (lex->line != text_buf)
+    {
+        if (len + 1 > text_size)
+        {
+            text_size = (len + 1) * 2;
+            text_buf = (char *)realloc(text_buf, text_size);
+        }
+        memcpy(text_buf, lex->line, len + 1);
+        lex->line = text_buf;
+    }
+    read_heredocs(lex);
+    if ((line = next_line(lex->sh, "> ")) == NULL)
+        return -1;
+
+    line_len = strlen(line);
+    if (len + line_len + 2 > text_size)
+    {
+        text_size = (len + line_len + 2) * 2;
+        text_buf = (char *)realloc(text_buf, text_size);
+    }
+    text_buf[len] = '\n';
+    memcpy(text_buf + len + 1, line, line_len + 1);
+    lex->line = text_buf;
+    if (word_size < 2 * line_len + 1)
+    {
+        word_size = 2 * line_len + 1;
+        word_buf = (char *)realloc(word_buf, word_size);
+    }
+    return 0;
+}
+
+/*
+ * Read a word, removing quotes and backslashes, into the arena. $NAME,
+ * ${NAME}, $? $$ $# $@ $* $0-$9, ${10} up and $((...)) are not looked up here but marked, so the
+ * command sees the values at the time it runs : VAR_SPLIT or VAR_QUOTED,
+ * the name, then VAR_END.
+ */
+int lex_word(lexer_t *lex)
+{
+    const char *line = lex->line;
+    const char *ends = lex->fanout ? " \t\n|&;<>()," : " \t\n|&;<>()";
+    size_t pos = lex->pos;
+    size_t len = 0, name_len;
+    long used;
+    char quote;
+
+    /* NAME=value in front of a command is an assignment */
+    name_len = strspn(line + pos, NAME_CHARS);
+    lex->assign = name_len > 0 && !isdigit((unsigned char)line[pos]) && line[pos + name_len] == '=';
+    lex->quoted = lex->expand = 0;
+
+    while (line[pos] != '\0' && strchr(ends, line[pos]) == NULL)
+    {
+        switch (line[pos])
+        {
+            case '\\':
+                /* Next character is taken as it is */
+                lex->quoted = 1;
+                pos++;
+                if (line[pos] != '\0')
+                {
+                    if (lex->pattern && strchr(GLOB_CHARS, line[pos]) != NULL)
+                        word_buf[len++] = '\\';
+                    word_buf[len++] = line[pos++];
+                }
+                break;
+            case '\'':
+            case '"':
+                lex->quoted = 1;
+                quote = line[pos++];
+                while (line[pos] != quote)
+                {
+                    if (line[pos] == '\0')
+                    {
+                        fprintf(stderr, "mini_shell : unexpected end of line looking for matching %c\n", quote);
+                        return -1;
+                    }
+                    /* In double quotes a backslash only escapes \ " $ and ` */
+                    if (quote == '"' && line[pos] == '\\' && line[pos + 1] != '\0' && strchr("\\\"$`", line[pos + 1]) != NULL)
+                        pos++;
+                    else if (quote == '"' && line[pos] == '$' && !lex->literal)
+                    {
+                        if ((used = mark_variable(line + pos, word_buf, &len, 1)) == -1)
+                            return -1;
+                        lex->expand |= used > 1;
+                        pos += used;
+                        continue;
+                    }
+                    if (lex->pattern && strchr(GLOB_CHARS, line[pos]) != NULL)
+                        word_buf[len++] = '\\';
+                    word_buf[len++] = line[pos++];
+                }
+                pos++;
+                break;
+            case '$':
+                if (!lex->literal)
+                {
+                    if ((used = mark_variable(line + pos, word_buf, &len, 0)) == -1)
+                        return -1;
+                    lex->expand |= used > 1;
+                    pos += used;
+                    break;
+                }
+                /* fall through */
+            default:
+                word_buf[len++] = line[pos++];
+        }
+    }
+
+    word_buf[len] = '\0';
+    lex->word = (char *)memcpy(arena_alloc(lex->arena, len + 1), word_buf, len + 1);
+    lex->pos = pos;
+    return 0;
+}
+
+/*
+ * Mark the variable at the $ of src into dst at *len. Returns the number
+ * of characters of src taken, 1 for a $ that starts no name and is kept,
+ * -1 after a message for a bad ${...}.
+ */
+long mark_variable(const char *src, char *dst, size_t *len, int quoted)
+{
+    size_t name_len;
+    long expr_len;
+    const char *name = src + 1;
+    int braced = *name == '{';
+
+    /* $((expression)) is marked as ( and the text, which is evaluated when the command runs */
+    if (src[1] == '(' && src[2] == '(')
+    {
+        if ((expr_len = arith_span(src + 3)) == -1)
+        {
+            fprintf(stderr, "mini_shell : %.*s : missing ))\n", (int)strcspn(src, "\n"), src);
+            return -1;
+        }
+        dst[(*len)++] = quoted ? VAR_QUOTED : VAR_SPLIT;
+        dst[(*len)++] = '(';
+        memcpy(dst + *len, src + 3, expr_len);
+        *len += expr_len;
+        dst[(*len)++] = VAR_END;
+        return 3 + expr_len + 2;
+    }
+
+    name += braced;
+    if (braced && isdigit((unsigned char)*name))
+        name_len = strspn(name, "0123456789");
+    else if (*name != '\0' && strchr("?$#@*0123456789", *name) != NULL)
+        name_len = 1;
+    else
+        name_len = strspn(name, NAME_CHARS);
+
+    if (braced && (name_len == 0 || name[name_len] != '}'))
+    {
+        fprintf(stderr, "mini_shell : %.*s : bad substitution\n", (int)strcspn(src, " \t"), src);
+        return -1;
+    }
+    if (name_len == 0)
+    {
+        dst[(*len)++] = '$';
+        return 1;
+    }
+
+    dst[(*len)++] = quoted ? VAR_QUOTED : VAR_SPLIT;
+    memcpy(dst + *len, name, name_len);
+    *len += name_len;
+    dst[(*len)++] = VAR_END;
+    return 1 + braced + name_len + braced;
+}
+
+group_t *insert_group(group_t **session_leader)
+{
+    /* Insert as first element */
+    int idx, id;
+    group_t *new_group;
+
+    /* Add a slab of free groups when none is left */
+    if (job_table.free_groups == NULL)
+    {
+        new_group = (group_t *)calloc(JOB_SLAB, sizeof(group_t));
+        nallocs++;
+        for (idx = JOB_SLAB - 1; idx >= 0; idx--)
+        {
+            new_group[idx].id = job_table.ngroups + idx + 1;
+            new_group[idx].group_link = job_table.free_groups;
+            job_table.free_groups = &new_group[idx];
+        }
+        job_table.ngroups += JOB_SLAB;
+    }
+
+    new_group = job_table.free_groups;
+    job_table.free_groups = new_group->group_link;
+    shell_stats.jobs_created++;
+
+    id = new_group->id;
+    memset(new_group, 0, sizeof(group_t));
+    new_group->id = id;
+    new_group->status = BG;
+
+    new_group->group_link = *session_leader;
+    if (*session_leader != NULL)
+        (*session_leader)->prev_group = new_group;
+    (*session_leader) = new_group;
+    return new_group;
+}
+
+process_t *insert_process(group_t *group)
+{
+    /* Insert as last element */
+    int idx;
+    process_t *new_process;
+
+    /* Add a slab of free processes when none is left */
+    if (job_table.free_processes == NULL)
+    {
+        new_process = (process_t *)calloc(JOB_SLAB, sizeof(process_t));
+        nallocs++;
+        for (idx = 0; idx < JOB_SLAB; idx++)
+        {
+            new_process[idx].proc_link = job_table.free_processes;
+            job_table.free_processes = &new_process[idx];
+        }
+    }
+
+    new_process = job_table.free_processes;
+    job_table.free_processes = new_process->proc_link;
+
+    memset(new_process, 0, sizeof(process_t));
+    new_process->status = proc_stat[RUNNING];
+    new_process->signal = sig[0];
+    new_process->group = group;
+
+    group->nprocess++;
+    group->nlive++;
+
+    new_process->prev_proc = group->proc_tail;
+    if (group->proc_tail != NULL)
+        group->proc_tail->proc_link = new_process;
+    else
+        group->proc_link = new_process;
+    group->proc_tail = new_process;
+    return new_process;
+}
+
+/* Create an arena whose first block holds size bytes */
+arena_t *arena_create(size_t size)
+{
+    arena_t *arena;
+
+    if (size < ARENA_MIN)
+        size = ARENA_MIN;
+    arena = (arena_t *)malloc(sizeof(arena_t) + size);
+    nallocs++;
+    shell_stats.arena_bytes += sizeof(arena_t) + size;
+    arena->next = NULL;
+    arena->parent = NULL;
+    arena->refs = 0;
+    arena->size = size;
+    arena->used = 0;
+    return arena;
+}
+
+/* Scratch arena holding one reference, which keeps its parent alive */
+arena_t *arena_child(arena_t *parent)
+{
+    arena_t *arena = arena_create(SCRATCH_SIZE);
+
+    arena->refs = 1;
+    arena->parent = parent;
+    parent->refs++;
+    return arena;
+}
+
+/* Scratch arena for the next pass of a loop : the same one emptied, or a new one when a job holds it */
+arena_t *arena_reuse(arena_t *scratch)
+{
+    arena_t *block, *next;
+
+    if (scratch->refs > 1)
+    {
+        block = arena_child(scratch->parent);
+        arena_release(scratch);
+        return block;
+    }
+    for (block = scratch->next; block != NULL; block = next)
+    {
+        next = block->next;
+        shell_stats.arena_bytes -= sizeof(arena_t) + block->size;
+        free(block);
+    }
+    scratch->next = NULL;
+    scratch->used = 0;
+    return scratch;
+}
+
+/* Take size bytes from the arena, adding a block when the current one is full */
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    arena_t *block = arena->next ? arena->next : arena;
+    void *ptr;
+
+    /* Keep pointers aligned */
+    size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+    if (block->size - block->used < size)
+    {
+        /* New blocks go after the first one, which keeps the reference count */
+        block = arena_create(size > block->size ? size * 2 : block->size * 2);
+        block->next = arena->next;
+        arena->next = block;
+    }
+    ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+/* Copy a string into the arena */
+char *arena_strdup(arena_t *arena, const char *str)
+{
+    size_t len = strlen(str) + 1;
+
+    return (char *)memcpy(arena_alloc(arena, len), str, len);
+}
+
+/* Give back what was taken from the arena since its current block was block, holding used bytes */
+void arena_rewind(arena_t *arena, arena_t *block, size_t used)
+{
+    arena_t *next;
+
+    while (arena->next != NULL && arena->next != block)
+    {
+        next = arena->next->next;
+        shell_stats.arena_bytes -= sizeof(arena_t) + arena->next->size;
+        free(arena->next);
+        arena->next = next;
+    }
+    block->used = used;
+}
+
+/* Drop one reference, the arena and all its blocks go with the last one, then its reference to its parent */
+void arena_release(arena_t *arena)
+{
+    arena_t *next, *parent;
+
+    if (arena == NULL || --arena->refs > 0)
+        return;
+    parent = arena->parent;
+    for (; arena != NULL; arena = next)
+    {
+        next = arena->next;
+        shell_stats.arena_bytes -= sizeof(arena_t) + arena->size;
+        free(arena);
+    }
+    arena_release(parent);
+}
+
+/* Add a started process to the pid index */
+void index_process(process_t *process)
+{
+    process_t **bucket = &job_table.pid_index[process->pid % PID_BUCKETS];
+
+    process->pid_link = *bucket;
+    *bucket = process;
+}
+
+/* Clear the terminal and show the banner, the clear sequence is written as Ctrl-L does */
+void initialize_msh(void)
+{
+    fputs("\033[H\033[2J", stdout);
+    printf("\033[32;1m");
+    printf("-----------------------------------------------------------------------------------\n");
+    printf("|                        WELCOME TO MINI SHELL                                    |\n");
+    printf("|                            AUTHOR : ABHI                                        |\n");
+    printf("-----------------------------------------------------------------------------------\n");
+    printf("\033[0m");
+    fflush(stdout);
+}
+
+/* Run $MSH_RC, ~/.mshrc by default and nothing when empty */
+void source_rc(shell_t *sh)
+{
+    char path[PATH_MAX];
+    const char *rc, *home;
+
+    if ((rc = var_get("MSH_RC")) != NULL)
+    {
+        if (*rc != '\0')
+            source_file(rc, sh);
+    }
+    else if ((home = var_get("HOME")) != NULL)
+    {
+        snprintf(path, sizeof(path), "%s/.mshrc", home);
+        source_file(path, sh);
+    }
+}
+
+/*
+ * Run the lines of a file in the shell, as the rc file of an interactive
+ * shell. It has its own reader, here-documents and the rest of compound
+ * commands are read from the file.
+ */
+void source_file(const char *path, shell_t *sh)
+{
+    int fd;
+    char *cmd;
+    arena_t *arena;
+    pipeline_t *list;
+    line_reader_t reader;
+    line_reader_t *saved_input = sh->input;
+    line_editor_t *saved_editor = sh->editor;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return;
+    reader_init_fd(&reader, fd);
+    sh->input = &reader;
+    sh->editor = NULL;
+    while ((cmd = read_line(&reader)) != NULL)
+    {
+        if (is_null_input(cmd) || is_ps1(cmd))
+            continue;
+        arena = arena_create(8 * (strlen(cmd) + 1));
+        arena->refs = 1;
+        shell_stats.parsed++;
+        if (command_parser(cmd, arena, &list, sh) == -1)
+            sh->exit_status = 2;
+        else
+            run_list(list, arena, sh);
+        sh->control = CTRL_NONE;
+        arena_release(arena);
+    }
+    sh->input = saved_input;
+    sh->editor = saved_editor;
+    free(reader.buf);
+    close(fd);
+}
+
+/* Fill in the compiled prompt, returns its length */
+size_t render_prompt(shell_t *sh, char *line, size_t size)
+{
+    size_t len = 0, room;
+    int idx, nprinted;
+    const char *home;
+    time_t now;
+    struct tm tm;
+
+    for (idx = 0; idx < nprompt_segments; idx++)
+    {
+        room = size - len;
+        switch (prompt_segments[idx].item)
+        {
+            case PROMPT_TEXT:
+                nprinted = prompt_segments[idx].len < room ? prompt_segments[idx].len : room - 1;
+                memcpy(line + len, prompt_text + prompt_segments[idx].start, nprinted);
+                len += nprinted;
+                break;
+            case PROMPT_CWD:
+                /* The home directory is shown as ~ */
+                home = prompt_text + prompt_segments[idx].start;
+                if (prompt_segments[idx].len > 0 && strncmp(sh->cwd, home, prompt_segments[idx].len) == 0 &&
+                    (sh->cwd[prompt_segments[idx].len] == '/' || sh->cwd[prompt_segments[idx].len] == '\0'))
+                    nprinted = snprintf(line + len, room, "~%s", sh->cwd + prompt_segments[idx].len);
+                else
+                    nprinted = snprintf(line + len, room, "%s", sh->cwd);
+                len += (size_t)nprinted < room ? (size_t)nprinted : room - 1;
+                break;
+            case PROMPT_TIME:
+                now = time(NULL);
+                localtime_r(&now, &tm);
+                len += strftime(line + len, room, "%H:%M:%S", &tm);
+                break;
+            case PROMPT_STATUS:
+                nprinted = snprintf(line + len, room, "%d", sh->exit_status);
+                len += (size_t)nprinted < room ? (size_t)nprinted : room - 1;
+                break;
+        }
+    }
+    return len;
+}
+
+/*
+ * Turn a prompt string into segments once, so showing it needs no parsing.
+ * \u, \h and \$ do not change in a session and become text here; \w, \t
+ * and \$? are filled in by render_prompt(). show_cwd adds the directory
+ * after the prompt like the default one.
+ */
+void compile_prompt(const char *ps, int show_cwd)
+{
+    char host[HOST_NAME_MAX + 1];
+    const char *text, *home;
+    struct passwd *pw;
+
+    prompt_text_len = 0;
+    nprompt_segments = 0;
+    add_prompt_segment(PROMPT_TEXT, "\033[32;1m", 7);
+
+    for (; *ps; ps++)
+    {
+        if (*ps != '\\' || ps[1] == '\0')
+        {
+            add_prompt_segment(PROMPT_TEXT, ps, 1);
+            continue;
+        }
+        switch (*++ps)
+        {
+            case 'w':
+                home = var_get("HOME");
+                add_prompt_segment(PROMPT_CWD, home ? home : "", home ? strlen(home) : 0);
+                break;
+            case 't':
+                add_prompt_segment(PROMPT_TIME, NULL, 0);
+                break;
+            case 'u':
+                pw = getpwuid(getuid());
+                text = pw ? pw->pw_name : "";
+                add_prompt_segment(PROMPT_TEXT, text, strlen(text));
+                break;
+            case 'h':
+                if (gethostname(host, sizeof(host)) == -1)
+                    host[0] = '\0';
+                host[sizeof(host) - 1] = '\0';
+                host[strcspn(host, ".")] = '\0';
+                add_prompt_segment(PROMPT_TEXT, host, strlen(host));
+                break;
+            case '$':
+                if (ps[1] == '?')
+                {
+                    add_prompt_segment(PROMPT_STATUS, NULL, 0);
+                    ps++;
+                }
+                else
+                    add_prompt_segment(PROMPT_TEXT, geteuid() == 0 ? "#" : "$", 1);
+                break;
+            case 'n':
+                add_prompt_segment(PROMPT_TEXT, "\n", 1);
+                break;
+            case 'e':
+                add_prompt_segment(PROMPT_TEXT, "\033", 1);
+                break;
+            case '\\':
+                add_prompt_segment(PROMPT_TEXT, "\\", 1);
+                break;
+            default:
+                add_prompt_segment(PROMPT_TEXT, ps - 1, 2);
+                break;
+        }
+    }
+
+    add_prompt_segment(PROMPT_TEXT, "\033[0m", 4);
+    if (show_cwd)
+    {
+        add_prompt_segment(PROMPT_TEXT, "\033[34;1m", 7);
+        home = var_get("HOME");
+        add_prompt_segment(PROMPT_CWD, home ? home : "", home ? strlen(home) : 0);
+        add_prompt_segment(PROMPT_TEXT, ":\033[0m ", 6);
+    }
+}
+
+/* Append a segment, text joins the text segment before it */
+void add_prompt_segment(prompt_item_t item, const char *text, size_t len)
+{
+    prompt_segment_t *last = nprompt_segments ? &prompt_segments[nprompt_segments - 1] : NULL;
+
+    /* A prompt that does not fit is cut short */
+    if (prompt_text_len + len > sizeof(prompt_text))
+        return;
+    if (item == PROMPT_TEXT && last != NULL && last->item == PROMPT_TEXT)
+    {
+        memcpy(prompt_text + prompt_text_len, text, len);
+        prompt_text_len += len;
+        last->len += len;
+        return;
+    }
+    if (nprompt_segments == MAX_PROMPT_SEGMENTS)
+        return;
+
+    memcpy(prompt_text + prompt_text_len, text, len);
+    prompt_segments[nprompt_segments].item = item;
+    prompt_segments[nprompt_segments].start = prompt_text_len;
+    prompt_segments[nprompt_segments].len = len;
+    prompt_text_len += len;
+    nprompt_segments++;
+}
+
+/* cd [dir] : change directory, home when no dir is given */
+int builtin_cd(int argc, char *argv[], shell_t *sh)
+{
+    const char *dir = argc > 1 ? argv[1] : var_get("HOME");
+
+    if (dir == NULL || chdir(dir) != 0)
+    {
+        perror("cd");
+        return 1;
+    }
+
+    /* The prompt reads this instead of calling getcwd */
+    if (getcwd(sh->cwd, sizeof(sh->cwd)) == NULL)
+        sh->cwd[0] = '\0';
+    var_set("PWD", 3, sh->cwd, 1);
+    return 0;
+}
+
+/* exit [n] : leave the shell with status n, that of the last command by default, hanging up its jobs */
+int builtin_exit(int argc, char *argv[], shell_t *sh)
+{
+    long status = sh->exit_status;
+    char *end;
+
+    if (argc > 1)
+    {
+        errno = 0;
+        status = strtol(argv[1], &end, 10);
+        if (*argv[1] == '\0' || *end != '\0' || errno != 0)
+        {
+            fprintf(stderr, "exit : %s : numeric argument required\n", argv[1]);
+            return 2;
+        }
+    }
+    hangup_jobs(sh->session_leader);
+    exit(status & 0xff);
+}
+
+/* Send SIGHUP to every job */
+void hangup_jobs(group_t *session_leader)
+{
+    group_t *grp_ptr;
+
+    for (grp_ptr = session_leader; grp_ptr; grp_ptr = grp_ptr->group_link)
+        killpg(grp_ptr->pgid, SIGHUP);
+}
+
+int is_null_input(char *cmd)
+{
+    if (strcmp(cmd, "") == 0)
+        return 1;
+    else
+        return 0;
+}
+
+int is_ps(char *cmd)
+{
+    if (strcmp(cmd, "jobs -l") == 0)
+        return 1;
+    else
+        return 0;
+}
+
+/* jobs : list jobs, jobs -l : list every process of them and the progress of background parallel runs */
+int builtin_jobs(int argc, char *argv[], shell_t *sh)
+{
+    update_status_of_bg(&sh->session_leader);
+    if (argc == 1)
+        jobs(&sh->session_leader);
+    else if (argc == 2 && strcmp(argv[1], "-l") == 0)
+    {
+        print_resource_for_my_shell(sh->session_leader);
+        print_runs();
+    }
+    else
+    {
+        fprintf(stderr, "jobs : usage : jobs [-l]\n");
+        return 2;
+    }
+    return 0;
+}
+
+/* renice N %job... or renice [--nice N] [--ioclass CLASS[:LEVEL]] %job... : reprioritize running jobs */
+int builtin_renice(int argc, char *argv[], shell_t *sh)
+{
+    int idx = 1;
+    placement_t change;
+
+    memset(&change, 0, sizeof(change));
+    if (argc > 1 && strncmp(argv[1], "--", 2) != 0 && argv[1][0] != '%')
+    {
+        if (set_placement(&change, "--nice", argv[1]) == -1)
+            return 2;
+        idx = 2;
+    }
+    for (; idx + 1 < argc && strncmp(argv[idx], "--", 2) == 0; idx += 2)
+        if (set_placement(&change, argv[idx], argv[idx + 1]) == -1 || change.has_cpus)
+        {
+            fprintf(stderr, "renice : use pin for CPUs\n");
+            return 2;
+        }
+
+    if (idx == argc || (!change.has_nice && change.ioclass == IOCLASS_NONE))
+    {
+        fprintf(stderr, "renice : usage : renice N|[--nice N] [--ioclass CLASS[:LEVEL]] %%job...\n");
+        return 2;
+    }
+    return place_jobs(argc - idx, argv + idx, &change, sh);
+}
+
+/* pin LIST %job... : move running jobs to the CPUs of LIST, e.g. 0-3,8 */
+int builtin_pin(int argc, char *argv[], shell_t *sh)
+{
+    placement_t change;
+
+    memset(&change, 0, sizeof(change));
+    if (argc < 3)
+    {
+        fprintf(stderr, "pin : usage : pin LIST %%job...\n");
+        return 2;
+    }
+    if (set_placement(&change, "--cpus", argv[1]) == -1)
+        return 2;
+    return place_jobs(argc - 2, argv + 2, &change, sh);
+}
+
+/* Apply a change of placement to every live process of the given jobs */
+int place_jobs(int nspecs, char *specs[], placement_t *change, shell_t *sh)
+{
+    int idx, status = 0;
+    group_t *group;
+    process_t *process;
+
+    update_status_of_bg(&sh->session_leader);
+    for (idx = 0; idx < nspecs; idx++)
+    {
+        if ((group = find_job(sh->session_leader, specs[idx])) == NULL)
+        {
+            fprintf(stderr, "%s : no such job\n", specs[idx]);
+            status = 1;
+            continue;
+        }
+        merge_placement(&group->placement, change);
+        group->placed = 1;
+        for (process = group->proc_link; process != NULL; process = process->proc_link)
+            if (process->status != proc_stat[EXITED] && process->status != proc_stat[KILLED] &&
+                place_process(process->pid, change) == -1)
+                status = 1;
+    }
+    return status;
+}
+
+/* Job of a %N, %+ or %- spec, counting from the newest as jobs lists them */
+group_t *find_job(group_t *session_leader, const char *spec)
+{
+    int n;
+    group_t *group;
+
+    if (spec[0] != '%')
+        return NULL;
+    if (spec[1] == '\0' || strcmp(spec + 1, "+") == 0 || strcmp(spec + 1, "%") == 0)
+        n = 1;
+    else if (strcmp(spec + 1, "-") == 0)
+        n = 2;
+    else if ((n = atoi(spec + 1)) < 1)
+        return NULL;
+
+    for (group = session_leader; group != NULL && --n > 0; group = group->group_link)
+        ;
+    return group;
+}
+
+/* Set one part of a placement from a run option, -1 after a message when it is not valid */
+int set_placement(placement_t *place, const char *option, const char *value)
+{
+    int idx;
+    long number;
+    char *end;
+    size_t len;
+
+    if (strcmp(option, "--cpus") == 0)
+    {
+        if (parse_cpus(value, &place->cpus) == -1)
+        {
+            fprintf(stderr, "%s : %s : not a CPU list\n", option, value);
+            return -1;
+        }
+        place->has_cpus = 1;
+    }
+    else if (strcmp(option, "--nice") == 0)
+    {
+        number = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || number < -20 || number > 19)
+        {
+            fprintf(stderr, "%s : %s : not a nice value from -20 to 19\n", option, value);
+            return -1;
+        }
+        place->has_nice = 1;
+        place->nice = number;
+    }
+    else if (strcmp(option, "--ioclass") == 0)
+    {
+        /* CLASS or CLASS:LEVEL, level 0 is the highest */
+        len = strcspn(value, ":");
+        for (idx = IOCLASS_REALTIME; idx <= IOCLASS_IDLE; idx++)
+            if (strlen(ioclass_names[idx]) == len && strncmp(value, ioclass_names[idx], len) == 0)
+                break;
+        number = idx == IOCLASS_IDLE ? 0 : 4;
+        if (value[len] == ':')
+            number = strtol(value + len + 1, &end, 10);
+        if (idx > IOCLASS_IDLE || (value[len] == ':' && (*end != '\0' || number < 0 || number > 7)))
+        {
+            fprintf(stderr, "%s : %s : not realtime, best-effort or idle with a level from 0 to 7\n", option, value);
+            return -1;
+        }
+        place->ioclass = idx;
+        place->iolevel = number;
+    }
+    else
+    {
+        fprintf(stderr, "run : %s : unknown option\n", option);
+        return -1;
+    }
+    return 0;
+}
+
+/* CPU list such as 0-3,8,10-11 */
+int parse_cpus(const char *list, cpu_set_t *cpus)
+{
+    long first, last;
+    char *end;
+
+    CPU_ZERO(cpus);
+    do
+    {
+        first = last = strtol(list, &end, 10);
+        if (end == list)
+            return -1;
+        if (*end == '-')
+        {
+            list = end + 1;
+            last = strtol(list, &end, 10);
+            if (end == list)
+                return -1;
+        }
+        if (first < 0 || last >= CPU_SETSIZE || first > last)
+            return -1;
+        for (; first <= last; first++)
+            CPU_SET(first, cpus);
+        list = end + 1;
+    } while (*end == ',');
+    return *end == '\0' ? 0 : -1;
+}
+
+/* Take the parts a change sets */
+void merge_placement(placement_t *place, placement_t *change)
+{
+    if (change->has_cpus)
+    {
+        place->has_cpus = 1;
+        place->cpus = change->cpus;
+    }
+    if (change->has_nice)
+    {
+        place->has_nice = 1;
+        place->nice = change->nice;
+    }
+    if (change->ioclass != IOCLASS_NONE)
+    {
+        place->ioclass = change->ioclass;
+        place->iolevel = change->iolevel;
+    }
+}
+
+/* Placement as jobs -l shows it : cpus=0-3 nice=10 io=idle */
+char *format_placement(placement_t *place, char *buf, size_t size)
+{
+    int cpu, first;
+    size_t len = 0;
+
+    buf[0] = '\0';
+    if (place->has_cpus)
+    {
+        len += snprintf(buf + len, size - len, "cpus=");
+        for (cpu = 0; cpu < CPU_SETSIZE && len < size; cpu++)
+        {
+            if (!CPU_ISSET(cpu, &place->cpus))
+                continue;
+            for (first = cpu; cpu + 1 < CPU_SETSIZE && CPU_ISSET(cpu + 1, &place->cpus); cpu++)
+                ;
+            len += snprintf(buf + len, size - len, buf[len - 1] == '=' ? "%d" : ",%d", first);
+            if (cpu > first && len < size)
+                len += snprintf(buf + len, size - len, "-%d", cpu);
+        }
+    }
+    if (place->has_nice && len < size)
+        len += snprintf(buf + len, size - len, "%snice=%d", len ? " " : "", place->nice);
+    if (place->ioclass != IOCLASS_NONE && len < size)
+        snprintf(buf + len, size - len, "%sio=%s:%d", len ? " " : "", ioclass_names[place->ioclass], place->iolevel);
+    return buf;
+}
+
+/* Apply a placement to one thread, 0 for the calling one */
+int place_task(pid_t tid, placement_t *place)
+{
+    int status = 0;
+
+    if (place->has_cpus && sched_setaffinity(tid, sizeof(cpu_set_t), &place->cpus) == -1)
+    {
+        perror("sched_setaffinity");
+        status = -1;
+    }
+    if (place->has_nice && setpriority(PRIO_PROCESS, tid, place->nice) == -1)
+    {
+        perror("setpriority");
+        status = -1;
+    }
+    if (place->ioclass != IOCLASS_NONE &&
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, tid, place->ioclass << IOPRIO_CLASS_SHIFT | place->iolevel) == -1)
+    {
+        perror("ioprio_set");
+        status = -1;
+    }
+    return status;
+}
+
+/* Apply a placement to every thread of a running process, Linux keeps all three per thread */
+int place_process(pid_t pid, placement_t *place)
+{
+    int status = 0;
+    char path[64];
+    DIR *dir;
+    struct dirent *entry;
+
+    snprintf(path, sizeof(path), "/proc/%d/task", pid);
+    if ((dir = opendir(path)) == NULL)
+        return place_task(pid, place);
+    while ((entry = readdir(dir)) != NULL)
+        if (entry->d_name[0] != '.' && place_task(atoi(entry->d_name), place) == -1)
+            status = -1;
+    closedir(dir);
+    return status;
+}
+
+/* fg : resume the latest job in the foreground */
+int builtin_fg(int argc, char *argv[], shell_t *sh)
+{
+    fg(sh->terminal, &sh->session_leader, sh->shell_pid, &sh->exit_status);
+    return sh->exit_status;
+}
+
+/* PS1=text : prompt without the directory, PS2=text : prompt followed by it */
+int is_ps1(char *cmd)
+{
+    if (strncmp(cmd, "PS1=", 4) == 0)
+    {
+        compile_prompt(cmd + 4, 0);
+        return 1;
+    }
+    if (strncmp(cmd, "PS2=", 4) == 0)
+    {
+        compile_prompt(cmd + 4, 1);
+        return 1;
+    }
+    return 0;
+}
+
+/* echo [word]... : print the words */
+int builtin_echo(int argc, char *argv[], shell_t *sh)
+{
+    int idx;
+
+    for (idx = 1; idx < argc; idx++)
+    {
+        if (idx > 1)
+            putchar(' ');
+        fputs(argv[idx], stdout);
+    }
+    putchar('\n');
+    return 0;
+}
+
+/* true and : do nothing and succeed */
+int builtin_true(int argc, char *argv[], shell_t *sh)
+{
+    return 0;
+}
+
+/* false : do nothing and fail */
+int builtin_false(int argc, char *argv[], shell_t *sh)
+{
+    return 1;
+}
+
+/* break [n] : leave the n innermost loops */
+int builtin_break(int argc, char *argv[], shell_t *sh)
+{
+    return loop_control(argc, argv, sh, CTRL_BREAK);
+}
+
+/* continue [n] : go on with the next pass of the nth innermost loop */
+int builtin_continue(int argc, char *argv[], shell_t *sh)
+{
+    return loop_control(argc, argv, sh, CTRL_CONTINUE);
+}
+
+/* Ask the loops around to break or continue, a count beyond them means the outermost */
+int loop_control(int argc, char *argv[], shell_t *sh, control_t control)
+{
+    int levels = argc > 1 ? atoi(argv[1]) : 1;
+
+    if (sh->loop_depth == 0)
+    {
+        fprintf(stderr, "%s : only meaningful in a loop\n", argv[0]);
+        return 0;
+    }
+    if (levels < 1)
+    {
+        fprintf(stderr, "%s : %s : loop count out of range\n", argv[0], argv[1]);
+        return 1;
+    }
+    sh->control = control;
+    sh->control_levels = levels < sh->loop_depth ? levels : sh->loop_depth;
+    return 0;
+}
+
+/* return [n] : leave the function with status n, that of the last command by default */
+int builtin_return(int argc, char *argv[], shell_t *sh)
+{
+    if (sh->function_depth == 0)
+    {
+        fprintf(stderr, "return : can only be used in a function\n");
+        return 1;
+    }
+    sh->control = CTRL_RETURN;
+    return argc > 1 ? atoi(argv[1]) : sh->exit_status;
+}
+
+/* shift [n] : drop the first n positional parameters */
+int builtin_shift(int argc, char *argv[], shell_t *sh)
+{
+    int count = argc > 1 ? atoi(argv[1]) : 1;
+
+    if (count < 0 || count > sh->nparams)
+    {
+        fprintf(stderr, "shift : %s : shift count out of range\n", argc > 1 ? argv[1] : "1");
+        return 1;
+    }
+    sh->params += count;
+    sh->nparams -= count;
+    return 0;
+}
+
+/* let expression... : evaluate each one, the status is 0 when the last is not 0 */
+int builtin_let(int argc, char *argv[], shell_t *sh)
+{
+    int idx;
+    int64_t value = 0;
+
+    if (argc < 2)
+    {
+        fprintf(stderr, "let : expression expected\n");
+        return 1;
+    }
+    for (idx = 1; idx < argc; idx++)
+        if (arith_eval(argv[idx], strlen(argv[idx]), &value, sh) == -1)
+            return 1;
+    return value == 0;
+}
+
+/* export [NAME[=value]]... : pass variables to commands, export alone lists them */
+int builtin_export(int argc, char *argv[], shell_t *sh)
+{
+    int idx, status = 0;
+    size_t slot, len, count = 0;
+    const char *value;
+    char **names;
+
+    if (argc == 1)
+    {
+        names = (char **)malloc((variables.nused + 1) * sizeof(char *));
+        for (slot = 0; slot < variables.nslots; slot++)
+            if (variables.slots[slot].name != NULL && variables.slots[slot].exported)
+                names[count++] = variables.slots[slot].name;
+        qsort(names, count, sizeof(char *), compare_string);
+
+        /* In a form that can be read back */
+        for (slot = 0; slot < count; slot++)
+        {
+            printf("export %s", names[slot]);
+            if ((value = var_get(names[slot])) != NULL)
+            {
+                fputs("=\"", stdout);
+                for (; *value != '\0'; value++)
+                {
+                    if (strchr("\"\\$`", *value) != NULL)
+                        putchar('\\');
+                    putchar(*value);
+                }
+                putchar('"');
+            }
+            putchar('\n');
+        }
+        free(names);
+        return 0;
+    }
+
+    for (idx = 1; idx < argc; idx++)
+    {
+        len = strcspn(argv[idx], "=");
+        if (!valid_name(argv[idx], len))
+        {
+            fprintf(stderr, "export : '%s' : not a valid identifier\n", argv[idx]);
+            status = 1;
+            continue;
+        }
+        var_set(argv[idx], len, argv[idx][len] == '=' ? argv[idx] + len + 1 : NULL, 1);
+    }
+    return status;
+}
+
+/* unset NAME... : remove variables, unset -f NAME... : remove functions */
+int builtin_unset(int argc, char *argv[], shell_t *sh)
+{
+    int idx, status = 0;
+
+    if (argc > 1 && strcmp(argv[1], "-f") == 0)
+    {
+        for (idx = 2; idx < argc; idx++)
+            remove_function(argv[idx]);
+        return 0;
+    }
+
+    for (idx = 1; idx < argc; idx++)
+    {
+        if (!valid_name(argv[idx], strlen(argv[idx])))
+        {
+            fprintf(stderr, "unset : '%s' : not a valid identifier\n", argv[idx]);
+            status = 1;
+            continue;
+        }
+        var_unset(argv[idx], strlen(argv[idx]));
+    }
+    return status;
+}
+
+/* local [NAME[=value]]... : variables put back as they were when the current scope ends */
+int builtin_local(int argc, char *argv[], shell_t *sh)
+{
+    int idx, status = 0;
+    size_t len;
+
+    if (variables.depth == 0)
+    {
+        fprintf(stderr, "local : can only be used in a function\n");
+        return 1;
+    }
+
+    for (idx = 1; idx < argc; idx++)
+    {
+        len = strcspn(argv[idx], "=");
+        if (!valid_name(argv[idx], len))
+        {
+            fprintf(stderr, "local : '%s' : not a valid identifier\n", argv[idx]);
+            status = 1;
+            continue;
+        }
+        var_local(argv[idx], len, argv[idx][len] == '=' ? argv[idx] + len + 1 : NULL, 0);
+    }
+    return status;
+}
+
+/* Shell options : set [name=value]... */
+int builtin_set(int argc, char *argv[], shell_t *sh)
+{
+    int idx, status = 0;
+    long size;
+
+    if (argc == 1)
+    {
+        printf("launch=%s\n", launch_modes[launch_mode]);
+        if (pipe_size == 0)
+            printf("pipebuf=default\n");
+        else
+            printf("pipebuf=%ld\n", pipe_size);
+        printf("histsize=%ld\n", history.cap ? history.cap : HISTORY_CAP);
+        printf("trace=%s\n", trace_ring != NULL ? trace_ring->path : "off");
+        return 0;
+    }
+
+    for (idx = 1; idx < argc; idx++)
+    {
+        /* set -o name=value is the same as set name=value */
+        if (strcmp(argv[idx], "-o") == 0)
+            continue;
+        if (strcmp(argv[idx], "launch=spawn") == 0)
+            launch_mode = LAUNCH_SPAWN;
+        else if (strcmp(argv[idx], "launch=fork") == 0)
+            launch_mode = LAUNCH_FORK;
+        else if (strcmp(argv[idx], "pipebuf=default") == 0)
+            pipe_size = 0;
+        else if (strncmp(argv[idx], "pipebuf=", 8) == 0 && (size = parse_size(argv[idx] + 8)) > 0)
+        {
+            /* The kernel refuses sizes above its limit */
+            if (size > pipe_max_size())
+                size = pipe_max_size();
+            pipe_size = size;
+        }
+        else if (strncmp(argv[idx], "histsize=", 9) == 0 && (size = parse_size(argv[idx] + 9)) > 0)
+            history.cap = size;
+        else if (strcmp(argv[idx], "trace=off") == 0 || strcmp(argv[idx], "trace=") == 0)
+        {
+            if (trace_ring != NULL)
+                trace_stop();
+        }
+        else if (strncmp(argv[idx], "trace=", 6) == 0)
+        {
+            /* A new file ends the trace going to the old one */
+            if (trace_ring != NULL)
+                trace_stop();
+            if (trace_start(argv[idx] + 6) == -1)
+                status = 1;
+        }
+        else
+        {
+            fprintf(stderr, "set : %s : invalid option\n", argv[idx]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* Size with an optional K, M or G suffix, -1 when it is not valid */
+long parse_size(const char *str)
+{
+    char *end;
+    long size = strtol(str, &end, 10);
+
+    if (end == str || size <= 0)
+        return -1;
+    switch (*end)
+    {
+        case 'k': case 'K':
+            size <<= 10;
+            end++;
+            break;
+        case 'm': case 'M':
+            size <<= 20;
+            end++;
+            break;
+        case 'g': case 'G':
+            size <<= 30;
+            end++;
+            break;
+    }
+    return *end == '\0' ? size : -1;
+}
+
+/* Largest pipe buffer an unprivileged process may ask for */
+long pipe_max_size(void)
+{
+    long size = 1 << 20;
+    FILE *fp = fopen("/proc/sys/fs/pipe-max-size", "re");
+
+    if (fp != NULL)
+    {
+        if (fscanf(fp, "%ld", &size) != 1)
+            size = 1 << 20;
+        fclose(fp);
+    }
+    return size;
+}
+
+/* FNV-1a hash of a string */
+unsigned int hash_string(const char *str)
+{
+    unsigned int hash = 2166136261u;
+
+    while (*str)
+        hash = (hash ^ (unsigned char)*str++) * 16777619u;
+    return hash;
+}
+
+/* FNV-1a hash of a name that need not end with a NUL */
+unsigned int hash_name(const char *name, size_t len)
+{
+    unsigned int hash = 2166136261u;
+
+    while (len-- > 0)
+        hash = (hash ^ (unsigned char)*name++) * 16777619u;
+    return hash;
+}
+
+/* NAME : a letter or _, then letters, digits and _ */
+int valid_name(const char *name, size_t len)
+{
+    return len > 0 && !isdigit((unsigned char)*name) && strspn(name, NAME_CHARS) >= len;
+}
+
+/* Slot holding a name, or the free slot it would go in */
+variable_t *var_slot(const char *name, size_t len, unsigned int hash)
+{
+    size_t mask = variables.nslots - 1;
+    size_t idx;
+    variable_t *var;
+
+    for (idx = hash & mask; ; idx = (idx + 1) & mask)
+    {
+        var = &variables.slots[idx];
+        if (var->name == NULL ||
+            (var->hash == hash && strncmp(var->name, name, len) == 0 && var->name[len] == '\0'))
+            return var;
+    }
+}
+
+/* Value of a shell variable, NULL when it is not set */
+const char *var_get(const char *name)
+{
+    return var_get_len(name, strlen(name));
+}
+
+const char *var_get_len(const char *name, size_t len)
+{
+    variable_t *var;
+
+    if (variables.nslots == 0)
+        return NULL;
+    var = var_slot(name, len, hash_name(name, len));
+    return var->name != NULL ? var->value : NULL;
+}
+
+/*
+ * Set a variable, a NULL value keeps the one it has. exported marks it
+ * for the environment of commands, a variable once exported stays so.
+ */
+void var_set(const char *name, size_t len, const char *value, int exported)
+{
+    unsigned int hash = hash_name(name, len);
+    variable_t *var;
+
+    if ((variables.nused + 1) * 10 > variables.nslots * 7)
+        var_grow();
+
+    var = var_slot(name, len, hash);
+    if (var->name == NULL)
+    {
+        var->name = strndup(name, len);
+        var->hash = hash;
+        variables.nused++;
+    }
+    if (value != NULL)
+    {
+        free(var->value);
+        var->value = strdup(value);
+    }
+    var->exported |= exported;
+    if (var->exported)
+        variables.environ_dirty = 1;
+}
+
+/* Remove a variable, its slot stays until the table grows so probing still works */
+void var_unset(const char *name, size_t len)
+{
+    variable_t *var;
+
+    if (variables.nslots == 0)
+        return;
+    var = var_slot(name, len, hash_name(name, len));
+    if (var->name == NULL)
+        return;
+    if (var->exported)
+        variables.environ_dirty = 1;
+    free(var->value);
+    var->value = NULL;
+    var->exported = 0;
+}
+
+/* Move the variables to a table twice the size of the live ones at least, dropping unset ones */
+void var_grow(void)
+{
+    size_t idx, nlive = 0;
+    size_t nold = variables.nslots;
+    variable_t *old = variables.slots;
+    variable_t *var;
+
+    for (idx = 0; idx < nold; idx++)
+        nlive += old[idx].name != NULL && (old[idx].value != NULL || old[idx].exported);
+
+    variables.nslots = VAR_MIN_SLOTS;
+    while (variables.nslots < nlive * 4)
+        variables.nslots *= 2;
+    variables.slots = (variable_t *)calloc(variables.nslots, sizeof(variable_t));
+    variables.nused = 0;
+    nallocs++;
+
+    for (idx = 0; idx < nold; idx++)
+    {
+        if (old[idx].name == NULL)
+            continue;
+        if (old[idx].value == NULL && !old[idx].exported)
+        {
+            free(old[idx].name);
+            continue;
+        }
+        var = var_slot(old[idx].name, strlen(old[idx].name), old[idx].hash);
+        *var = old[idx];
+        variables.nused++;
+    }
+    free(old);
+}
+
+/* Take the environment the shell was started with as exported variables */
+void var_import(char **envp)
+{
+    char *eq;
+
+    var_grow();
+    for (; *envp != NULL; envp++)
+        if ((eq = strchr(*envp, '=')) != NULL && valid_name(*envp, eq - *envp))
+            var_set(*envp, eq - *envp, eq + 1, 1);
+}
+
+/* Environment of commands, built again only after an exported variable changed */
+char **var_environ(void)
+{
+    size_t idx, count = 0;
+    variable_t *var;
+
+    if (variables.environ != NULL && !variables.environ_dirty)
+        return variables.environ;
+
+    if (variables.environ != NULL)
+    {
+        for (idx = 0; variables.environ[idx] != NULL; idx++)
+            free(variables.environ[idx]);
+        free(variables.environ);
+    }
+
+    variables.environ = (char **)malloc((variables.nused + 1) * sizeof(char *));
+    for (idx = 0; idx < variables.nslots; idx++)
+    {
+        var = &variables.slots[idx];
+        if (var->name == NULL || var->value == NULL || !var->exported)
+            continue;
+        variables.environ[count] = (char *)malloc(strlen(var->name) + strlen(var->value) + 2);
+        sprintf(variables.environ[count++], "%s=%s", var->name, var->value);
+    }
+    variables.environ[count] = NULL;
+    variables.environ_dirty = 0;
+    return variables.environ;
+}
+
+/* Start a scope for locals */
+void var_push_scope(void)
+{
+    variables.depth++;
+}
+
+/* End the current scope, putting back the variables its locals hid */
+void var_pop_scope(void)
+{
+    saved_var_t *saved;
+    variable_t *var;
+    size_t len;
+
+    while ((saved = variables.saved) != NULL && saved->depth == variables.depth)
+    {
+        variables.saved = saved->next;
+        len = strlen(saved->name);
+        if (saved->value != NULL)
+            var_set(saved->name, len, saved->value, 0);
+        else
+            var_unset(saved->name, len);
+
+        /* The export flag comes back as it was too */
+        var = var_slot(saved->name, len, hash_name(saved->name, len));
+        if (var->name != NULL && var->exported != saved->exported)
+        {
+            var->exported = saved->exported;
+            variables.environ_dirty = 1;
+        }
+        free(saved->name);
+        free(saved->value);
+        free(saved);
+    }
+    variables.depth--;
+}
+
+/* Set a variable until the current scope ends, -1 when there is no scope */
+int var_local(const char *name, size_t len, const char *value, int exported)
+{
+    saved_var_t *saved;
+    variable_t *var;
+
+    if (variables.depth == 0)
+        return -1;
+
+    /* The outer value is saved once per scope */
+    for (saved = variables.saved; saved != NULL && saved->depth == variables.depth; saved = saved->next)
+        if (strncmp(saved->name, name, len) == 0 && saved->name[len] == '\0')
+            break;
+    if (saved == NULL || saved->depth != variables.depth)
+    {
+        var = var_slot(name, len, hash_name(name, len));
+        saved = (saved_var_t *)malloc(sizeof(saved_var_t));
+        saved->name = strndup(name, len);
+        saved->value = var->name != NULL && var->value != NULL ? strdup(var->value) : NULL;
+        saved->exported = var->name != NULL && var->exported;
+        saved->depth = variables.depth;
+        saved->next = variables.saved;
+        variables.saved = saved;
+    }
+
+    if (value != NULL)
+        var_set(name, len, value, exported);
+    else
+        var_unset(name, len);
+    return 0;
+}
+
+/* Set the NAME=value words of a command, exported until the scope ends when temporary */
+void assign_variables(command_t *command, int temporary)
+{
+    int idx;
+    char *eq;
+
+    for (idx = 0; idx < command->nassigns; idx++)
+    {
+        eq = strchr(command->assigns[idx], '=');
+        if (temporary)
+            var_local(command->assigns[idx], eq - command->assigns[idx], eq + 1, 1);
+        else
+            var_set(command->assigns[idx], eq - command->assigns[idx], eq + 1, 0);
+    }
+}
+
+/* Walk $PATH for an executable, note the mtime of the directory it was found in */
+char *find_in_path(const char *name, struct timespec *dir_mtime)
+{
+    const char *path_var = var_get("PATH");
+    const char *dir, *end;
+    char *candidate;
+    size_t dir_len, name_len = strlen(name);
+    struct stat st;
+
+    if (path_var == NULL)
+        path_var = "/usr/local/bin:/usr/bin:/bin";
+
+    candidate = (char *)malloc(strlen(path_var) + name_len + 2);
+    for (dir = path_var; ; dir = end + 1)
+    {
+        end = strchrnul(dir, ':');
+        dir_len = end - dir;
+
+        /* Empty entry means current directory */
+        if (dir_len == 0)
+            candidate[dir_len++] = '.';
+        else
+            memcpy(candidate, dir, dir_len);
+        candidate[dir_len] = '\0';
+
+        if (stat(candidate, &st) == 0)
+        {
+            *dir_mtime = st.st_mtim;
+            candidate[dir_len] = '/';
+            memcpy(candidate + dir_len + 1, name, name_len + 1);
+            if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+                return candidate;
+        }
+
+        if (*end == '\0')
+            break;
+    }
+    free(candidate);
+    return NULL;
+}
+
+/*
+ * Return the absolute path of a command, walking $PATH only on the first use.
+ * Entries are dropped when $PATH changes, and an entry is looked up again
+ * when the directory it was found in has been modified since.
+ */
+char *hash_lookup(const char *name, int *hashed)
+{
+    const char *path_var = var_get("PATH");
+    char *dir_end;
+    unsigned int bucket;
+    struct stat st;
+    hash_entry_t *entry;
+
+    if (hashed != NULL)
+        *hashed = 0;
+
+    /* Names with a slash are used as they are */
+    if (strchr(name, '/') != NULL)
+        return (char *)name;
+
+    /* Forget everything when $PATH has changed */
+    if (path_var == NULL)
+        path_var = "";
+    if (hashed_path_var == NULL || strcmp(hashed_path_var, path_var) != 0)
+    {
+        hash_forget();
+        hashed_path_var = strdup(path_var);
+    }
+
+    bucket = hash_string(name) % HASH_BUCKETS;
+    for (entry = hash_table[bucket]; entry != NULL; entry = entry->next)
+        if (strcmp(entry->name, name) == 0)
+            break;
+
+    if (entry != NULL)
+    {
+        /* Check the directory the command was found in is unchanged */
+        dir_end = strrchr(entry->path, '/');
+        *dir_end = '\0';
+        if (stat(entry->path[0] ? entry->path : "/", &st) == 0 &&
+            st.st_mtim.tv_sec == entry->dir_mtime.tv_sec &&
+            st.st_mtim.tv_nsec == entry->dir_mtime.tv_nsec)
+        {
+            *dir_end = '/';
+            entry->hits++;
+            if (hashed != NULL)
+                *hashed = 1;
+            return entry->path;
+        }
+        *dir_end = '/';
+
+        /* Stale, look it up again */
+        free(entry->path);
+        if ((entry->path = find_in_path(name, &entry->dir_mtime)) == NULL)
+        {
+            /* Unlink the entry, it is no longer in $PATH */
+            hash_entry_t **link = &hash_table[bucket];
+            while (*link != entry)
+                link = &(*link)->next;
+            *link = entry->next;
+            free(entry->name);
+            free(entry);
+            return NULL;
+        }
+        entry->hits++;
+        return entry->path;
+    }
+
+    /* First use, remember where it is */
+    entry = (hash_entry_t *)calloc(1, sizeof(hash_entry_t));
+    if ((entry->path = find_in_path(name, &entry->dir_mtime)) == NULL)
+    {
+        free(entry);
+        return NULL;
+    }
+    entry->name = strdup(name);
+    entry->hits = 1;
+    entry->next = hash_table[bucket];
+    hash_table[bucket] = entry;
+    return entry->path;
+}
+
+/* Empty the command path table */
+void hash_forget(void)
+{
+    int idx;
+    hash_entry_t *entry, *next;
+
+    for (idx = 0; idx < HASH_BUCKETS; idx++)
+    {
+        for (entry = hash_table[idx]; entry != NULL; entry = next)
+        {
+            next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+        hash_table[idx] = NULL;
+    }
+    free(hashed_path_var);
+    hashed_path_var = NULL;
+}
+
+/* hash : list remembered commands, hash -r : forget them, hash name... : remember names */
+int builtin_hash(int argc, char *argv[], shell_t *sh)
+{
+    int idx, status = 0, empty = 1;
+    hash_entry_t *entry;
+
+    if (argc == 1)
+    {
+        for (idx = 0; idx < HASH_BUCKETS; idx++)
+        {
+            for (entry = hash_table[idx]; entry != NULL; entry = entry->next)
+            {
+                if (empty)
+                    printf("%-6s%s\n", "hits", "command");
+                empty = 0;
+                printf("%4lu  %s\n", entry->hits, entry->path);
+            }
+        }
+        if (empty)
+            printf("hash : hash table empty\n");
+        return 0;
+    }
+    else if (argc == 2 && strcmp(argv[1], "-r") == 0)
+    {
+        hash_forget();
+        return 0;
+    }
+
+    for (idx = 1; idx < argc; idx++)
+    {
+        if (hash_lookup(argv[idx], NULL) == NULL)
+        {
+            fprintf(stderr, "hash : %s : not found\n", argv[idx]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+/* type name... : tell how each name would be run */
+int builtin_type(int argc, char *argv[], shell_t *sh)
+{
+    int idx, word, hashed, status = 0;
+    char *path;
+
+    for (idx = 1; idx < argc; idx++)
+    {
+        for (word = 0; reserved_words[word] != NULL; word++)
+            if (strcmp(argv[idx], reserved_words[word]) == 0)
+                break;
+        if (reserved_words[word] != NULL)
+            printf("%s is a shell keyword\n", argv[idx]);
+        else if (find_function(argv[idx]) != NULL)
+            printf("%s is a function\n", argv[idx]);
+        else if (find_builtin(argv[idx]) != NULL)
+            printf("%s is a shell builtin\n", argv[idx]);
+        else if ((path = hash_lookup(argv[idx], &hashed)) == NULL)
+        {
+            fprintf(stderr, "type : %s : not found\n", argv[idx]);
+            status = 1;
+        }
+        else if (hashed)
+            printf("%s is hashed (%s)\n", argv[idx], path);
+        else
+            printf("%s is %s\n", argv[idx], path);
+    }
+    return status;
+}
+
+/*
+ * parallel [-j N] cmd [arg]... [::: item...] : run cmd once per item with
+ * {} replaced by the item, or the item added as the last argument. Items
+ * are the words after ::: or the lines of stdin. At most N jobs run at a
+ * time, N defaults to the number of online CPUs. Each job is a background
+ * job of the shell. When stdin is the input of the shell itself, items
+ * are the lines the shell has not read yet. A job stopped by a signal is
+ * continued, one stopped for the terminal is killed. Returns the number
+ * of failed items, at most 101.
+ */
+int builtin_parallel(int argc, char *argv[], shell_t *sh)
+{
+    int status, failed;
+    pid_t pid;
+    struct rusage usage;
+    parallel_run_t *run;
+
+    if ((run = new_run(argc, argv, 0, sh)) == NULL)
+        return 2;
+
+    while (1)
+    {
+        /* Keep njobs running while there are items */
+        fill_run(run);
+        if (run->running == 0)
+            break;
+
+        /* Start the next item as soon as one is reaped */
+        if ((pid = wait4(-1, &status, WUNTRACED, &usage)) == -1)
+        {
+            /* Interrupted, let the running items finish */
+            if (errno == EINTR)
+            {
+                run->stop = 1;
+                continue;
+            }
+            perror("parallel : wait4");
+            break;
+        }
+        shell_stats.waits++;
+        record_status(sh->session_leader, pid, status, &usage);
+        release_group_resource(&sh->session_leader);
+
+        /* Background runs go on meanwhile */
+        schedule_runs();
+    }
+
+    report_run(run);
+    failed = run->failed;
+    free_run(run);
+    return failed > 101 ? 101 : failed;
+}
+
+/*
+ * parallel ... & : start the first items and give the prompt back. The
+ * shell starts the next ones as it reaps the jobs, jobs lists those that
+ * run and jobs -l how far the run has gone. A shell at the end of its
+ * input waits for the items left before it exits.
+ */
+int builtin_parallel_bg(int argc, char *argv[], shell_t *sh)
+{
+    parallel_run_t *run;
+
+    if ((run = new_run(argc, argv, 1, sh)) == NULL)
+        return 2;
+    run->next = parallel_runs;
+    parallel_runs = run;
+    schedule_runs();
+    return 0;
+}
+
+/*
+ * Set up a run of parallel from its words, NULL after a message when they
+ * are wrong. A background run copies its words and items out of the line,
+ * reads all the lines of stdin now and keeps stdin, stdout and stderr for
+ * its jobs, as its redirections are undone once it returns.
+ */
+parallel_run_t *new_run(int argc, char *argv[], int background, shell_t *sh)
+{
+    int idx, first = 1, nwords, njobs = 0, shell_input;
+    unsigned long nitems = 0;
+    char *item;
+    char **items;
+    struct stat st;
+    parallel_run_t *run;
+
+    /* Options */
+    if (argc > 1 && strncmp(argv[1], "-j", 2) == 0)
+    {
+        if (argv[1][2] != '\0')
+            njobs = atoi(argv[1] + 2);
+        else if (argc > 2)
+            njobs = atoi(argv[++first]);
+        first++;
+        if (njobs <= 0)
+        {
+            fprintf(stderr, "parallel : invalid number of jobs\n");
+            return NULL;
+        }
+    }
+    if (njobs == 0)
+        njobs = sysconf(_SC_NPROCESSORS_ONLN);
+
+    /* Command words run up to ::: */
+    for (nwords = 0; first + nwords < argc && strcmp(argv[first + nwords], ":::") != 0; nwords++)
+        ;
+    if (nwords == 0)
+    {
+        fprintf(stderr, "parallel : usage : parallel [-j N] command [arg]... [::: item...]\n");
+        return NULL;
+    }
+
+    /* The shell reads ahead of its commands, the lines it holds are the next items */
+    shell_input = first + nwords == argc && stdin_reader != NULL && !isatty(0) && fstat(0, &st) == 0 &&
+                  st.st_dev == stdin_reader->dev && st.st_ino == stdin_reader->ino;
+    if (shell_input && (background || getpid() != sh->shell_pid))
+    {
+        fprintf(stderr, "parallel : stdin is the input of the shell, give the items after :::\n");
+        return NULL;
+    }
+    if (first + nwords == argc && background && isatty(0))
+    {
+        fprintf(stderr, "parallel : stdin is the terminal, give the items after :::\n");
+        return NULL;
+    }
+
+    run = (parallel_run_t *)calloc(1, sizeof(parallel_run_t));
+    run->background = background;
+    run->njobs = njobs;
+    run->nwords = nwords;
+    run->words = argv + first;
+    run->fds[0] = run->fds[1] = run->fds[2] = -1;
+    run->slots = (group_t **)calloc(njobs, sizeof(group_t *));
+    run->started = (struct timespec *)calloc(njobs, sizeof(struct timespec));
+    run->sh = sh;
+    if (first + nwords < argc)
+        run->items = argv + first + nwords + 1;
+    else if (shell_input)
+        run->reader = stdin_reader;
+    else
+    {
+        reader_init_fd(&run->own_reader, 0);
+        run->reader = &run->own_reader;
+    }
+    run->null_stdin = run->items == NULL;
+    clock_gettime(CLOCK_MONOTONIC, &run->begin);
+    if (!background)
+        return run;
+
+    /* Words and items go to an arena of the run */
+    run->arena = arena_create(ARENA_MIN);
+    run->arena->refs = 1;
+    run->words = (char **)arena_alloc(run->arena, nwords * sizeof(char *));
+    for (idx = 0; idx < nwords; idx++)
+        run->words[idx] = arena_strdup(run->arena, argv[first + idx]);
+    items = (char **)malloc(1024 * sizeof(char *));
+    while ((item = run->items ? *run->items : read_line(run->reader)) != NULL)
+    {
+        if (run->items)
+            run->items++;
+        if (nitems > 0 && nitems % 1024 == 0)
+            items = (char **)realloc(items, (nitems + 1024) * sizeof(char *));
+        items[nitems++] = arena_strdup(run->arena, item);
+    }
+    run->items = (char **)arena_alloc(run->arena, (nitems + 1) * sizeof(char *));
+    memcpy(run->items, items, nitems * sizeof(char *));
+    run->items[nitems] = NULL;
+    run->ntotal = nitems;
+    free(items);
+    if (run->reader == &run->own_reader)
+        free(run->own_reader.buf);
+    run->reader = NULL;
+
+    /* Its jobs get the stdin, stdout and stderr it was started with */
+    for (idx = 0; idx < 3; idx++)
+        run->fds[idx] = fcntl(idx, F_DUPFD_CLOEXEC, 10);
+    return run;
+}
+
+/* Start items until njobs run or none is left */
+void fill_run(parallel_run_t *run)
+{
+    int idx, exit_status = run->sh->exit_status;
+    char *item;
+    group_t *group;
+
+    while (run->running < run->njobs && !run->stop)
+    {
+        item = run->items ? *run->items : read_line(run->reader);
+        if (item == NULL)
+        {
+            run->stop = 1;
+            break;
+        }
+        if (run->items)
+            run->items++;
+        run->nitems++;
+
+        if ((group = launch_item(run, item)) == NULL)
+        {
+            run->failed++;
+            run->ndone++;
+            continue;
+        }
+        for (idx = 0; run->slots[idx] != NULL; idx++)
+            ;
+        run->slots[idx] = group;
+        clock_gettime(CLOCK_MONOTONIC, &run->started[idx]);
+        run->running++;
+    }
+
+    /* An item that cannot start counts as failed, it is not the status of the shell */
+    run->sh->exit_status = exit_status;
+}
+
+/* Start the next items of the background runs, and report and release those that are over */
+void schedule_runs(void)
+{
+    parallel_run_t *run;
+    parallel_run_t **link = &parallel_runs;
+
+    while ((run = *link) != NULL)
+    {
+        fill_run(run);
+        if (run->running > 0)
+        {
+            link = &run->next;
+            continue;
+        }
+        *link = run->next;
+        report_run(run);
+        free_run(run);
+    }
+}
+
+/* A shell at the end of its input waits for the background runs to go through their items */
+void finish_runs(shell_t *sh)
+{
+    int status;
+    pid_t pid;
+    struct rusage usage;
+
+    while (parallel_runs != NULL)
+    {
+        if ((pid = wait4(-1, &status, WUNTRACED, &usage)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        shell_stats.waits++;
+        record_status(sh->session_leader, pid, status, &usage);
+        release_group_resource(&sh->session_leader);
+        schedule_runs();
+    }
+}
+
+/* A job of parallel has finished, its slot is free for the next item */
+void item_done(group_t *group, int status)
+{
+    int idx;
+    parallel_run_t *run = group->run;
+
+    for (idx = 0; idx < run->njobs && run->slots[idx] != group; idx++)
+        ;
+    if (idx == run->njobs)
+        return;
+    if (run->nlatency % 1024 == 0)
+        run->latency = (double *)realloc(run->latency, (run->nlatency + 1024) * sizeof(double));
+    run->latency[run->nlatency++] = elapsed_seconds(&run->started[idx]);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        run->failed++;
+    run->slots[idx] = NULL;
+    run->running--;
+    run->ndone++;
+}
+
+/* Nothing gives a job of parallel the terminal, one stopped for it is killed and others go on */
+void item_stopped(process_t *process, int status)
+{
+    if (WSTOPSIG(status) == SIGTTIN || WSTOPSIG(status) == SIGTTOU)
+    {
+        fprintf(stderr, "parallel : %s stopped for the terminal, killed\n", process->argv[0]);
+        kill(process->pid, SIGKILL);
+    }
+    else
+    {
+        kill(process->pid, SIGCONT);
+        process->status = proc_stat[RUNNING];
+    }
+}
+
+/* Throughput and latency of the items, on the stderr of the run or with the job notices at the terminal */
+void report_run(parallel_run_t *run)
+{
+    char line[256];
+    double seconds = elapsed_seconds(&run->begin);
+
+    if (run->nlatency == 0)
+        return;
+    qsort(run->latency, run->nlatency, sizeof(double), compare_double);
+    snprintf(line, sizeof(line),
+             "parallel : %lu items in %.3f s (%.0f items/sec) latency p50 %.3f s p99 %.3f s max %.3f s, %d failed\n",
+             run->ndone, seconds, run->ndone / seconds, run->latency[run->nlatency / 2],
+             run->latency[run->nlatency * 99 / 100], run->latency[run->nlatency - 1], run->failed);
+    if (run->background && report_jobs && isatty(run->fds[2]))
+        queue_notice(line);
+    else if (run->background && run->fds[2] != -1)
+        write(run->fds[2], line, strlen(line));
+    else
+        fputs(line, stderr);
+}
+
+/* Progress of the background runs, for jobs -l */
+void print_runs(void)
+{
+    parallel_run_t *run;
+
+    for (run = parallel_runs; run != NULL; run = run->next)
+        printf("parallel %s : %lu of %lu items done, %d running, %d failed, %.3f s\n", run->words[0],
+               run->ndone, run->ntotal, run->running, run->failed, elapsed_seconds(&run->begin));
+}
+
+/* Release a run with its copies and descriptors */
+void free_run(parallel_run_t *run)
+{
+    int idx;
+
+    for (idx = 0; idx < 3; idx++)
+        if (run->fds[idx] != -1)
+            close(run->fds[idx]);
+    if (run->reader == &run->own_reader)
+        free(run->own_reader.buf);
+    arena_release(run->arena);
+    free(run->latency);
+    free(run->started);
+    free(run->slots);
+    free(run);
+}
+
+/* Start the command of parallel for one item as a background job of the shell */
+group_t *launch_item(parallel_run_t *run, char *item)
+{
+    int idx, replaced = 0;
+    size_t size = strlen(item) + 1;
+    arena_t *arena;
+    group_t *group;
+    process_t *process;
+    redirect_t *redir;
+
+    for (idx = 0; idx < run->nwords; idx++)
+        size += 2 * (strlen(run->words[idx]) + strlen(item) + 1);
+    arena = arena_create(size + (run->nwords + 2) * sizeof(char *) + 3 * sizeof(redirect_t));
+
+    /* Its run reports it, so it has no job notice of its own */
+    group = insert_group(&run->sh->session_leader);
+    group->arena = arena;
+    group->run = run;
+    arena->refs++;
+    process = insert_process(group);
+
+    /* {} in a word is replaced by the item, otherwise the item is added */
+    process->argv = (char **)arena_alloc(arena, (run->nwords + 2) * sizeof(char *));
+    for (idx = 0; idx < run->nwords; idx++)
+    {
+        process->argv[idx] = substitute_item(arena, run->words[idx], item);
+        if (process->argv[idx] != run->words[idx])
+            replaced = 1;
+    }
+    if (!replaced)
+        process->argv[idx++] = arena_strdup(arena, item);
+    process->argv[idx] = NULL;
+    group->command = process->argv[0];
+
+    /* Items read from stdin are not for the jobs to read, a background run passes on its descriptors */
+    for (idx = 2; idx >= 0; idx--)
+    {
+        if ((idx > 0 || !run->null_stdin) && run->fds[idx] == -1)
+            continue;
+        redir = (redirect_t *)arena_alloc(arena, sizeof(redirect_t));
+        memset(redir, 0, sizeof(redirect_t));
+        redir->fd = idx;
+        if (idx == 0 && run->null_stdin)
+        {
+            redir->type = REDIR_IN;
+            redir->path = "/dev/null";
+        }
+        else
+        {
+            redir->type = REDIR_DUP;
+            redir->dup_fd = run->fds[idx];
+        }
+        redir->next = process->redirects;
+        process->redirects = redir;
+    }
+
+    launch_group(group, run->sh);
+    if (group->nprocess == 0)
+    {
+        release_group_resource(&run->sh->session_leader);
+        return NULL;
+    }
+    return group;
+}
+
+/* Copy of a word with every {} replaced by the item, the word itself when it has none */
+char *substitute_item(arena_t *arena, const char *word, const char *item)
+{
+    size_t len = 0, count = 0, item_len = strlen(item);
+    const char *mark;
+    char *copy;
+
+    for (mark = strstr(word, "{}"); mark != NULL; mark = strstr(mark + 2, "{}"))
+        count++;
+    if (count == 0)
+        return (char *)word;
+
+    copy = (char *)arena_alloc(arena, strlen(word) + count * item_len + 1);
+    while ((mark = strstr(word, "{}")) != NULL)
+    {
+        memcpy(copy + len, word, mark - word);
+        len += mark - word;
+        memcpy(copy + len, item, item_len);
+        len += item_len;
+        word = mark + 2;
+    }
+    strcpy(copy + len, word);
+    return copy;
+}
+
+/* Order of strings for qsort */
+int compare_string(const void *a, const void *b)
+{
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Order of doubles for qsort */
+int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+void ignore_foreground_signals(int signum)
+{
+    /* This is just to ignore the foreground signals by shell */
+}
+
+/* Drop a process that could not be started from its group */
+process_t *release_process_resource(group_t *group, process_t *process)
+{
+    process_t *next_proc = process->proc_link;
+
+    /* Unlink from the group, arguments stay in the arena of the line */
+    if (process->prev_proc != NULL)
+        process->prev_proc->proc_link = next_proc;
+    else
+        group->proc_link = next_proc;
+    if (next_proc != NULL)
+        next_proc->prev_proc = process->prev_proc;
+    else
+        group->proc_tail = process->prev_proc;
+
+    /* Release process resource */
+    process->proc_link = job_table.free_processes;
+    job_table.free_processes = process;
+
+    /* Decrement no of process in group, an empty group is released later */
+    group->nprocess--;
+    if (--group->nlive == 0)
+    {
+        group->dead_link = job_table.dead_groups;
+        job_table.dead_groups = group;
+    }
+
+    /* Return next process in the group */
+    return next_proc;
+}
+
+/*
+ * A process has exited. It stays in its group with its resource usage
+ * until the whole group is released, so jobs -l can show it.
+ */
+void finish_process(group_t *group, process_t *process)
+{
+    unindex_process(process);
+
+    add_usage(&group->usage, &process->usage);
+
+    /* Group is released once none of its processes is left */
+    if (--group->nlive == 0)
+    {
+        group->dead_link = job_table.dead_groups;
+        job_table.dead_groups = group;
+    }
+}
+
+/* Unlink a process from the pid index, the pid may be reused from now on */
+void unindex_process(process_t *process)
+{
+    process_t **link;
+
+    for (link = &job_table.pid_index[process->pid % PID_BUCKETS]; *link != NULL; link = &(*link)->pid_link)
+    {
+        if (*link == process)
+        {
+            *link = process->pid_link;
+            break;
+        }
+    }
+}
+
+/* Release the groups that have no process left */
+void release_group_resource(group_t **session_leader)
+{
+    group_t *grp_ptr;
+    process_t *proc_ptr, *next_proc;
+
+    while ((grp_ptr = job_table.dead_groups) != NULL)
+    {
+        job_table.dead_groups = grp_ptr->dead_link;
+
+        /* Unlink from the session */
+        if (grp_ptr->prev_group != NULL)
+            grp_ptr->prev_group->group_link = grp_ptr->group_link;
+        else
+            *session_leader = grp_ptr->group_link;
+        if (grp_ptr->group_link != NULL)
+            grp_ptr->group_link->prev_group = grp_ptr->prev_group;
+
+        /* Release the finished processes */
+        for (proc_ptr = grp_ptr->proc_link; proc_ptr != NULL; proc_ptr = next_proc)
+        {
+            next_proc = proc_ptr->proc_link;
+            proc_ptr->proc_link = job_table.free_processes;
+            job_table.free_processes = proc_ptr;
+        }
+
+        /* Release group resource, with its line once no job uses it */
+        arena_release(grp_ptr->arena);
+        grp_ptr->group_link = job_table.free_groups;
+        job_table.free_groups = grp_ptr;
+        shell_stats.jobs_reaped++;
+    }
+}
+
+/* Add the resource usage of a process to a total */
+void add_usage(struct rusage *total, struct rusage *usage)
+{
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = usage->ru_maxrss;
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_inblock += usage->ru_inblock;
+    total->ru_oublock += usage->ru_oublock;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+/* Print the times of a timed pipeline on stderr */
+void print_times(double real, struct rusage *usage)
+{
+    double user = usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6;
+    double sys = usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1e6;
+
+    fprintf(stderr, "\nreal\t%dm%.3fs\nuser\t%dm%.3fs\nsys\t%dm%.3fs\n",
+            (int)(real / 60), real - 60 * (int)(real / 60),
+            (int)(user / 60), user - 60 * (int)(user / 60),
+            (int)(sys / 60), sys - 60 * (int)(sys / 60));
+}
+
+/* Print info for each process with pid */
+void print_resource_for_my_shell(group_t *session_leader)
+{
+    int idx, proc_count = 0;
+    char place[128];
+    group_t *grp_ptr = session_leader;
+    process_t * proc_ptr;
+
+    if (session_leader != NULL)
+    {
+        printf("%-6s%-9s%-11s%-11s%-11s%-9s%-9s%-34s%-11s\n","PID", "PGID", "STATUS", "STAT", "SIGNAL", "CPU", "MAXRSS", "PLACEMENT", "COMMAND");
+        printf("------------------------------------------------------------------------------------------------------------\n");
+    }
+    while (grp_ptr != NULL)
+    {
+        proc_count = 0;
+        proc_ptr = grp_ptr->proc_link;
+        while (proc_ptr != NULL)
+        {
+            proc_count++;
+
+            printf("%-6d", proc_ptr->pid);
+            printf("%-9d", proc_ptr->pgid);
+
+            if(grp_ptr->status == FG)
+            printf("%-11s", "Foreground");
+            else
+            printf("%-11s", "Background");
+
+            printf("%-11s", proc_ptr->status);
+
+            if (strcmp(proc_ptr->status, "stopped") == 0)
+            printf("%-11s", proc_ptr->signal);
+            else
+            printf("%-11s", " ");
+
+            /* CPU time and peak RSS are known once a process has finished */
+            if (proc_ptr->status == proc_stat[EXITED] || proc_ptr->status == proc_stat[KILLED])
+            {
+                printf("%-9.2f", proc_ptr->usage.ru_utime.tv_sec + proc_ptr->usage.ru_stime.tv_sec +
+                       (proc_ptr->usage.ru_utime.tv_usec + proc_ptr->usage.ru_stime.tv_usec) / 1e6);
+                printf("%-9ld", proc_ptr->usage.ru_maxrss);
+            }
+            else
+                printf("%-9s%-9s", "-", "-");
+
+            printf("%-34s", grp_ptr->placed ? format_placement(&grp_ptr->placement, place, sizeof(place)) : "-");
+
+            if (proc_count == 1)
+                printf("%-11s ", proc_ptr->argv[0]);
+            else
+                printf("| %-10s", proc_ptr->argv[0]);
+
+            puts("");
+
+            proc_ptr = proc_ptr->proc_link;
+        }
+        grp_ptr = grp_ptr->group_link;
+    }
+    return;
+}
+
+/* Print info for each each group with pgid */
+void jobs(group_t **session_leader)
+{
+    int idx = 0;
+    group_t *grp_ptr = *session_leader;
+    process_t * proc_ptr;
+
+    if (*session_leader != NULL)
+    {
+        printf("%-6s%-9s%-11s%-11s%-11s%-11s\n"," ", "PGID", "STATUS", "STAT", "SIGNAL", "COMMAND");
+        printf("------------------------------------------------------------\n");
+    }
+    else
+    {
+        return;
+    }
+    while (grp_ptr != NULL)
+    {
+            idx++;
+            if (idx == 1)
+                printf("[%2d]+ ", idx);
+            else if (idx == 2)
+                printf("[%2d]- ", idx);
+            else
+                printf("[%2d]  ", idx);
+
+            printf("%-9d", grp_ptr->pgid);
+
+            if(grp_ptr->status == FG)
+            printf("%-11s", "Foreground");
+            else if (grp_ptr->status == BG)
+            printf("%-11s", "Background");
+
+            /* State of the job is that of its first unfinished process */
+            for (proc_ptr = grp_ptr->proc_link; proc_ptr->proc_link != NULL; proc_ptr = proc_ptr->proc_link)
+                if (proc_ptr->status != proc_stat[EXITED] && proc_ptr->status != proc_stat[KILLED])
+                    break;
+
+            printf("%-11s",proc_ptr->status);
+
+            printf("%-11s", proc_ptr->signal);
+
+            proc_ptr = grp_ptr->proc_link;
+            while (proc_ptr != NULL)
+            {
+                if(proc_ptr->proc_link != NULL)
+                printf("%s | ",proc_ptr->argv[0]);
+                else
+                printf("%s",proc_ptr->argv[0]);
+                proc_ptr = proc_ptr->proc_link;
+            }
+            puts("");
+            grp_ptr = grp_ptr->group_link;
+    }
+    return;
+}
+
+/* Wait until no process of the foreground group is running */
+void wait_for_fg(group_t **session_leader, int *exit_status, struct rusage *usage)
+{
+    int status;
+    pid_t pid, last_pid = 0;
+    struct rusage proc_usage;
+    group_t *fg_group;
+    process_t *proc_ptr;
+
+    for (fg_group = *session_leader; fg_group != NULL; fg_group = fg_group->group_link)
+        if (fg_group->status == FG)
+            break;
+    if (fg_group == NULL)
+        return;
+
+    /* Exit status of the pipeline is that of its last process */
+    for (proc_ptr = fg_group->proc_link; proc_ptr != NULL; proc_ptr = proc_ptr->proc_link)
+        last_pid = proc_ptr->pid;
+
+    TRACE(TRACE_WAIT, 'B', 0, 0, fg_group->pgid, fg_group->command);
+    while (group_running(fg_group))
+    {
+        /* Any child may report here, background ones are recorded too */
+        if ((pid = wait4(-1, &status, WUNTRACED | WCONTINUED, &proc_usage)) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("wait4 on foreground process");
+            exit(EXIT_FAILURE);
+        }
+        shell_stats.waits++;
+
+#ifdef DEBUG
+        printf("Process %d has changed state\n", pid);
+#endif
+        if (pid == last_pid)
+        {
+            if (WIFEXITED(status))
+                *exit_status = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status))
+                *exit_status = WTERMSIG(status) + 128;
+            else if (WIFSTOPPED(status))
+                *exit_status = WSTOPSIG(status) + 128;
+        }
+        record_status(*session_leader, pid, status, &proc_usage);
+
+        /* Background runs of parallel start their next items meanwhile, the job is not released while it runs */
+        if (group_running(fg_group))
+            schedule_runs();
+    }
+    TRACE(TRACE_WAIT, 'E', 0, 0, fg_group->pgid, fg_group->command);
+    fg_group->status = BG;
+
+    /* Usage of the processes that finished, for time */
+    if (usage != NULL)
+        *usage = fg_group->usage;
+
+    release_group_resource(session_leader);
+    schedule_runs();
+    return;
+}
+
+/*
+ * Reap every child that changed state since the last call. Nothing is
+ * asked of the kernel unless SIGCHLD arrived, and then all pending
+ * changes are collected with wait4(-1) in one batch.
+ */
+void update_status_of_bg(group_t **session_leader)
+{
+    int status;
+    pid_t pid;
+    ssize_t nread;
+    struct rusage usage;
+    struct signalfd_siginfo info[16];
+
+    /* Several state changes may have been merged into one signal */
+    nread = 0;
+    while (read(sigchld_fd, info, sizeof(info)) > 0)
+        nread++;
+    if (nread == 0)
+        return;
+
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+    {
+        shell_stats.waits++;
+#ifdef DEBUG
+        printf("Background process %d has changed state\n", pid);
+#endif
+        record_status(*session_leader, pid, status, &usage);
+    }
+    release_group_resource(session_leader);
+
+    /* Jobs of parallel that finished make room for its next items */
+    schedule_runs();
+    return;
+}
+
+/* Find a live process by its pid */
+process_t *find_process(pid_t pid)
+{
+    process_t *proc_ptr;
+
+    for (proc_ptr = job_table.pid_index[pid % PID_BUCKETS]; proc_ptr != NULL; proc_ptr = proc_ptr->pid_link)
+        if (proc_ptr->pid == pid)
+            return proc_ptr;
+    return NULL;
+}
+
+/* Apply a state change reported by wait4 to the process it belongs to */
+group_t *record_status(group_t *session_leader, pid_t pid, int status, struct rusage *usage)
+{
+    group_t *grp_ptr;
+    process_t *proc_ptr;
+
+    if ((proc_ptr = find_process(pid)) == NULL)
+        return NULL;
+    grp_ptr = proc_ptr->group;
+
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+    {
+        TRACE(TRACE_EXIT, 'i', pid, proc_ptr->pgid, WIFEXITED(status) ? WEXITSTATUS(status) : WTERMSIG(status) + 128,
+              proc_ptr->argv[0]);
+        proc_ptr->status = proc_stat[WIFEXITED(status) ? EXITED : KILLED];
+        proc_ptr->usage = *usage;
+
+        /* A job of parallel is reported by its run, the last process of another background job is gone */
+        if (grp_ptr->run != NULL)
+            item_done(grp_ptr, status);
+        else if (grp_ptr->nlive == 1 && grp_ptr->status == BG)
+            notify_job(session_leader, grp_ptr, WIFEXITED(status) ? "Done" : "Killed");
+
+        finish_process(grp_ptr, proc_ptr);
+    }
+    else if (WIFSTOPPED(status))
+    {
+        TRACE(TRACE_STOP, 'i', pid, proc_ptr->pgid, WSTOPSIG(status), proc_ptr->argv[0]);
+        proc_ptr->status = proc_stat[STOPPED];
+        proc_ptr->signal = stop_signal_name(WSTOPSIG(status));
+
+        /* A job of parallel goes on or is killed, another one has come to a stop */
+        if (grp_ptr->run != NULL)
+            item_stopped(proc_ptr, status);
+        else if (!group_running(grp_ptr))
+            notify_job(session_leader, grp_ptr, "Stopped");
+    }
+    else if (WIFCONTINUED(status))
+    {
+        TRACE(TRACE_CONTINUE, 'i', pid, proc_ptr->pgid, 0, proc_ptr->argv[0]);
+        proc_ptr->status = proc_stat[RUNNING];
+    }
+    return grp_ptr;
+}
+
+/* Check if any process of a group is still running */
+int group_running(group_t *group)
+{
+    process_t *proc_ptr;
+
+    for (proc_ptr = group->proc_link; proc_ptr != NULL; proc_ptr = proc_ptr->proc_link)
+        if (proc_ptr->status == proc_stat[RUNNING])
+            return 1;
+    return 0;
+}
+
+/* Name of the signal that stopped a process */
+char *stop_signal_name(int signum)
+{
+    switch (signum)
+    {
+        case SIGSTOP:
+            return sig[1];
+        case SIGTSTP:
+            return sig[2];
+        case SIGTTIN:
+            return sig[3];
+        case SIGTTOU:
+            return sig[4];
+        default:
+            return sig[0];
+    }
+}
+
+/* Queue a job state message, shown before the next prompt */
+void notify_job(group_t *session_leader, group_t *group, char *state)
+{
+    int idx = 1;
+    int len;
+    group_t *grp_ptr;
+
+    if (!report_jobs)
+        return;
+
+    /* Number the job the way jobs does */
+    for (grp_ptr = session_leader; grp_ptr != group; grp_ptr = grp_ptr->group_link)
+        idx++;
+
+    len = snprintf(NULL, 0, "[%2d]%c %-9d%-11s%s\n", idx, idx == 1 ? '+' : idx == 2 ? '-' : ' ',
+                   group->pgid, state, group->command);
+    if (notices_len + len + 1 > notices_size)
+    {
+        notices_size = (notices_len + len + 1) * 2;
+        job_notices = (char *)realloc(job_notices, notices_size);
+    }
+    sprintf(job_notices + notices_len, "[%2d]%c %-9d%-11s%s\n", idx, idx == 1 ? '+' : idx == 2 ? '-' : ' ',
+            group->pgid, state, group->command);
+    notices_len += len;
+}
+
+/* Queue a line of text with the job state messages */
+void queue_notice(const char *text)
+{
+    size_t len = strlen(text);
+
+    if (notices_len + len + 1 > notices_size)
+    {
+        notices_size = (notices_len + len + 1) * 2;
+        job_notices = (char *)realloc(job_notices, notices_size);
+    }
+    memcpy(job_notices + notices_len, text, len + 1);
+    notices_len += len;
+}
+
+/* Print the queued job state messages */
+void print_job_notices(void)
+{
+    if (notices_len == 0)
+        return;
+    fwrite(job_notices, 1, notices_len, stdout);
+    notices_len = 0;
+}
+
+/* Block until input is ready, returns 0 when children were reaped instead */
+int wait_for_input(int event_fd, group_t **session_leader)
+{
+    struct epoll_event events[2];
+    int idx, nready, input_ready = 0;
+
+    if ((nready = epoll_wait(event_fd, events, 2, -1)) == -1)
+        return 0;
+
+    for (idx = 0; idx < nready; idx++)
+    {
+        if (events[idx].data.fd == sigchld_fd)
+            update_status_of_bg(session_leader);
+        else
+            input_ready = 1;
+    }
+    return input_ready;
+}
+
+/* Put a background process to foreground */
+void fg(int terminal, group_t **session_leader, pid_t shell_pid, int *exit_status)
+{
+    int status;
+    process_t *proc_ptr;
+
+    if (*session_leader != NULL)
+    if ((*session_leader)->proc_link != NULL)
+    if ((*session_leader)->status == BG)
+    {
+        printf("%s\n",(*session_leader)->proc_link->argv[0]);
+
+        /* Give the control terminal to following group */
+        if (terminal != -1)
+            TRACE(TRACE_TERMINAL, 'i', 0, 0, (*session_leader)->pgid, NULL);
+        if (terminal != -1 && tcsetpgrp(terminal, (*session_leader)->pgid) == -1)
+        {
+            perror("tcsetpgrp1");
+            exit(0);
+        }
+
+        proc_ptr = (*session_leader)->proc_link;
+        while (proc_ptr != NULL)
+        {
+            /* Send SIGCONT to each process to resume execution, finished ones are left alone */
+            if (proc_ptr->status == proc_stat[STOPPED])
+            {
+                TRACE(TRACE_CONTINUE, 'i', proc_ptr->pid, proc_ptr->pgid, 0, "SIGCONT sent");
+                kill(proc_ptr->pid, SIGCONT);
+                proc_ptr->status = proc_stat[RUNNING];
+                proc_ptr->signal = sig[0];
+            }
+            proc_ptr = proc_ptr->proc_link;
+        }
+        (*session_leader)->status = FG;
+
+        /* Wait for process group to change state */
+        wait_for_fg(session_leader, exit_status, NULL);
+
+        /* Retrive the controlling terminal back */
+        if (terminal != -1)
+            TRACE(TRACE_TERMINAL, 'i', 0, 0, shell_pid, NULL);
+        if (terminal != -1 && tcsetpgrp(terminal, shell_pid) == -1)
+        {
+            perror("tcsetpgrp2");
+            exit(0);
+        }
+    }
+    return;
+}
+
+/* Remember the terminal settings the editor goes back to after each line */
+void editor_init(line_editor_t *editor, int fd)
+{
+    memset(editor, 0, sizeof(*editor));
+    editor->fd = fd;
+    tcgetattr(fd, &editor->cooked);
+    editor->size = 256;
+    editor->buf = (char *)malloc(editor->size);
+}
+
+/* Next line of input, edited on the terminal behind prompt, the compiled one when NULL */
+char *next_line(shell_t *sh, const char *prompt)
+{
+    if (sh->editor != NULL)
+        return edit_line(sh->editor, sh, prompt);
+    return read_line(sh->input);
+}
+
+/*
+ * Show the prompt and edit a line in raw mode, children are reaped while
+ * the user is typing. Input is read one byte at a time so that typeahead
+ * after the line is left for the command it starts. Returns the line, valid
+ * until the next call, or NULL at end of input.
+ */
+char *edit_line(line_editor_t *editor, shell_t *sh, const char *prompt)
+{
+    struct termios raw;
+    unsigned char c;
+    char *newline;
+    int navail, state = EDIT_MORE;
+    ssize_t nread;
+
+    editor->len = editor->cursor = 0;
+    editor->hist_pos = HIST_NONE;
+    editor->searching = editor->esc = 0;
+
+    /* Redraws only repeat the last line of the prompt */
+    if (prompt != NULL)
+        editor->prompt_len = strlen(strncpy(editor->prompt, prompt, sizeof(editor->prompt) - 1));
+    else
+        editor->prompt_len = render_prompt(sh, editor->prompt, sizeof(editor->prompt));
+    newline = memrchr(editor->prompt, '\n', editor->prompt_len);
+    editor->prompt_last = newline ? newline - editor->prompt + 1 : 0;
+
+    /* Raw mode before the prompt, keys typed after it must not be echoed */
+    raw = editor->cooked;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(editor->fd, TCSADRAIN, &raw);
+
+    /* Job notices are still in stdio */
+    fflush(stdout);
+    if (write(1, editor->prompt, editor->prompt_len) == -1)
+        perror("write");
+
+    while (state == EDIT_MORE)
+    {
+        /* Keep reaping while the user is typing */
+        if (!wait_for_input(sh->event_fd, &sh->session_leader))
+            continue;
+        if (ioctl(editor->fd, FIONREAD, &navail) == -1 || navail < 1)
+            navail = 1;
+
+        while (state == EDIT_MORE && navail-- > 0)
+        {
+            if ((nread = read(editor->fd, &c, 1)) == -1 && errno == EINTR)
+                continue;
+            state = nread == 1 ? editor_key(editor, c) : EDIT_EOF;
+        }
+    }
+    tcsetattr(editor->fd, TCSADRAIN, &editor->cooked);
+
+    if (state == EDIT_EOF)
+        return NULL;
+    editor->buf[editor->len] = '\0';
+    return editor->buf;
+}
+
+/* Apply one key, returns EDIT_DONE when the line is complete */
+int editor_key(line_editor_t *editor, int key)
+{
+    size_t pos;
+    int searched = 0;
+
+    /* Arrow and editing keys come as ESC [ x or ESC [ n ~ */
+    if (editor->esc == 1)
+    {
+        editor->esc = key == '[' || key == 'O' ? 2 : 0;
+        return EDIT_MORE;
+    }
+    if (editor->esc == 2)
+    {
+        editor->esc = 0;
+        if (key >= '0' && key <= '9')
+        {
+            editor->esc = 3;
+            editor->esc_arg = key;
+            return EDIT_MORE;
+        }
+        switch (key)
+        {
+            case 'A': key = 16; break;
+            case 'B': key = 14; break;
+            case 'C': key = 6; break;
+            case 'D': key = 2; break;
+            case 'H': key = 1; break;
+            case 'F': key = 5; break;
+            default: return EDIT_MORE;
+        }
+    }
+    else if (editor->esc == 3)
+    {
+        editor->esc = 0;
+        if (key != '~')
+            return EDIT_MORE;
+        switch (editor->esc_arg)
+        {
+            case '1': case '7': key = 1; break;
+            case '4': case '8': key = 5; break;
+            case '3': key = KEY_DELETE; break;
+            default: return EDIT_MORE;
+        }
+    }
+    else if (key == 27)
+    {
+        editor->esc = 1;
+        return EDIT_MORE;
+    }
+
+    /* Ctrl-R : type to search older entries, any other key takes the match */
+    if (editor->searching)
+    {
+        if (key == 18)
+        {
+            if (!editor->search_failed)
+                editor_search(editor, editor->match);
+            editor_refresh(editor);
+            return EDIT_MORE;
+        }
+        if (key == 127 || key == 8)
+        {
+            if (editor->query_len > 0)
+                editor->query_len--;
+            editor_search(editor, history.nentries);
+            editor_refresh(editor);
+            return EDIT_MORE;
+        }
+        if (key == 7)
+        {
+            editor->searching = 0;
+            editor_set(editor, editor->saved, editor->saved_len);
+            editor_refresh(editor);
+            return EDIT_MORE;
+        }
+        if (key >= 32 && key < 127 && editor->query_len < MAX_QUERY)
+        {
+            /* Entries newer than the match did not even hold the shorter query */
+            editor->query[editor->query_len++] = key;
+            editor_search(editor, editor->match < history.nentries ? editor->match + 1 : history.nentries);
+            editor_refresh(editor);
+            return EDIT_MORE;
+        }
+        editor->searching = 0;
+        searched = 1;
+    }
+
+    switch (key)
+    {
+        case '\r':
+        case '\n':
+            /* The screen still shows the search */
+            if (searched)
+            {
+                editor->cursor = editor->len;
+                editor_refresh(editor);
+            }
+            if (write(1, "\n", 1) == -1)
+                perror("write");
+            return EDIT_DONE;
+        case 3:
+            /* Ctrl-C drops the line */
+            if (write(1, "^C\n", 3) == -1)
+                perror("write");
+            editor->len = 0;
+            return EDIT_DONE;
+        case 4:
+            if (editor->len == 0)
+                return EDIT_EOF;
+            /* Ctrl-D on a line deletes like the Delete key */
+            /* fall through */
+        case KEY_DELETE:
+            if (editor->cursor < editor->len)
+            {
+                for (pos = editor->cursor + 1; pos < editor->len && (editor->buf[pos] & 0xC0) == 0x80; pos++)
+                    ;
+                editor_delete(editor, editor->cursor, pos);
+            }
+            break;
+        case 127:
+        case 8:
+            if (editor->cursor > 0)
+                editor_delete(editor, char_start(editor->buf, editor->cursor - 1), editor->cursor);
+            break;
+        case 1:
+            editor->cursor = 0;
+            break;
+        case 5:
+            editor->cursor = editor->len;
+            break;
+        case 2:
+            if (editor->cursor > 0)
+                editor->cursor = char_start(editor->buf, editor->cursor - 1);
+            break;
+        case 6:
+            if (editor->cursor < editor->len)
+                for (editor->cursor++; editor->cursor < editor->len && (editor->buf[editor->cursor] & 0xC0) == 0x80;
+                     editor->cursor++)
+                    ;
+            break;
+        case 11:
+            editor->len = editor->cursor;
+            break;
+        case 21:
+            editor_delete(editor, 0, editor->cursor);
+            break;
+        case 23:
+            /* Ctrl-W deletes the word before the cursor */
+            for (pos = editor->cursor; pos > 0 && editor->buf[pos - 1] == ' '; pos--)
+                ;
+            for (; pos > 0 && editor->buf[pos - 1] != ' '; pos--)
+                ;
+            editor_delete(editor, pos, editor->cursor);
+            break;
+        case 12:
+            if (write(1, "\033[H\033[2J", 7) == -1 || write(1, editor->prompt, editor->prompt_last) == -1)
+                perror("write");
+            break;
+        case 16:
+        case 14:
+            editor_history(editor, key == 16);
+            return EDIT_MORE;
+        case 18:
+            editor_save(editor);
+            editor->searching = 1;
+            editor->search_failed = 0;
+            editor->query_len = 0;
+            history_sync(&history);
+            editor->match = history.nentries;
+            break;
+        default:
+            if (key < 32 || key > 255)
+                return EDIT_MORE;
+            editor_insert(editor, key);
+            return EDIT_MORE;
+    }
+    editor_refresh(editor);
+    return EDIT_MORE;
+}
+
+/* Insert a byte at the cursor, typing at the end only echoes it */
+void editor_insert(line_editor_t *editor, char c)
+{
+    char byte = c;
+
+    if (editor->len + 2 > editor->size)
+    {
+        editor->size *= 2;
+        editor->buf = (char *)realloc(editor->buf, editor->size);
+    }
+    if (editor->cursor == editor->len)
+    {
+        editor->buf[editor->len++] = c;
+        editor->cursor++;
+        if (write(1, &byte, 1) == -1)
+            perror("write");
+        return;
+    }
+    memmove(editor->buf + editor->cursor + 1, editor->buf + editor->cursor, editor->len - editor->cursor);
+    editor->buf[editor->cursor++] = c;
+    editor->len++;
+    editor_refresh(editor);
+}
+
+/* Remove the bytes from..to and put the cursor there */
+void editor_delete(line_editor_t *editor, size_t from, size_t to)
+{
+    memmove(editor->buf + from, editor->buf + to, editor->len - to);
+    editor->len -= to - from;
+    editor->cursor = from;
+}
+
+/* Replace the line, with the cursor at its end */
+void editor_set(line_editor_t *editor, const char *text, size_t len)
+{
+    if (len + 1 > editor->size)
+    {
+        editor->size = len + 1;
+        editor->buf = (char *)realloc(editor->buf, editor->size);
+    }
+    memcpy(editor->buf, text, len);
+    editor->len = editor->cursor = len;
+}
+
+/* Keep the typed line while history is shown in its place */
+void editor_save(line_editor_t *editor)
+{
+    if (editor->len > editor->saved_size)
+    {
+        editor->saved_size = editor->len;
+        editor->saved = (char *)realloc(editor->saved, editor->saved_size);
+    }
+    if (editor->len > 0)
+        memcpy(editor->saved, editor->buf, editor->len);
+    editor->saved_len = editor->len;
+}
+
+/* Redraw the last line of the prompt and the line with one writev */
+void editor_refresh(line_editor_t *editor)
+{
+    struct iovec iov[7];
+    char moves[32];
+    size_t pos, ncols = 0;
+    int niov = 0;
+
+    /* Columns between the cursor and the end of the line */
+    for (pos = editor->cursor; pos < editor->len; pos++)
+        if ((editor->buf[pos] & 0xC0) != 0x80)
+            ncols++;
+    moves[0] = '\0';
+    if (ncols > 0)
+        sprintf(moves, "\033[%zuD", ncols);
+
+    iov[niov].iov_base = "\r";
+    iov[niov++].iov_len = 1;
+    if (editor->searching)
+    {
+        iov[niov].iov_base = editor->search_failed ? "(failed reverse-i-search)`" : "(reverse-i-search)`";
+        iov[niov].iov_len = strlen(iov[niov].iov_base);
+        niov++;
+        iov[niov].iov_base = editor->query;
+        iov[niov++].iov_len = editor->query_len;
+        iov[niov].iov_base = "': ";
+        iov[niov++].iov_len = 3;
+    }
+    else
+    {
+        iov[niov].iov_base = editor->prompt + editor->prompt_last;
+        iov[niov++].iov_len = editor->prompt_len - editor->prompt_last;
+    }
+    iov[niov].iov_base = editor->buf;
+    iov[niov++].iov_len = editor->len;
+    iov[niov].iov_base = "\033[K";
+    iov[niov++].iov_len = 3;
+    iov[niov].iov_base = moves;
+    iov[niov++].iov_len = strlen(moves);
+    if (writev(1, iov, niov) == -1)
+        perror("writev");
+}
+
+/* Up and down walk through history, the typed line comes back at the end */
+void editor_history(line_editor_t *editor, int older)
+{
+    const char *entry;
+    size_t len;
+
+    if (editor->hist_pos == HIST_NONE)
+    {
+        history_sync(&history);
+        editor->hist_pos = history.nentries;
+    }
+    if (older ? editor->hist_pos == 0 : editor->hist_pos >= history.nentries)
+        return;
+
+    if (editor->hist_pos == history.nentries)
+        editor_save(editor);
+    editor->hist_pos += older ? -1 : 1;
+    if (editor->hist_pos == history.nentries)
+        editor_set(editor, editor->saved, editor->saved_len);
+    else if ((entry = history_entry(&history, editor->hist_pos, &len)) != NULL)
+        editor_set(editor, entry, len);
+    editor_refresh(editor);
+}
+
+/* Show the newest entry before entry below that holds the query */
+void editor_search(line_editor_t *editor, size_t below)
+{
+    const char *entry;
+    size_t len;
+    long found;
+
+    editor->search_failed = 0;
+    if (editor->query_len == 0)
+    {
+        editor->match = history.nentries;
+        editor_set(editor, editor->saved, editor->saved_len);
+        return;
+    }
+    if ((found = history_search(&history, editor->query, editor->query_len, below)) == -1)
+    {
+        editor->search_failed = 1;
+        return;
+    }
+    editor->match = found;
+    if ((entry = history_entry(&history, found, &len)) != NULL)
+        editor_set(editor, entry, len);
+}
+
+/* Start of the UTF-8 character holding the byte at pos */
+size_t char_start(const char *buf, size_t pos)
+{
+    while (pos > 0 && (buf[pos] & 0xC0) == 0x80)
+        pos--;
+    return pos;
+}
+
+/*
+ * Open $HISTFILE, ~/.msh_history by default. Nothing is read here, the
+ * file is mapped and indexed the first time history is looked at. Without
+ * a usable file history lives in a memfd for this session only.
+ */
+void history_open(history_t *hist)
+{
+    const char *file = var_get("HISTFILE");
+    const char *home = var_get("HOME");
+
+    if (hist->cap == 0)
+        hist->cap = HISTORY_CAP;
+    if (file != NULL)
+        hist->path = *file ? strdup(file) : NULL;
+    else if (home != NULL)
+    {
+        hist->path = (char *)malloc(strlen(home) + sizeof("/.msh_history"));
+        sprintf(hist->path, "%s/.msh_history", home);
+    }
+
+    if (hist->path == NULL || history_reopen(hist) == -1)
+    {
+        free(hist->path);
+        hist->path = NULL;
+        hist->fd = memfd_create("msh_history", MFD_CLOEXEC);
+    }
+}
+
+/* Open the history file again, after it was compacted and renamed over */
+int history_reopen(history_t *hist)
+{
+    struct stat st;
+    int fd;
+
+    if ((fd = open(hist->path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1 || fstat(fd, &st) == -1)
+    {
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if (hist->fd != -1)
+        close(hist->fd);
+    if (hist->map != NULL)
+        munmap(hist->map, hist->map_size);
+
+    hist->fd = fd;
+    hist->dev = st.st_dev;
+    hist->ino = st.st_ino;
+    hist->map = NULL;
+    hist->map_size = 0;
+    hist->nentries = 0;
+    hist->compacting = 0;
+    return 0;
+}
+
+/*
+ * Bring the mapping and the index up to date with the file, which other
+ * shells may have appended to. Only the new part of the file is indexed.
+ */
+int history_sync(history_t *hist)
+{
+    struct stat st;
+    size_t size, indexed;
+    char *scan, *end, *newline;
+    void *map;
+
+    if (hist->fd == -1)
+        return -1;
+
+    /* Compacted by a child of some shell : start over on the new file */
+    if (hist->path != NULL && stat(hist->path, &st) == 0 && (st.st_dev != hist->dev || st.st_ino != hist->ino))
+        history_reopen(hist);
+    if (fstat(hist->fd, &st) == -1)
+        return -1;
+    size = st.st_size;
+
+    if (hist->offsets == NULL)
+    {
+        hist->offsets_size = 1024;
+        hist->offsets = (size_t *)malloc(hist->offsets_size * sizeof(size_t));
+        hist->offsets[0] = 0;
+    }
+    indexed = hist->offsets[hist->nentries];
+    if (size < indexed)
+    {
+        /* Cut short by someone else, index it again */
+        hist->nentries = 0;
+        indexed = 0;
+    }
+
+    if (size != hist->map_size)
+    {
+        if (hist->map == NULL)
+            map = size ? mmap(NULL, size, PROT_READ, MAP_SHARED, hist->fd, 0) : NULL;
+        else if (size == 0)
+        {
+            munmap(hist->map, hist->map_size);
+            map = NULL;
+        }
+        else
+            map = mremap(hist->map, hist->map_size, size, MREMAP_MAYMOVE);
+        if (map == MAP_FAILED)
+            return -1;
+        hist->map = (char *)map;
+        hist->map_size = size;
+    }
+
+    /* Only whole lines are entries */
+    end = hist->map + size;
+    for (scan = hist->map + indexed; scan < end && (newline = memchr(scan, '\n', end - scan)) != NULL;
+         scan = newline + 1)
+    {
+        if (hist->nentries + 2 > hist->offsets_size)
+        {
+            hist->offsets_size *= 2;
+            hist->offsets = (size_t *)realloc(hist->offsets, hist->offsets_size * sizeof(size_t));
+        }
+        hist->offsets[++hist->nentries] = newline + 1 - hist->map;
+    }
+    return 0;
+}
+
+/*
+ * Append a line with one O_APPEND write, so shells sharing the file do not
+ * mix their lines. The lock keeps the write off a file being compacted.
+ */
+void history_add(history_t *hist, const char *line)
+{
+    struct iovec iov[2];
+    struct stat st, path_st;
+
+    if (hist->fd == -1)
+        return;
+
+    while (1)
+    {
+        flock(hist->fd, LOCK_EX);
+        if (hist->path == NULL || stat(hist->path, &path_st) == -1 ||
+            (path_st.st_dev == hist->dev && path_st.st_ino == hist->ino))
+            break;
+        flock(hist->fd, LOCK_UN);
+        if (history_reopen(hist) == -1)
+            return;
+    }
+
+    iov[0].iov_base = (char *)line;
+    iov[0].iov_len = strlen(line);
+    iov[1].iov_base = "\n";
+    iov[1].iov_len = 1;
+    if (writev(hist->fd, iov, 2) == -1)
+        perror("history");
+    flock(hist->fd, LOCK_UN);
+
+    if (!hist->compacting && hist->path != NULL && fstat(hist->fd, &st) == 0 && st.st_size > hist->cap)
+        history_compact(hist);
+}
+
+/*
+ * Number of the newest entry before entry below that holds the query, -1
+ * when there is none. The mapping is searched backwards a chunk at a time,
+ * so recent matches are found without touching the rest of the file.
+ */
+long history_search(history_t *hist, const char *query, size_t len, size_t below)
+{
+    const char *chunk, *end, *hit, *last;
+    size_t low, high, mid;
+
+    if (below == 0 || below > hist->nentries || len == 0)
+        return -1;
+
+    /* Leave out the newline of entry below - 1 */
+    end = hist->map + hist->offsets[below] - 1;
+    while (end > hist->map)
+    {
+        chunk = end - hist->map > HISTORY_CHUNK ? end - HISTORY_CHUNK : hist->map;
+
+        /* Last match in the chunk */
+        last = NULL;
+        for (hit = chunk; (hit = memmem(hit, end - hit, query, len)) != NULL; hit++)
+            last = hit;
+
+        if (last != NULL)
+        {
+            /* Entry holding the match */
+            for (low = 0, high = below - 1; low < high;)
+            {
+                mid = (low + high + 1) / 2;
+                if (hist->map + hist->offsets[mid] <= last)
+                    low = mid;
+                else
+                    high = mid - 1;
+            }
+            return low;
+        }
+
+        /* A match may cross into the next chunk */
+        if (chunk == hist->map)
+            break;
+        end = chunk + len - 1;
+    }
+    return -1;
+}
+
+/* Text and length of an entry, without its newline */
+const char *history_entry(history_t *hist, size_t idx, size_t *len)
+{
+    if (idx >= hist->nentries)
+        return NULL;
+    *len = hist->offsets[idx + 1] - hist->offsets[idx] - 1;
+    return hist->map + hist->offsets[idx];
+}
+
+/*
+ * Keep the newest half of the cap in a new file and rename it over the
+ * old one. A child does it so the prompt does not wait. Shells appending
+ * at the same time wait on the lock and then reopen the new file.
+ */
+void history_compact(history_t *hist)
+{
+    struct stat st, path_st;
+    char *map, *start, *tmp_path;
+    size_t size;
+    pid_t cpid;
+    int fd;
+
+    if ((cpid = fork()) != 0)
+    {
+        /* The child is reaped like any unknown pid */
+        if (cpid > 0)
+            hist->compacting = 1;
+        return;
+    }
+
+    flock(hist->fd, LOCK_EX);
+    if (fstat(hist->fd, &st) == -1 || st.st_size <= hist->cap || stat(hist->path, &path_st) == -1 ||
+        path_st.st_dev != st.st_dev || path_st.st_ino != st.st_ino)
+        _exit(0);
+    size = st.st_size;
+    if ((map = mmap(NULL, size, PROT_READ, MAP_SHARED, hist->fd, 0)) == MAP_FAILED)
+        _exit(1);
+
+    /* Start on a whole entry */
+    start = map + size - hist->cap / 2;
+    if ((start = memchr(start, '\n', map + size - start)) == NULL)
+        _exit(1);
+    start++;
+
+    tmp_path = (char *)malloc(strlen(hist->path) + 32);
+    sprintf(tmp_path, "%s.%d", hist->path, getpid());
+    if ((fd = open(tmp_path, O_WRONLY | O_CREAT | O_EXCL, 0600)) == -1)
+        _exit(1);
+    if (write(fd, start, map + size - start) != map + size - start || fdatasync(fd) == -1 ||
+        rename(tmp_path, hist->path) == -1)
+    {
+        unlink(tmp_path);
+        _exit(1);
+    }
+    _exit(0);
+}
+
+/* history [n] : list the last n entries, all of them by default */
+int builtin_history(int argc, char *argv[], shell_t *sh)
+{
+    const char *entry;
+    size_t idx, len, first = 0;
+    long count;
+
+    if (argc > 2 || (argc == 2 && (count = atol(argv[1])) <= 0))
+    {
+        fprintf(stderr, "history : usage : history [n]\n");
+        return 2;
+    }
+    if (history_sync(&history) == -1)
+        return 0;
+    if (argc == 2 && (size_t)count < history.nentries)
+        first = history.nentries - count;
+
+    for (idx = first; (entry = history_entry(&history, idx, &len)) != NULL; idx++)
+        printf("%5zu  %.*s\n", idx + 1, (int)len, entry);
+    return 0;
+}
+
+/* Read input from a file descriptor in READ_CHUNK sized blocks */
+void reader_init_fd(line_reader_t *reader, int fd)
+{
+    struct stat st;
+
+    reader->fd = fd;
+    if (fstat(fd, &st) == -1)
+        st.st_dev = st.st_ino = 0;
+    reader->dev = st.st_dev;
+    reader->ino = st.st_ino;
+    reader->size = READ_CHUNK;
+    reader->buf = (char *)malloc(reader->size);
+    reader->start = reader->scan = reader->end = 0;
+    reader->eof = 0;
+}
+
+/* Read input lines from a string given with -c */
+void reader_init_string(line_reader_t *reader, const char *str)
+{
+    reader->fd = -1;
+    reader->dev = 0;
+    reader->ino = 0;
+    reader->end = strlen(str);
+    reader->size = reader->end + 1;
+    reader->buf = (char *)malloc(reader->size);
+    memcpy(reader->buf, str, reader->size);
+    reader->start = reader->scan = 0;
+    reader->eof = 1;
+}
+
+/*
+ * Return the next line without its newline, or NULL at end of input.
+ * Lines have no length limit, the buffer grows to hold the longest one.
+ * The returned line is valid until the next call.
+ */
+char *read_line(line_reader_t *reader)
+{
+    char *line, *newline;
+    ssize_t nread;
+
+    while (1)
+    {
+        /* Look for a newline only in the data not scanned before */
+        newline = memchr(reader->buf + reader->scan, '\n', reader->end - reader->scan);
+        if (newline != NULL)
+        {
+            *newline = '\0';
+            line = reader->buf + reader->start;
+            reader->start = reader->scan = newline - reader->buf + 1;
+            return line;
+        }
+        reader->scan = reader->end;
+
+        if (reader->eof)
+        {
+            /* Last line without a newline */
+            if (reader->start == reader->end)
+                return NULL;
+            line = reader->buf + reader->start;
+            reader->buf[reader->end] = '\0';
+            reader->start = reader->scan = reader->end;
+            return line;
+        }
+
+        /* Move the partial line to the front and make room for more input */
+        if (reader->start > 0)
+        {
+            memmove(reader->buf, reader->buf + reader->start, reader->end - reader->start);
+            reader->end -= reader->start;
+            reader->scan -= reader->start;
+            reader->start = 0;
+        }
+        if (reader->size - reader->end < READ_CHUNK / 2)
+        {
+            reader->size *= 2;
+            reader->buf = (char *)realloc(reader->buf, reader->size);
+        }
+
+        /* Keep one byte for the terminating NUL */
+        nread = read(reader->fd, reader->buf + reader->end, reader->size - reader->end - 1);
+        if (nread == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("read");
+            nread = 0;
+        }
+        if (nread == 0)
+            reader->eof = 1;
+        reader->end += nread;
+    }
+}
+
+/* Seconds passed since begin */
+double elapsed_seconds(struct timespec *begin)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) + (now.tv_nsec - begin->tv_nsec) / 1e9;
+}
+
+/* Print command throughput of a non-interactive run on stderr */
+void report_throughput(unsigned long ncommands, double seconds)
+{
+    fprintf(stderr, "mini_shell : %lu commands in %.3f s (%.0f commands/sec)\n",
+            ncommands, seconds, seconds > 0 ? ncommands / seconds : 0.0);
+}
+
+/* Print the time to start and the time spent getting parse trees, lexed or from the cache */
+void report_parse(double startup)
+{
+    fprintf(stderr, "mini_shell : startup %.3f ms, parse %.3f ms (script cache %s)\n", startup * 1e3,
+            script_cache.parse_seconds * 1e3,
+            script_cache.map != NULL ? "hit" : script_cache.path != NULL ? "miss" : "off");
+}
+
+/* Print the allocations made for parsing on stderr */
+void report_allocations(unsigned long ncommands)
+{
+    fprintf(stderr, "mini_shell : %lu allocations (%.2f per command)\n",
+            nallocs, ncommands > 0 ? (double)nallocs / ncommands : 0.0);
+}
+
+/* 64 bit FNV-1a style hash of a block of memory, 8 bytes per multiply */
+uint64_t hash_bytes(const void *data, size_t len)
+{
+    const unsigned char *byte = (const unsigned char *)data;
+    uint64_t hash = 14695981039346656037ull;
+    uint64_t word;
+
+    for (; len >= 8; byte += 8, len -= 8)
+    {
+        memcpy(&word, byte, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+        hash ^= hash >> 32;
+    }
+    while (len-- > 0)
+        hash = (hash ^ *byte++) * 1099511628211ull;
+    return hash;
+}
+
+/*
+ * Find the cache file of a script, named from the hash of its absolute
+ * path in $MSH_CACHE_DIR ($XDG_CACHE_HOME/mini_shell or ~/.cache/mini_shell
+ * when unset, no cache when empty). Maps it when it matches the mtime,
+ * size and content hash of the script, else starts recording.
+ */
+void cache_open(script_cache_t *cache, const char *script, shell_t *sh)
+{
+    int fd;
+    void *data;
+    char dir[PATH_MAX];
+    const char *base;
+    struct stat st;
+
+    cache->sh = sh;
+    if ((base = var_get("MSH_CACHE_DIR")) != NULL)
+        snprintf(dir, sizeof(dir), "%s", base);
+    else if ((base = var_get("XDG_CACHE_HOME")) != NULL && *base != '\0')
+        snprintf(dir, sizeof(dir), "%s/mini_shell", base);
+    else if ((base = var_get("HOME")) != NULL)
+        snprintf(dir, sizeof(dir), "%s/.cache/mini_shell", base);
+    else
+        return;
+    if (dir[0] == '\0' || (cache->script = realpath(script, NULL)) == NULL)
+        return;
+
+    /* Identity of the script as it is now */
+    if ((fd = open(script, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st) == -1 || !S_ISREG(st.st_mode))
+    {
+        if (fd != -1)
+            close(fd);
+        return;
+    }
+    memcpy(cache->header.magic, CACHE_MAGIC, 4);
+    cache->header.version = CACHE_VERSION;
+    cache->header.layout = sizeof(placement_t);
+    cache->header.path_len = strlen(cache->script);
+    cache->header.mtime_sec = st.st_mtim.tv_sec;
+    cache->header.mtime_nsec = st.st_mtim.tv_nsec;
+    cache->header.size = st.st_size;
+    cache->header.hash = hash_bytes("", 0);
+    if (st.st_size > 0 && (data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED)
+    {
+        cache->header.hash = hash_bytes(data, st.st_size);
+        munmap(data, st.st_size);
+    }
+    close(fd);
+
+    cache->path = (char *)malloc(strlen(dir) + 32);
+    sprintf(cache->path, "%s/%016llx.mshc", dir, (unsigned long long)hash_bytes(cache->script, cache->header.path_len));
+    if (cache_map(cache) == 0)
+        return;
+
+    /* Miss : record the lines as they are parsed, the file is written at exit */
+    mkdir(dir, 0700);
+    if (base != NULL && strcmp(dir, base) != 0)
+    {
+        /* ~/.cache may not exist yet either */
+        *strrchr(dir, '/') = '\0';
+        mkdir(dir, 0700);
+        strcat(dir, "/mini_shell");
+        mkdir(dir, 0700);
+    }
+    cache->compiling = 1;
+    cache->owner = getpid();
+    cache_put(cache, &cache->header, sizeof(cache_header_t));
+    cache_put_str(cache, cache->script, cache->header.path_len);
+    cache->start = cache->len;
+    atexit(cache_finish);
+}
+
+/* Map the cache file when it is for this very script, -1 when it is not usable */
+int cache_map(script_cache_t *cache)
+{
+    int fd;
+    struct stat st;
+    const cache_header_t *header;
+    const char *map;
+
+    if ((fd = open(cache->path, O_RDONLY | O_CLOEXEC)) == -1)
+        return -1;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(cache_header_t) ||
+        (map = (const char *)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+    {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    /* Same version, script, mtime, size and content, and records that are whole */
+    header = (const cache_header_t *)map;
+    cache->map = map;
+    cache->pos = sizeof(cache_header_t);
+    if (memcmp(header, &cache->header, offsetof(cache_header_t, records_hash)) != 0 ||
+        (size_t)st.st_size < sizeof(cache_header_t) + header->path_len + 8 ||
+        cache_get_num(cache) != header->path_len + 1 ||
+        memcmp(map + cache->pos, cache->script, header->path_len + 1) != 0 ||
+        (cache->pos += header->path_len + 1) + header->records_len != (size_t)st.st_size ||
+        hash_bytes(map + cache->pos, header->records_len) != header->records_hash)
+    {
+        munmap((void *)map, st.st_size);
+        cache->map = NULL;
+        return -1;
+    }
+    cache->end = st.st_size;
+    return 0;
+}
+
+/* Append bytes to the records */
+void cache_put(script_cache_t *cache, const void *data, size_t len)
+{
+    if (cache->len + len + 1 > cache->size)
+    {
+        cache->size = (cache->len + len + 1) * 2;
+        cache->buf = (char *)realloc(cache->buf, cache->size);
+    }
+    memcpy(cache->buf + cache->len, data, len);
+    cache->len += len;
+}
+
+/* Numbers are 7 bits per byte, most of them fit in one */
+void cache_put_num(script_cache_t *cache, uint32_t value)
+{
+    unsigned char bytes[5];
+    size_t len = 0;
+
+    while (value >= 0x80)
+    {
+        bytes[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    bytes[len++] = value;
+    cache_put(cache, bytes, len);
+}
+
+/* A string ends with a NUL so it can be used where it is mapped */
+void cache_put_str(script_cache_t *cache, const char *str, size_t len)
+{
+    if (str == NULL)
+    {
+        cache_put_num(cache, 0);
+        return;
+    }
+    cache_put_num(cache, len + 1);
+    cache_put(cache, str, len);
+    cache->buf[cache->len++] = '\0';
+}
+
+/* Record a parsed line, line_len sizes its arena when it is read back */
+void cache_put_line(script_cache_t *cache, pipeline_t *list, size_t line_len)
+{
+    cache_put_num(cache, CACHE_LIST);
+    cache_put_num(cache, line_len);
+    cache_put_list(cache, list);
+}
+
+/* Record a PS1= or PS2= line, which is not parsed */
+void cache_put_prompt(script_cache_t *cache, const char *cmd)
+{
+    cache_put_num(cache, CACHE_PROMPT);
+    cache_put_str(cache, cmd, strlen(cmd));
+}
+
+/* A list is its number of pipelines and each of them */
+void cache_put_list(script_cache_t *cache, pipeline_t *list)
+{
+    uint32_t count = 0;
+    pipeline_t *pl;
+
+    for (pl = list; pl != NULL; pl = pl->next)
+        count++;
+    cache_put_num(cache, count);
+    for (pl = list; pl != NULL; pl = pl->next)
+        cache_put_pipeline(cache, pl);
+}
+
+void cache_put_pipeline(script_cache_t *cache, pipeline_t *pl)
+{
+    command_t *command;
+    pipeline_t *branch;
+
+    cache_put_num(cache, pl->background | pl->timed << 1 | (pl->placement != NULL) << 2);
+    cache_put_num(cache, pl->connector);
+    cache_put_str(cache, pl->text, pl->text != NULL ? strlen(pl->text) : 0);
+    if (pl->placement != NULL)
+        cache_put(cache, pl->placement, sizeof(placement_t));
+    cache_put_num(cache, pl->ncommands);
+    for (command = pl->commands; command != NULL; command = command->next)
+        cache_put_command(cache, command);
+    cache_put_num(cache, pl->nbranches);
+    for (branch = pl->branches; branch != NULL; branch = branch->next)
+        cache_put_pipeline(cache, branch);
+}
+
+void cache_put_command(script_cache_t *cache, command_t *command)
+{
+    uint32_t count = 0;
+    redirect_t *redir;
+
+    cache_put_words(cache, command->argc, command->argv);
+    cache_put_words(cache, command->nassigns, command->assigns);
+    cache_put_num(cache, command->expand);
+
+    for (redir = command->redirects; redir != NULL; redir = redir->next)
+        count++;
+    cache_put_num(cache, count);
+    for (redir = command->redirects; redir != NULL; redir = redir->next)
+    {
+        cache_put_num(cache, redir->type);
+        cache_put_num(cache, redir->fd);
+        cache_put_num(cache, redir->dup_fd);
+        cache_put_num(cache, redir->strip_tabs | redir->expand << 1);
+        cache_put_str(cache, redir->path, redir->path != NULL ? strlen(redir->path) : 0);
+        cache_put_str(cache, redir->body, redir->body_len);
+    }
+    cache_put_compound(cache, command->compound);
+}
+
+/* Number of words and each of them */
+void cache_put_words(script_cache_t *cache, int count, char **words)
+{
+    int idx;
+
+    cache_put_num(cache, count);
+    for (idx = 0; idx < count; idx++)
+        cache_put_str(cache, words[idx], strlen(words[idx]));
+}
+
+/* A compound command starts with its type plus one, 0 for none */
+void cache_put_compound(script_cache_t *cache, compound_t *compound)
+{
+    uint32_t count = 0;
+    case_item_t *item;
+
+    if (compound == NULL)
+    {
+        cache_put_num(cache, 0);
+        return;
+    }
+    cache_put_num(cache, compound->type + 1);
+    cache_put_list(cache, compound->cond);
+    cache_put_list(cache, compound->body);
+    cache_put_list(cache, compound->else_part);
+    cache_put_str(cache, compound->name, compound->name != NULL ? strlen(compound->name) : 0);
+
+    /* A for over the positional parameters has no words at all */
+    cache_put_num(cache, compound->words != NULL);
+    if (compound->words != NULL)
+        cache_put_words(cache, compound->nwords, compound->words);
+
+    for (item = compound->items; item != NULL; item = item->next)
+        count++;
+    cache_put_num(cache, count);
+    for (item = compound->items; item != NULL; item = item->next)
+    {
+        cache_put_words(cache, item->npatterns, item->patterns);
+        cache_put_list(cache, item->body);
+    }
+}
+
+uint32_t cache_get_num(script_cache_t *cache)
+{
+    uint32_t value = 0;
+    int shift = 0;
+    unsigned char byte;
+
+    do
+    {
+        byte = cache->map[cache->pos++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        shift += 7;
+    } while (byte & 0x80);
+    return value;
+}
+
+/* String of the mapped records, used where it is */
+char *cache_get_str(script_cache_t *cache, size_t *len)
+{
+    uint32_t str_len = cache_get_num(cache);
+    char *str;
+
+    if (str_len-- == 0)
+        return NULL;
+    str = (char *)cache->map + cache->pos;
+    cache->pos += str_len + 1;
+    if (len != NULL)
+        *len = str_len;
+    return str;
+}
+
+/*
+ * Next line of a mapped cache : its parse tree in a new arena holding one
+ * reference, or the text of a prompt line in *cmd. NULL at the end.
+ */
+arena_t *cache_next_line(script_cache_t *cache, char **cmd, pipeline_t **list)
+{
+    arena_t *arena;
+
+    if (cache->pos >= cache->end)
+        return NULL;
+
+    *cmd = NULL;
+    *list = NULL;
+    if (cache_get_num(cache) == CACHE_PROMPT)
+    {
+        *cmd = cache_get_str(cache, NULL);
+        arena = arena_create(0);
+        arena->refs = 1;
+        return arena;
+    }
+
+    /* Only the nodes are made again, they take less than the lexed line did */
+    arena = arena_create(8 * (cache_get_num(cache) + 1));
+    arena->refs = 1;
+    *list = cache_get_list(cache, arena);
+    return arena;
+}
+
+pipeline_t *cache_get_list(script_cache_t *cache, arena_t *arena)
+{
+    uint32_t count;
+    pipeline_t *list = NULL;
+    pipeline_t **tail = &list;
+
+    for (count = cache_get_num(cache); count > 0; count--)
+    {
+        *tail = cache_get_pipeline(cache, arena);
+        tail = &(*tail)->next;
+    }
+    return list;
+}
+
+pipeline_t *cache_get_pipeline(script_cache_t *cache, arena_t *arena)
+{
+    uint32_t flags, count;
+    pipeline_t *pl;
+    command_t **tail;
+    pipeline_t **branch_tail;
+
+    pl = (pipeline_t *)arena_alloc(arena, sizeof(pipeline_t));
+    memset(pl, 0, sizeof(pipeline_t));
+    flags = cache_get_num(cache);
+    pl->background = flags & 1;
+    pl->timed = (flags >> 1) & 1;
+    pl->connector = (connector_t)cache_get_num(cache);
+    pl->text = cache_get_str(cache, NULL);
+    if (flags & 4)
+    {
+        pl->placement = (placement_t *)arena_alloc(arena, sizeof(placement_t));
+        memcpy(pl->placement, cache->map + cache->pos, sizeof(placement_t));
+        cache->pos += sizeof(placement_t);
+    }
+
+    tail = &pl->commands;
+    for (count = pl->ncommands = cache_get_num(cache); count > 0; count--)
+    {
+        *tail = cache_get_command(cache, arena);
+        tail = &(*tail)->next;
+    }
+    branch_tail = &pl->branches;
+    for (count = pl->nbranches = cache_get_num(cache); count > 0; count--)
+    {
+        *branch_tail = cache_get_pipeline(cache, arena);
+        branch_tail = &(*branch_tail)->next;
+    }
+    return pl;
+}
+
+command_t *cache_get_command(script_cache_t *cache, arena_t *arena)
+{
+    uint32_t count, flags;
+    command_t *command;
+    redirect_t *redir;
+    redirect_t **tail;
+
+    command = (command_t *)arena_alloc(arena, sizeof(command_t));
+    memset(command, 0, sizeof(command_t));
+    command->argc = cache_get_num(cache);
+    command->argv = cache_get_words(cache, command->argc, arena);
+    if ((command->nassigns = cache_get_num(cache)) > 0)
+        command->assigns = cache_get_words(cache, command->nassigns, arena);
+    command->expand = cache_get_num(cache);
+
+    tail = &command->redirects;
+    for (count = cache_get_num(cache); count > 0; count--)
+    {
+        redir = (redirect_t *)arena_alloc(arena, sizeof(redirect_t));
+        memset(redir, 0, sizeof(redirect_t));
+        redir->type = (redirect_type_t)cache_get_num(cache);
+        redir->fd = cache_get_num(cache);
+        redir->dup_fd = cache_get_num(cache);
+        flags = cache_get_num(cache);
+        redir->strip_tabs = flags & 1;
+        redir->expand = (flags >> 1) & 1;
+        redir->path = cache_get_str(cache, NULL);
+        redir->body = cache_get_str(cache, &redir->body_len);
+        *tail = redir;
+        tail = &redir->next;
+    }
+    command->compound = cache_get_compound(cache, arena);
+    return command;
+}
+
+/* Vector of count words ending with NULL, the count is read by the caller */
+char **cache_get_words(script_cache_t *cache, int count, arena_t *arena)
+{
+    int idx;
+    char **words = (char **)arena_alloc(arena, (count + 1) * sizeof(char *));
+
+    for (idx = 0; idx < count; idx++)
+        words[idx] = cache_get_str(cache, NULL);
+    words[count] = NULL;
+    return words;
+}
+
+compound_t *cache_get_compound(script_cache_t *cache, arena_t *arena)
+{
+    uint32_t type, count;
+    compound_t *compound;
+    case_item_t *item;
+    case_item_t **tail;
+
+    if ((type = cache_get_num(cache)) == 0)
+        return NULL;
+    compound = (compound_t *)arena_alloc(arena, sizeof(compound_t));
+    memset(compound, 0, sizeof(compound_t));
+    compound->type = (compound_type_t)(type - 1);
+    compound->cond = cache_get_list(cache, arena);
+    compound->body = cache_get_list(cache, arena);
+    compound->else_part = cache_get_list(cache, arena);
+    compound->name = cache_get_str(cache, NULL);
+    if (cache_get_num(cache))
+    {
+        compound->nwords = cache_get_num(cache);
+        compound->words = cache_get_words(cache, compound->nwords, arena);
+    }
+
+    tail = &compound->items;
+    for (count = cache_get_num(cache); count > 0; count--)
+    {
+        item = (case_item_t *)arena_alloc(arena, sizeof(case_item_t));
+        memset(item, 0, sizeof(case_item_t));
+        item->npatterns = cache_get_num(cache);
+        item->patterns = cache_get_words(cache, item->npatterns, arena);
+        item->body = cache_get_list(cache, arena);
+        *tail = item;
+        tail = &item->next;
+    }
+    return compound;
+}
+
+/*
+ * At exit, write the recorded lines to the cache file. When the script
+ * left early the rest of it is parsed first, without running it and with
+ * any message hidden, and a script with a syntax error is not cached.
+ */
+void cache_finish(void)
+{
+    int fd, text_len;
+    char *cmd, *tmp;
+    arena_t *arena;
+    pipeline_t *list;
+    script_cache_t *cache = &script_cache;
+    cache_header_t *header;
+
+    if (!cache->compiling || cache->owner != getpid())
+        return;
+
+    fflush(stderr);
+    if ((fd = open("/dev/null", O_WRONLY | O_CLOEXEC)) != -1)
+    {
+        dup2(fd, 2);
+        close(fd);
+    }
+    while (cache->compiling && (cmd = next_line(cache->sh, NULL)) != NULL)
+    {
+        if (is_null_input(cmd))
+            continue;
+        if (strncmp(cmd, "PS1=", 4) == 0 || strncmp(cmd, "PS2=", 4) == 0)
+        {
+            cache_put_prompt(cache, cmd);
+            continue;
+        }
+        arena = arena_create(8 * (strlen(cmd) + 1));
+        arena->refs = 1;
+        if ((text_len = command_parser(cmd, arena, &list, cache->sh)) == -1)
+            cache->compiling = 0;
+        else
+            cache_put_line(cache, list, text_len);
+        arena_release(arena);
+    }
+    if (!cache->compiling)
+        return;
+
+    /* Written aside and renamed, so a reader never sees half a file */
+    header = (cache_header_t *)cache->buf;
+    header->records_len = cache->len - cache->start;
+    header->records_hash = hash_bytes(cache->buf + cache->len - header->records_len, header->records_len);
+    tmp = (char *)malloc(strlen(cache->path) + 16);
+    sprintf(tmp, "%s.%d", cache->path, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600)) == -1)
+    {
+        free(tmp);
+        return;
+    }
+    if (write(fd, cache->buf, cache->len) != (ssize_t)cache->len || rename(tmp, cache->path) == -1)
+        unlink(tmp);
+    close(fd);
+    free(tmp);
+}
+
+/*
+ * Start recording events for a trace file. The ring is mapped shared so
+ * children forked from now on record into it too until they exec.
+ */
+int trace_start(const char *path)
+{
+    static int registered;
+    size_t size = sizeof(trace_ring_t) + TRACE_EVENTS * sizeof(trace_event_t);
+    trace_ring_t *ring;
+
+    if (strlen(path) >= sizeof(ring->path))
+    {
+        fprintf(stderr, "set : %s : %s\n", path, strerror(ENAMETOOLONG));
+        return -1;
+    }
+    if ((ring = (trace_ring_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+    {
+        perror("trace");
+        return -1;
+    }
+    ring->mask = TRACE_EVENTS - 1;
+    ring->owner = getpid();
+    strcpy(ring->path, path);
+    trace_ring = ring;
+
+    /* Check now that the file can be written, not when the shell exits */
+    if (trace_flush() == -1)
+    {
+        munmap(ring, size);
+        trace_ring = NULL;
+        return -1;
+    }
+    if (!registered)
+    {
+        registered = 1;
+        atexit(trace_stop);
+    }
+    return 0;
+}
+
+/* Write the trace file and stop recording, only the shell that started the trace does */
+void trace_stop(void)
+{
+    if (trace_ring == NULL || trace_ring->owner != getpid())
+        return;
+    trace_flush();
+    munmap(trace_ring, sizeof(trace_ring_t) + TRACE_EVENTS * sizeof(trace_event_t));
+    trace_ring = NULL;
+}
+
+/* Record an event, pid and pgid are 0 for the shell itself */
+void trace_event(trace_kind_t kind, char phase, pid_t pid, pid_t pgid, int arg, const char *detail)
+{
+    uint64_t seq = __atomic_fetch_add(&trace_ring->head, 1, __ATOMIC_RELAXED);
+    trace_event_t *event = &trace_ring->events[seq & trace_ring->mask];
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    /* Readers skip the slot while it is written */
+    __atomic_store_n(&event->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    event->ns = now.tv_sec * 1000000000ull + now.tv_nsec;
+    event->pid = pid ? pid : trace_ring->owner;
+    event->pgid = pgid ? pgid : trace_ring->owner;
+    event->arg = arg;
+    event->kind = kind;
+    event->phase = phase;
+    event->detail[0] = '\0';
+    if (detail != NULL)
+        strncat(event->detail, detail, sizeof(event->detail) - 1);
+    __atomic_store_n(&event->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Write the events still in the ring as Chrome trace-event JSON. Each
+ * process group is a process of the trace and each pid a thread of it,
+ * the shell is the first one. Durations are B/E pairs, the rest instants.
+ */
+int trace_flush(void)
+{
+    FILE *out;
+    uint64_t head, seq, idx;
+    trace_event_t event, *slot;
+
+    if ((out = fopen(trace_ring->path, "w")) == NULL)
+    {
+        fprintf(stderr, "trace : %s : %s\n", trace_ring->path, strerror(errno));
+        return -1;
+    }
+    head = __atomic_load_n(&trace_ring->head, __ATOMIC_ACQUIRE);
+    idx = head > trace_ring->mask + 1 ? head - trace_ring->mask - 1 : 0;
+
+    fprintf(out, "{\"traceEvents\": [\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, "
+            "\"args\": {\"name\": \"mini_shell\"}}", (int)trace_ring->owner);
+    for (; idx < head; idx++)
+    {
+        /* Events still being written or already overwritten are left out */
+        slot = &trace_ring->events[idx & trace_ring->mask];
+        if ((seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE)) != idx + 1)
+            continue;
+        event = *slot;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        fprintf(out, ",\n{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %llu.%03llu, \"pid\": %d, \"tid\": %d",
+                trace_names[event.kind], event.phase, (unsigned long long)(event.ns / 1000),
+                (unsigned long long)(event.ns % 1000), event.pgid, event.pid);
+        if (event.phase == 'i')
+            fputs(", \"s\": \"t\"", out);
+        fputs(", \"args\": {", out);
+        if (trace_args[event.kind] != NULL && event.phase != 'B')
+            fprintf(out, "\"%s\": %d, ", trace_args[event.kind], event.arg);
+        fputs("\"detail\": ", out);
+        json_string(out, event.detail);
+        fputs("}}", out);
+
+        /* A job is named after its command line once it has a group */
+        if (event.kind == TRACE_LAUNCH && event.phase == 'E' && event.arg > 0)
+        {
+            fprintf(out, ",\n{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"args\": {\"name\": ", event.arg);
+            json_string(out, event.detail);
+            fputs("}}", out);
+        }
+    }
+    fputs("\n],\n\"displayTimeUnit\": \"ns\"}\n", out);
+    return fclose(out) == EOF ? -1 : 0;
+}
+
+/* Print a string as a JSON string literal */
+void json_string(FILE *out, const char *str)
+{
+    putc('"', out);
+    for (; *str != '\0'; str++)
+    {
+        if (*str == '"' || *str == '\\')
+            fprintf(out, "\\%c", *str);
+        else if ((unsigned char)*str < 0x20)
+            fprintf(out, "\\u%04x", (unsigned char)*str);
+        else
+            putc(*str, out);
+    }
+    putc('"', out);
+}
+
+/* Nanoseconds since begin */
+uint64_t elapsed_ns(struct timespec *begin)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - begin->tv_sec) * 1000000000ull + now.tv_nsec - begin->tv_nsec;
+}
+
+/* Count a latency in the bucket of its highest bit */
+void hist_record(latency_hist_t *hist, uint64_t ns)
+{
+    int bucket = ns == 0 ? 0 : 64 - __builtin_clzll(ns);
+
+    if (bucket >= LATENCY_BUCKETS)
+        bucket = LATENCY_BUCKETS - 1;
+    hist->buckets[bucket]++;
+    hist->count++;
+    hist->total_ns += ns;
+}
+
+/* Duration with the unit that keeps it short */
+char *format_ns(char *buf, size_t size, uint64_t ns)
+{
+    if (ns < 1000)
+        snprintf(buf, size, "%lluns", (unsigned long long)ns);
+    else if (ns < 1000000)
+        snprintf(buf, size, "%.4gus", ns / 1e3);
+    else if (ns < 1000000000)
+        snprintf(buf, size, "%.4gms", ns / 1e6);
+    else
+        snprintf(buf, size, "%.4gs", ns / 1e9);
+    return buf;
+}
+
+/* Print a histogram, one line per bucket in use, or as a JSON member */
+void print_hist(const char *name, latency_hist_t *hist, int json)
+{
+    int bucket, first = 1;
+    char low[16], high[16];
+
+    if (json)
+    {
+        printf("\"%s\": {\"count\": %lu, \"total_ns\": %llu, \"buckets\": [", name, hist->count,
+               (unsigned long long)hist->total_ns);
+        for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+        {
+            if (hist->buckets[bucket] == 0)
+                continue;
+            printf("%s{\"lt_ns\": %llu, \"count\": %lu}", first ? "" : ", ", 1ull << bucket, hist->buckets[bucket]);
+            first = 0;
+        }
+        printf("]}");
+        return;
+    }
+
+    printf("%s : %lu", name, hist->count);
+    if (hist->count > 0)
+        printf(", mean %s", format_ns(low, sizeof(low), hist->total_ns / hist->count));
+    putchar('\n');
+    for (bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+        if (hist->buckets[bucket] > 0)
+            printf("  %8s - %-8s %lu\n", format_ns(low, sizeof(low), bucket ? 1ull << (bucket - 1) : 0),
+                   format_ns(high, sizeof(high), 1ull << bucket), hist->buckets[bucket]);
+}
+
+/* stats [-j] : counters and latency histograms of the shell, -j prints them as JSON */
+int builtin_stats(int argc, char *argv[], shell_t *sh)
+{
+    int json = 0;
+    struct mallinfo2 info = mallinfo2();
+    shell_stats_t *st = &shell_stats;
+
+    if (argc == 2 && strcmp(argv[1], "-j") == 0)
+        json = 1;
+    else if (argc != 1)
+    {
+        fprintf(stderr, "Usage : stats [-j]\n");
+        return 2;
+    }
+
+    if (json)
+    {
+        printf("{\"parsed\": %lu, \"started\": %lu, \"exec_failures\": %lu, \"waits\": %lu, "
+               "\"jobs_created\": %lu, \"jobs_reaped\": %lu, \"jobs\": %lu, \"arena_bytes\": %zu, "
+               "\"malloc_bytes\": %zu, ", st->parsed, st->started, st->exec_failures, st->waits,
+               st->jobs_created, st->jobs_reaped, st->jobs_created - st->jobs_reaped, st->arena_bytes,
+               info.uordblks + info.hblkhd);
+        print_hist("parse", &st->parse, 1);
+        printf(", ");
+        print_hist("fork_exec", &st->fork_exec, 1);
+        printf(", ");
+        print_hist("prompt_to_prompt", &st->prompt, 1);
+        printf("}\n");
+        return 0;
+    }
+
+    printf("commands parsed     %lu\n", st->parsed);
+    printf("processes started   %lu\n", st->started);
+    printf("exec failures       %lu\n", st->exec_failures);
+    printf("waits               %lu\n", st->waits);
+    printf("jobs created        %lu\n", st->jobs_created);
+    printf("jobs reaped         %lu\n", st->jobs_reaped);
+    printf("jobs in list        %lu\n", st->jobs_created - st->jobs_reaped);
+    printf("arena bytes         %zu\n", st->arena_bytes);
+    printf("malloc bytes        %zu\n", info.uordblks + info.hblkhd);
+    print_hist("parse", &st->parse, 0);
+    print_hist("fork to exec", &st->fork_exec, 0);
+    print_hist("prompt to prompt", &st->prompt, 0);
+    return 0;
 }